@@ -1,16 +1,37 @@
 #include "AbstractSyntaxTree.h"
 #include "Driver.h"
+#include "Simplifier.h"
+#include "Library.h"
 #include <llvm/ADT/APFloat.h>
+#include <llvm/ADT/Hashing.h>
 #include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/SmallVector.h>
 #include <llvm/IR/Type.h>
 #include <llvm/IR/Function.h>
 #include <llvm/IR/BasicBlock.h>
 #include <llvm/IR/Verifier.h>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <functional>
 #include <iostream>
+#include <optional>
 
-unique_ptr<ExprAST> LogError(const string& Str) {
+string GradientFunctionName(const string& FunctionName) {
+  return "grad_" + FunctionName;
+}
+
+string DualFunctionName(const string& FunctionName) {
+  return "dual_" + FunctionName;
+}
+
+string BatchFunctionName(const string& FunctionName) {
+  return FunctionName + "_batch";
+}
+
+ExprIndex LogError(const string& Str) {
   std::cerr << Str << std::endl;
-  return nullptr;
+  return InvalidExpr;
 }
 
 unique_ptr<FunctionAST> LogErrorF(const string& Str) {
@@ -32,95 +53,395 @@ string PrototypeAST::getName() const {
   return this->mName;
 }
 
-Value *NumberExprAST::codegen(Driver& TheDriver,
+uint32_t ExprArena::InternSymbol(string_view Name) {
+  string Symbol(Name);
+  const auto [It, Inserted] = mSymbolIndices.try_emplace(Symbol, mSymbols.size());
+  if (Inserted) {
+    mSymbols.push_back(move(Symbol));
+  }
+  return It->second;
+}
+
+ExprIndex ExprArena::CreateNode(ExprKind Kind, BinaryOp Op, uint32_t Symbol,
+                                ArrayRef<ExprIndex> Operands) {
+  // Operands may point into mOperands itself, so copy them before appending.
+  const llvm::SmallVector<ExprIndex, 4> OperandsCopy(Operands.begin(),
+                                                     Operands.end());
+  // Return the existing node if an equal one has been created before.
+  const size_t Hash = llvm::hash_combine(
+    static_cast<uint8_t>(Kind), static_cast<uint8_t>(Op), Symbol,
+    llvm::hash_combine_range(OperandsCopy.begin(), OperandsCopy.end()));
+  const auto [First, Last] = mUniqueNodes.equal_range(Hash);
+  for (auto It = First; It != Last; ++It) {
+    const ExprNode& Node = mNodes[It->second];
+    if (Node.mKind == Kind && Node.mOperator == Op && Node.mSymbol == Symbol &&
+        getOperands(It->second) == ArrayRef<ExprIndex>(OperandsCopy))
+      return It->second;
+  }
+  const ExprNode Node{Kind, Op, static_cast<uint16_t>(OperandsCopy.size()),
+                      Symbol, static_cast<uint32_t>(mOperands.size())};
+  mOperands.insert(mOperands.end(), OperandsCopy.begin(), OperandsCopy.end());
+  mNodes.push_back(Node);
+  mUniqueNodes.emplace(Hash, mNodes.size() - 1);
+  return mNodes.size() - 1;
+}
+
+ExprIndex ExprArena::CreateNumber(double Val) {
+  uint64_t Bits;
+  std::memcpy(&Bits, &Val, sizeof(Bits));
+  const auto [It, Inserted] = mConstantIndices.try_emplace(Bits, mConstants.size());
+  if (Inserted) {
+    mConstants.push_back(Val);
+  }
+  return CreateNode(ExprKind::Number, BinaryOp::None, It->second, {});
+}
+
+ExprIndex ExprArena::CreateVariable(string_view Name) {
+  return CreateNode(ExprKind::Variable, BinaryOp::None, InternSymbol(Name), {});
+}
+
+ExprIndex ExprArena::CreateBinary(BinaryOp Op, ExprIndex LHS, ExprIndex RHS) {
+  return CreateNode(ExprKind::Binary, Op, 0, {LHS, RHS});
+}
+
+ExprIndex ExprArena::CreateCall(string_view Callee, ArrayRef<ExprIndex> Args) {
+  return CreateNode(ExprKind::Call, BinaryOp::None, InternSymbol(Callee), Args);
+}
+
+ExprIndex ExprArena::CreateIf(ExprIndex Cond, ExprIndex Then, ExprIndex Else) {
+  return CreateNode(ExprKind::If, BinaryOp::None, 0, {Cond, Then, Else});
+}
+
+ExprIndex ExprArena::CreateFor(string_view VarName, ExprIndex Start,
+                               ExprIndex End, ExprIndex Step, ExprIndex Body) {
+  return CreateNode(ExprKind::For, BinaryOp::None, InternSymbol(VarName),
+                    {Start, End, Step, Body});
+}
+
+void ExprArena::clear() {
+  mNodes.clear();
+  mOperands.clear();
+  mConstants.clear();
+  mSymbols.clear();
+  mSymbolIndices.clear();
+  mConstantIndices.clear();
+  mUniqueNodes.clear();
+  ClearValueCache();
+}
+
+vector<ExprIndex> ExprArena::CollectNodes(ExprIndex Root) const {
+  vector<bool> Visited(Root + 1, false);
+  vector<ExprIndex> Stack{Root};
+  vector<ExprIndex> Nodes;
+  while (!Stack.empty()) {
+    const ExprIndex Index = Stack.back();
+    Stack.pop_back();
+    if (Index == InvalidExpr || Visited[Index])
+      continue;
+    Visited[Index] = true;
+    Nodes.push_back(Index);
+    for (const ExprIndex Operand : getOperands(Index))
+      Stack.push_back(Operand);
+  }
+  return Nodes;
+}
+
+size_t ExprArena::CountNodes(ExprIndex Root) const {
+  return CollectNodes(Root).size();
+}
+
+uint64_t ExprArena::CountTreeNodes(ExprIndex Root) const {
+  // Operands are always created before their parents, so a single pass in
+  // index order sees every operand before it is used.
+  constexpr uint64_t Saturated = std::numeric_limits<uint64_t>::max();
+  vector<uint64_t> TreeSize(Root + 1, 0);
+  for (ExprIndex Index = 0; Index <= Root; ++Index) {
+    uint64_t Size = 1;
+    for (const ExprIndex Operand : getOperands(Index)) {
+      if (Operand == InvalidExpr)
+        continue;
+      Size = (TreeSize[Operand] > Saturated - Size) ? Saturated
+                                                    : Size + TreeSize[Operand];
+    }
+    TreeSize[Index] = Size;
+  }
+  return TreeSize[Root];
+}
+
+double ExprArena::SpeculationCost(ExprIndex Root) const {
+  double Cost = 0;
+  for (const ExprIndex Index : CollectNodes(Root)) {
+    switch (getKind(Index)) {
+      case ExprKind::Number:
+      case ExprKind::Variable:
+        break;
+      case ExprKind::Binary:
+        if (getOperator(Index) == BinaryOp::Assign)
+          return std::numeric_limits<double>::infinity();
+        if (getOperator(Index) == BinaryOp::Power && isNumber(getOperand(Index, 1))) {
+          Cost += GetPowerCost(getNumber(getOperand(Index, 1)));
+          break;
+        }
+        Cost += GetOperatorCost(getOperator(Index));
+        break;
+      case ExprKind::Call:
+        if (!ExternFunctionsMap.count(getName(Index)))
+          return std::numeric_limits<double>::infinity();
+        Cost += GetCallCost(getName(Index));
+        break;
+      case ExprKind::If:
+        Cost += 2.0;
+        break;
+      case ExprKind::For:
+        return std::numeric_limits<double>::infinity();
+    }
+  }
+  return Cost;
+}
+
+void ExprArena::ClearValueCache() {
+  mValueCache.clear();
+  mDualCache.clear();
+  mValueCacheLog.clear();
+}
+
+void ExprArena::RollbackValueCache(size_t Checkpoint) {
+  while (mValueCacheLog.size() > Checkpoint) {
+    mValueCache.erase(mValueCacheLog.back());
+    mDualCache.erase(mValueCacheLog.back());
+    mValueCacheLog.pop_back();
+  }
+}
+
+Value *ExprArena::codegen(ExprIndex Index,
+                          Driver& TheDriver,
+                          LLVMContext& TheContext,
+                          IRBuilder<>& Builder,
+                          Module& TheModule,
+                          map<string, AllocaInst*>& NamedValues) {
+  // A node shared by several parents is emitted only once.  The cached values
+  // are valid as long as they dominate the insertion point and no variable
+  // has been stored to since; codegenIf, codegenFor and '=' take care of
+  // dropping the entries that no longer hold.
+  const auto It = mValueCache.find(Index);
+  if (It != mValueCache.end())
+    return It->second;
+  Value *V = codegenNode(Index, TheDriver, TheContext, Builder, TheModule, NamedValues);
+  // '=' and loops have side effects and must be emitted every time.
+  const bool HasSideEffects = getKind(Index) == ExprKind::For ||
+    (getKind(Index) == ExprKind::Binary && getOperator(Index) == BinaryOp::Assign);
+  if (V && !HasSideEffects) {
+    mValueCache.emplace(Index, V);
+    mValueCacheLog.push_back(Index);
+  }
+  return V;
+}
+
+Value *ExprArena::codegenNode(ExprIndex Index,
+                              Driver& TheDriver,
                               LLVMContext& TheContext,
                               IRBuilder<>& Builder,
                               Module& TheModule,
                               map<string, AllocaInst*>& NamedValues) {
   using llvm::ConstantFP;
   using llvm::APFloat;
-  return ConstantFP::get(TheContext, APFloat(mValue));
+  switch (getKind(Index)) {
+    case ExprKind::Number:
+      return ConstantFP::get(TheContext, APFloat(getNumber(Index)));
+    case ExprKind::Variable: {
+      AllocaInst *A = NamedValues[getName(Index)];
+      if (!A)
+        return LogErrorV("Unknown variable name");
+      // Load the value.
+      return Builder.CreateLoad(A->getAllocatedType(), A, getName(Index).c_str());
+    }
+    case ExprKind::Binary:
+      return codegenBinary(Index, TheDriver, TheContext, Builder, TheModule, NamedValues);
+    case ExprKind::Call:
+      return codegenCall(Index, TheDriver, TheContext, Builder, TheModule, NamedValues);
+    case ExprKind::If:
+      return codegenIf(Index, TheDriver, TheContext, Builder, TheModule, NamedValues);
+    case ExprKind::For:
+      return codegenFor(Index, TheDriver, TheContext, Builder, TheModule, NamedValues);
+  }
+  return LogErrorV("invalid expression node");
+}
+
+// Emit Base^Exponent as LowerPower lowers it.  Constant integer exponents
+// become a chain of multiplications (by repeated squaring) that the
+// optimizer can see through, 0.5 a square root, and anything else a call of
+// pow.  The chains may round differently from pow in the last bits.
+static Value *CreatePower(Value *Base, Value *Exponent, Driver& TheDriver,
+                          IRBuilder<>& Builder) {
+  using llvm::ConstantFP;
+  struct Lowering {
+    Driver& mDriver;
+    IRBuilder<>& mBuilder;
+    llvm::Type *mType;
+    Value *Constant(double Val) { return ConstantFP::get(mType, Val); }
+    Value *Multiply(Value *L, Value *R) { return mBuilder.CreateFMul(L, R, "powtmp"); }
+    Value *Divide(Value *L, Value *R) { return mBuilder.CreateFDiv(L, R, "powtmp"); }
+    Value *PowerInteger(Value *Base, int32_t N) {
+      return mBuilder.CreateIntrinsic(llvm::Intrinsic::powi,
+                                      {mType, mBuilder.getInt32Ty()},
+                                      {Base, mBuilder.getInt32(N)},
+                                      nullptr, "powtmp");
+    }
+    Value *SquareRoot(Value *Base) {
+      // pow(-0, 0.5) is +0 and pow(-inf, 0.5) is +inf, where sqrt gives -0
+      // and NaN
+      Value *Root = mBuilder.CreateUnaryIntrinsic(llvm::Intrinsic::sqrt, Base, nullptr, "sqrttmp");
+      Root = mBuilder.CreateUnaryIntrinsic(llvm::Intrinsic::fabs, Root, nullptr, "fabstmp");
+      Value *Infinity = ConstantFP::getInfinity(mType);
+      Value *IsMinusInfinity = mBuilder.CreateFCmpOEQ(Base, ConstantFP::getInfinity(mType, true), "isinf");
+      return mBuilder.CreateSelect(IsMinusInfinity, Infinity, Root, "powtmp");
+    }
+    Value *Power(Value *Base, Value *Exponent) {
+      Function *CallPow = mDriver.getFunction("pow");
+      if (!CallPow)
+        return LogErrorV("unknown function referenced");
+      return mBuilder.CreateCall(CallPow, {Base, Exponent}, "powtmp");
+    }
+  };
+  Lowering TheLowering{TheDriver, Builder, Base->getType()};
+  std::optional<double> N;
+  if (const auto *C = llvm::dyn_cast<ConstantFP>(Exponent))
+    N = C->getValueAPF().convertToDouble();
+  return LowerPower(TheLowering, Base, Exponent, N);
+}
+
+// Emit the partial derivative of the library function Callee (a key of
+// ExternFunctionsMap) with respect to its argument I.  Args are the
+// arguments of the call and V its value.  fabs has the slope -1 below zero
+// and 1 elsewhere, as in LibraryPartial.
+static Value *CreateLibraryPartial(const string& Callee, ArrayRef<Value*> Args,
+                                   Value *V, size_t I, Driver& TheDriver,
+                                   IRBuilder<>& Builder) {
+  using llvm::ConstantFP;
+  Value *One = ConstantFP::get(V->getType(), 1.0);
+  auto Call = [&](const string& Name, Value *Arg) -> Value* {
+    Function *F = TheDriver.getFunction(Name);
+    if (!F)
+      return LogErrorV("unknown function referenced");
+    return Builder.CreateCall(F, {Arg}, "calltmp");
+  };
+  Value *X = Args[0];
+  if (Callee == "exp")
+    return V;
+  if (Callee == "log")
+    return Builder.CreateFDiv(One, X, "divtmp");
+  if (Callee == "sin")
+    return Call("cos", X);
+  if (Callee == "cos") {
+    Value *Sin = Call("sin", X);
+    return Sin ? Builder.CreateFNeg(Sin, "negtmp") : nullptr;
+  }
+  if (Callee == "tan")
+    return Builder.CreateFAdd(One, Builder.CreateFMul(V, V, "multmp"), "addtmp");
+  if (Callee == "asin" || Callee == "acos") {
+    // d(asin(x)) = 1 / sqrt(1 - x^2) = -d(acos(x))
+    Value *Root = Call("sqrt", Builder.CreateFSub(One, Builder.CreateFMul(X, X, "multmp"), "subtmp"));
+    if (!Root)
+      return nullptr;
+    Value *Sign = ConstantFP::get(V->getType(), Callee == "asin" ? 1.0 : -1.0);
+    return Builder.CreateFDiv(Sign, Root, "divtmp");
+  }
+  if (Callee == "atan")
+    return Builder.CreateFDiv(One, Builder.CreateFAdd(One, Builder.CreateFMul(X, X, "multmp"), "addtmp"), "divtmp");
+  if (Callee == "atan2") {
+    // d(atan2(y, x)) = (x * dy - y * dx) / (x^2 + y^2)
+    Value *Y = Args[0];
+    X = Args[1];
+    Value *Norm = Builder.CreateFAdd(Builder.CreateFMul(X, X, "multmp"),
+                                     Builder.CreateFMul(Y, Y, "multmp"), "addtmp");
+    return I == 0 ? Builder.CreateFDiv(X, Norm, "divtmp")
+                  : Builder.CreateFDiv(Builder.CreateFNeg(Y, "negtmp"), Norm, "divtmp");
+  }
+  if (Callee == "sqrt")
+    return Builder.CreateFDiv(ConstantFP::get(V->getType(), 0.5), V, "divtmp");
+  if (Callee == "fabs") {
+    Value *Negative = Builder.CreateFCmpULT(X, ConstantFP::get(V->getType(), 0.0), "cmptmp");
+    return Builder.CreateSelect(Negative, ConstantFP::get(V->getType(), -1.0), One, "signtmp");
+  }
+  if (Callee == "pow") {
+    // the rule of '^'
+    if (I == 1) {
+      Value *Log = Call("log", X);
+      return Log ? Builder.CreateFMul(V, Log, "multmp") : nullptr;
+    }
+    Value *Tmp = CreatePower(X, Builder.CreateFSub(Args[1], One, "subtmp"), TheDriver, Builder);
+    return Tmp ? Builder.CreateFMul(Tmp, Args[1], "multmp") : nullptr;
+  }
+  return LogErrorV("no derivative of the library function " + Callee);
 }
 
-Value *VariableExprAST::codegen(Driver& TheDriver,
+Value *ExprArena::codegenBinary(ExprIndex Index,
+                                Driver& TheDriver,
                                 LLVMContext& TheContext,
                                 IRBuilder<>& Builder,
                                 Module& TheModule,
                                 map<string, AllocaInst*>& NamedValues) {
-  Value *V = NamedValues[mName];
-  if (!V)
-    LogErrorV("Unknown variable name");
-  return V;
-}
-
-Value *BinaryExprAST::codegen(Driver& TheDriver,
-                              LLVMContext& TheContext,
-                              IRBuilder<>& Builder,
-                              Module& TheModule,
-                              map<string, AllocaInst*>& NamedValues) {
+  const BinaryOp Op = getOperator(Index);
+  const ExprIndex LHS = getOperand(Index, 0);
+  const ExprIndex RHS = getOperand(Index, 1);
   // Special case '=' because we don't want to emit the LHS as an expression.
-  if (mOperator == "=") {
-    VariableExprAST *LHSE = static_cast<VariableExprAST*>(mLHS.get());
-    if (!LHSE)
+  if (Op == BinaryOp::Assign) {
+    if (getKind(LHS) != ExprKind::Variable)
       return LogErrorV("destination of '=' must be a variable");
     // Codegen the RHS
-    Value *Val = mRHS->codegen(TheDriver, TheContext, Builder, TheModule, NamedValues);
+    Value *Val = codegen(RHS, TheDriver, TheContext, Builder, TheModule, NamedValues);
     if (!Val)
       return nullptr;
     // Look up the name
-    Value *Variable = NamedValues[LHSE->getVariable()];
+    AllocaInst *Variable = NamedValues[getName(LHS)];
     if (!Variable)
       return LogErrorV("Unknown variable name");
+    Builder.CreateStore(Val, Variable);
+    // loads of any variable emitted so far may be stale now
+    ClearValueCache();
     return Val;
   }
-  Value *L = mLHS->codegen(TheDriver, TheContext, Builder, TheModule, NamedValues);
-  Value *R = mRHS->codegen(TheDriver, TheContext, Builder, TheModule, NamedValues);
+  Value *L = codegen(LHS, TheDriver, TheContext, Builder, TheModule, NamedValues);
+  Value *R = codegen(RHS, TheDriver, TheContext, Builder, TheModule, NamedValues);
   if (!L || !R)
     return nullptr;
-  if (mOperator == "+") {
-    return Builder.CreateFAdd(L, R, "addtmp");
-  } else if (mOperator == "-") {
-    return Builder.CreateFSub(L, R, "subtmp");
-  } else if (mOperator == "*") {
-    return Builder.CreateFMul(L, R, "multmp");
-  } else if (mOperator == "/") {
-    return Builder.CreateFDiv(L, R, "divtmp");
-  } else if (mOperator == "^") {
-    Function *CallPow = TheDriver.getFunction("pow");
-    if (!CallPow)
-      return LogErrorV("unknown function referenced");
-    if (CallPow->arg_size() != 2) {
-      std::cerr << "Should be " << CallPow->arg_size() << " arguments\n";
-      return LogErrorV("incorrect # arguments passed");
-    }
-    vector<Value *> ArgsV;
-    ArgsV.push_back(L);
-    ArgsV.push_back(R);
-    return Builder.CreateCall(CallPow, ArgsV, "powtmp");
-  } else if (mOperator == "<") {
-    L = Builder.CreateFCmpULT(L, R, "cmptmp");
-    // Convert bool 0/1 to double 0.0 or 1.0
-    return Builder.CreateUIToFP(L, llvm::Type::getDoubleTy(TheContext), "booltmp");
-  } else {
-    return LogErrorV("invalid binary operator");
+  switch (Op) {
+    case BinaryOp::Add:
+      return Builder.CreateFAdd(L, R, "addtmp");
+    case BinaryOp::Subtract:
+      return Builder.CreateFSub(L, R, "subtmp");
+    case BinaryOp::Multiply:
+      return Builder.CreateFMul(L, R, "multmp");
+    case BinaryOp::Divide:
+      return Builder.CreateFDiv(L, R, "divtmp");
+    case BinaryOp::Power:
+      return CreatePower(L, R, TheDriver, Builder);
+    case BinaryOp::Less:
+      L = Builder.CreateFCmpULT(L, R, "cmptmp");
+      // Convert bool 0/1 to double 0.0 or 1.0
+      return Builder.CreateUIToFP(L, llvm::Type::getDoubleTy(TheContext), "booltmp");
+    default:
+      return LogErrorV("invalid binary operator");
   }
 }
 
-Value *CallExprAST::codegen(Driver& TheDriver,
-                            LLVMContext& TheContext,
-                            IRBuilder<>& Builder,
-                            Module& TheModule,
-                            map<string, AllocaInst*>& NamedValues) {
+Value *ExprArena::codegenCall(ExprIndex Index,
+                              Driver& TheDriver,
+                              LLVMContext& TheContext,
+                              IRBuilder<>& Builder,
+                              Module& TheModule,
+                              map<string, AllocaInst*>& NamedValues) {
   // Look up the name in the global module table.
-  Function *CalleeF = TheDriver.getFunction(mCallee);
+  Function *CalleeF = TheDriver.getFunction(getName(Index));
   if (!CalleeF)
     return LogErrorV("unknown function referenced");
+  const ArrayRef<ExprIndex> Arguments = getOperands(Index);
   // If argument mismatch error.
-  if (CalleeF->arg_size() != mArguments.size())
+  if (CalleeF->arg_size() != Arguments.size())
     return LogErrorV("incorrect # arguments passed");
   vector<Value *> ArgsV;
-  for (unsigned i = 0, e = mArguments.size(); i != e; ++i) {
-    ArgsV.push_back(mArguments[i]->codegen(TheDriver, TheContext, Builder, TheModule, NamedValues));
+  for (const ExprIndex Arg : Arguments) {
+    ArgsV.push_back(codegen(Arg, TheDriver, TheContext, Builder, TheModule, NamedValues));
     if (!ArgsV.back())
       return nullptr;
   }
@@ -144,7 +465,7 @@ Function *PrototypeAST::codegen(Driver& TheDriver,
   FunctionType *FT =
     FunctionType::get(Type::getDoubleTy(TheContext), Doubles, false);
   // Actually create the function
-  Function *F = 
+  Function *F =
     Function::Create(FT, Function::ExternalLinkage, mName, &TheModule);
   // Set names for all arguments.
   unsigned Idx = 0;
@@ -158,7 +479,6 @@ Function *FunctionAST::codegen(Driver& TheDriver,
                                LLVMContext& TheContext,
                                IRBuilder<>& Builder,
                                Module& TheModule,
-                               FunctionPassManager& FPM,
                                map<string, AllocaInst*>& NamedValues) {
   using llvm::Function;
   using llvm::BasicBlock;
@@ -182,13 +502,15 @@ Function *FunctionAST::codegen(Driver& TheDriver,
     // Add arguments to variable symbol table
     NamedValues[std::string(Arg.getName())] = Alloca;
   }
-  if (Value *RetVal = mBody->codegen(TheDriver, TheContext, Builder, TheModule, NamedValues)) {
+  mArena->ClearValueCache();
+  Value *RetVal = mArena->codegen(mBody, TheDriver, TheContext, Builder, TheModule, NamedValues);
+  // The cached values belong to this function only.
+  mArena->ClearValueCache();
+  if (RetVal) {
     // Finish off the function.
     Builder.CreateRet(RetVal);
     // Validate the generated code, checking for consistency.
     llvm::verifyFunction(*TheFunction);
-    // Run the optimizer on the function.
-    FPM.run(*TheFunction);
     return TheFunction;
   }
   // Error reading body, remove function.
@@ -196,107 +518,126 @@ Function *FunctionAST::codegen(Driver& TheDriver,
   return nullptr;
 }
 
-Value *ForExprAST::codegen(Driver &TheDriver, LLVMContext &TheContext,
-                           IRBuilder<> &Builder, Module &TheModule,
-                           map<string, AllocaInst*> &NamedValues) {
-  using llvm::PHINode;
+Value *ExprArena::codegenFor(ExprIndex Index,
+                             Driver& TheDriver,
+                             LLVMContext& TheContext,
+                             IRBuilder<>& Builder,
+                             Module& TheModule,
+                             map<string, AllocaInst*>& NamedValues) {
   using llvm::BasicBlock;
   using llvm::ConstantFP;
   using llvm::APFloat;
   using llvm::Constant;
   using llvm::AllocaInst;
-  // TODO: figure out what happen here
-  // TODO: figure out the old phi node code
+  const string& VarName = getName(Index);
+  const ExprIndex Start = getOperand(Index, 0);
+  const ExprIndex End = getOperand(Index, 1);
+  const ExprIndex Step = getOperand(Index, 2);
+  const ExprIndex Body = getOperand(Index, 3);
   Function *TheFunction = Builder.GetInsertBlock()->getParent();
   // Create an alloca for the variable in the entry block.
-  AllocaInst *Alloca = TheDriver.CreateEntryBlockAlloca(TheFunction, mVarName);
+  AllocaInst *Alloca = TheDriver.CreateEntryBlockAlloca(TheFunction, VarName);
   // Emit the start code first, without 'variable' in scope.
-  Value *StartVal = mStart->codegen(TheDriver, TheContext, Builder,
-                                    TheModule, NamedValues);
+  Value *StartVal = codegen(Start, TheDriver, TheContext, Builder,
+                            TheModule, NamedValues);
   if (!StartVal)
     return nullptr;
   Builder.CreateStore(StartVal, Alloca);
-//   BasicBlock *PreheaderBB = Builder.GetInsertBlock();
+  // Values emitted before the loop may refer to a variable the loop variable
+  // shadows, and values emitted inside it are tied to the loop variable, so
+  // the loop starts and ends with an empty cache.
+  ClearValueCache();
   BasicBlock *LoopBB = BasicBlock::Create(TheContext, "loop", TheFunction);
   // Insert an explicit fall through from the current block to the LoopBB.
   Builder.CreateBr(LoopBB);
   // Start insertion in LoopBB.
   Builder.SetInsertPoint(LoopBB);
-  // Start the PHI node with an entry for Start.
-//   PHINode *Variable = Builder.CreatePHI(llvm::Type::getDoubleTy(TheContext),
-//                                         2, mVarName.c_str());
-//   Variable->addIncoming(StartVal, PreheaderBB);
-  // Within the loop, the variable is defined equal to the PHI node.  If it
-  // shadows an existing variable, we have to restore it, so save it now.
   /*
-     Now the code starts to get more interesting. Our ‘for’ loop introduces a new 
-     variable to the symbol table. This means that our symbol table can now contain 
-     either function arguments or loop variables. To handle this, before we codegen 
-     the body of the loop, we add the loop variable as the current value for its 
-     name. Note that it is possible that there is a variable of the same name in the 
-     outer scope. It would be easy to make this an error (emit an error and return 
-     null if there is already an entry for VarName) but we choose to allow shadowing 
-     of variables. In order to handle this correctly, we remember the Value that we 
-     are potentially shadowing in OldVal (which will be null if there is no shadowed 
+     Now the code starts to get more interesting. Our ‘for’ loop introduces a new
+     variable to the symbol table. This means that our symbol table can now contain
+     either function arguments or loop variables. To handle this, before we codegen
+     the body of the loop, we add the loop variable as the current value for its
+     name. Note that it is possible that there is a variable of the same name in the
+     outer scope. It would be easy to make this an error (emit an error and return
+     null if there is already an entry for VarName) but we choose to allow shadowing
+     of variables. In order to handle this correctly, we remember the Value that we
+     are potentially shadowing in OldVal (which will be null if there is no shadowed
      variable).
   */
-//   Value *OldVal = NamedValues[mVarName];
-//   NamedValues[mVarName] = Variable;
-  AllocaInst *OldVal = NamedValues[mVarName];
-  NamedValues[mVarName] = Alloca;
+  AllocaInst *OldVal = NamedValues[VarName];
+  NamedValues[VarName] = Alloca;
   // Emit the body of the loop.  This, like any other expr, can change the
   // current BB.  Note that we ignore the value computed by the body, but don't
   // allow an error.
-  if (!mBody->codegen(TheDriver, TheContext, Builder, TheModule, NamedValues))
+  if (!codegen(Body, TheDriver, TheContext, Builder, TheModule, NamedValues))
     return nullptr;
   Value *StepVal = nullptr;
-  if (mStep) {
-    StepVal = mStep->codegen(TheDriver, TheContext, Builder, TheModule, NamedValues);
+  if (Step != InvalidExpr) {
+    StepVal = codegen(Step, TheDriver, TheContext, Builder, TheModule, NamedValues);
     if (!StepVal)
       return nullptr;
   } else {
     // If not specified, use 1.0.
     StepVal = ConstantFP::get(TheContext, APFloat(1.0));
   }
-//   Value *NextVar = Builder.CreateFAdd(Variable, StepVal, "nextvar");
   // Compute the end condition
-  Value *EndCond = mEnd->codegen(TheDriver, TheContext, Builder, TheModule, NamedValues);
+  Value *EndCond = codegen(End, TheDriver, TheContext, Builder, TheModule, NamedValues);
   if (!EndCond)
     return nullptr;
+  // Reload, increment, and restore the alloca.  This handles the case where
+  // the body of the loop mutates the variable.
+  Value *CurVar = Builder.CreateLoad(Alloca->getAllocatedType(), Alloca,
+                                     VarName.c_str());
+  Value *NextVar = Builder.CreateFAdd(CurVar, StepVal, "nextvar");
+  Builder.CreateStore(NextVar, Alloca);
   // Convert condition to a bool by comparing non-equal to 0.0.
   EndCond = Builder.CreateFCmpONE(
       EndCond, ConstantFP::get(TheContext, APFloat(0.0)), "loopcond");
   // Create the "after loop" block and insert it.
-//   BasicBlock *LoopEndBB = Builder.GetInsertBlock();
   BasicBlock *AfterBB =
       BasicBlock::Create(TheContext, "afterloop", TheFunction);
   // Insert the conditional branch into the end of LoopEndBB.
   Builder.CreateCondBr(EndCond, LoopBB, AfterBB);
   // Any new code will be inserted in AfterBB.
   Builder.SetInsertPoint(AfterBB);
-  // Add a new entry to the PHI node for the backedge.
-//   Variable->addIncoming(NextVar, LoopEndBB);
   // Restore the unshadowed variable.
   if (OldVal)
-    NamedValues[mVarName] = OldVal;
+    NamedValues[VarName] = OldVal;
   else
-    NamedValues.erase(mVarName);
+    NamedValues.erase(VarName);
+  ClearValueCache();
   // for expr always returns 0.0.
   return Constant::getNullValue(llvm::Type::getDoubleTy(TheContext));
 }
 
-Value *IfExprAST::codegen(Driver &TheDriver, LLVMContext &TheContext,
-                          IRBuilder<> &Builder, Module &TheModule,
-                          map<string, AllocaInst*> &NamedValues) {
+Value *ExprArena::codegenIf(ExprIndex Index,
+                            Driver& TheDriver,
+                            LLVMContext& TheContext,
+                            IRBuilder<>& Builder,
+                            Module& TheModule,
+                            map<string, AllocaInst*>& NamedValues) {
   using llvm::PHINode;
   using llvm::BasicBlock;
   using llvm::ConstantFP;
   using llvm::APFloat;
-  Value *CondV = mCond->codegen(TheDriver, TheContext, Builder, TheModule, NamedValues);
+  Value *CondV = codegen(getOperand(Index, 0), TheDriver, TheContext, Builder, TheModule, NamedValues);
   if (!CondV)
     return nullptr;
   // Convert condition to a bool by comparing non-equal to 0.0.
   CondV = Builder.CreateFCmpONE(CondV, ConstantFP::get(TheContext, APFloat(0.0)), "ifcond");
+  const ExprIndex Then = getOperand(Index, 1);
+  const ExprIndex Else = getOperand(Index, 2);
+  // Cheap arms without side effects are both evaluated and the result is
+  // picked with a select: no branch to mispredict, and the vectorizer can
+  // handle it.  Both arms are emitted in the current block, so their values
+  // stay valid in the cache.
+  if (SpeculationCost(Then) + SpeculationCost(Else) <= TheDriver.getSelectCost()) {
+    Value *ThenV = codegen(Then, TheDriver, TheContext, Builder, TheModule, NamedValues);
+    Value *ElseV = codegen(Else, TheDriver, TheContext, Builder, TheModule, NamedValues);
+    if (!ThenV || !ElseV)
+      return nullptr;
+    return Builder.CreateSelect(CondV, ThenV, ElseV, "iftmp");
+  }
   // Get the current function object
   Function *TheFunction = Builder.GetInsertBlock()->getParent();
   // Create blocks for the then and else cases.  Insert the 'then' block at the
@@ -305,11 +646,15 @@ Value *IfExprAST::codegen(Driver &TheDriver, LLVMContext &TheContext,
   BasicBlock *ElseBB = BasicBlock::Create(TheContext, "else");
   BasicBlock *MergeBB = BasicBlock::Create(TheContext, "ifcont");
   Builder.CreateCondBr(CondV, ThenBB, ElseBB);
+  // Values emitted in one branch dominate neither the other branch nor the
+  // merge block, so each branch drops its own cache entries when it ends.
+  const size_t CacheCheckpoint = mValueCacheLog.size();
   // change the insert point to the end of ThenBB
   Builder.SetInsertPoint(ThenBB);
-  Value *ThenV = mThen->codegen(TheDriver, TheContext, Builder, TheModule, NamedValues);
+  Value *ThenV = codegen(Then, TheDriver, TheContext, Builder, TheModule, NamedValues);
   if (!ThenV)
     return nullptr;
+  RollbackValueCache(CacheCheckpoint);
   // Create an unconditional branch to the merge block
   Builder.CreateBr(MergeBB);
   // Codegen of 'Then' can change the current block, update ThenBB for the PHI.
@@ -317,9 +662,10 @@ Value *IfExprAST::codegen(Driver &TheDriver, LLVMContext &TheContext,
   // Emit the else block.
   TheFunction->getBasicBlockList().push_back(ElseBB);
   Builder.SetInsertPoint(ElseBB);
-  Value *ElseV = mElse->codegen(TheDriver, TheContext, Builder, TheModule, NamedValues);
+  Value *ElseV = codegen(Else, TheDriver, TheContext, Builder, TheModule, NamedValues);
   if (!ElseV)
     return nullptr;
+  RollbackValueCache(CacheCheckpoint);
   Builder.CreateBr(MergeBB);
   // codegen of 'Else' can change the current block, update ElseBB for the PHI.
   ElseBB = Builder.GetInsertBlock();
@@ -332,226 +678,1048 @@ Value *IfExprAST::codegen(Driver &TheDriver, LLVMContext &TheContext,
   return PN;
 }
 
-unique_ptr<ExprAST> IfExprAST::clone() const {
-  return make_unique<IfExprAST>(mCond->clone(), mThen->clone(), mElse->clone());
-}
-
-unique_ptr<ExprAST> ForExprAST::clone() const {
-  return make_unique<ForExprAST>(mVarName, mStart->clone(), mEnd->clone(),
-                                 mStep->clone(), mBody->clone());
-}
-
-unique_ptr<ExprAST> NumberExprAST::clone() const {
-  return make_unique<NumberExprAST>(mValue);
-}
-
-unique_ptr<ExprAST> VariableExprAST::clone() const {
-  return make_unique<VariableExprAST>(mName);
-}
-
-unique_ptr<ExprAST> BinaryExprAST::clone() const {
-  return make_unique<BinaryExprAST>(mOperator, mLHS->clone(), mRHS->clone());
-}
-
-unique_ptr<ExprAST> CallExprAST::clone() const {
-  vector<unique_ptr<ExprAST>> NewArgs;
-  for (const auto& i : mArguments) {
-    NewArgs.emplace_back(i->clone());
-  }
-  return make_unique<CallExprAST>(mCallee, move(NewArgs));
-}
-
 unique_ptr<PrototypeAST> PrototypeAST::clone() const {
   return make_unique<PrototypeAST>(mName, mArguments);
 }
 
-unique_ptr<FunctionAST> FunctionAST::clone() const {
-  return make_unique<FunctionAST>(mPrototype->clone(), mBody->clone());
+void FunctionAST::Simplify(bool FastMath) {
+  mBody = Simplifier(*mArena, FastMath).Simplify(mBody);
 }
 
-unique_ptr<ExprAST> ExprAST::Derivative(Driver& TheDriver, const string& Variable) const {
-  return nullptr;
+unique_ptr<FunctionAST> FunctionAST::clone() const {
+  return make_unique<FunctionAST>(mPrototype->clone(), mArena, mBody);
 }
 
-unique_ptr<ExprAST> NumberExprAST::Derivative(Driver& TheDriver, const string& Variable) const {
-  return make_unique<NumberExprAST>(0.0);
+// The derivative nodes are appended to the same arena and refer to the
+// original nodes by index where the old code had to clone subtrees.
+ExprIndex ExprArena::Derivative(ExprIndex Index, Driver& TheDriver,
+                                const string& Variable) {
+  DerivativeMap Done;
+  return Derivative(Index, TheDriver, Variable, Done);
 }
 
-unique_ptr<ExprAST> VariableExprAST::Derivative(Driver& TheDriver, const string& Variable) const {
-  if (Variable == mName) {
-    return make_unique<NumberExprAST>(1.0);
-  } else {
-    return make_unique<NumberExprAST>(0.0);
+// Each node of the DAG is differentiated once; a shared subexpression gets
+// a shared derivative.
+ExprIndex ExprArena::Derivative(ExprIndex Index, Driver& TheDriver,
+                                const string& Variable, DerivativeMap& Done) {
+  const auto It = Done.find(Index);
+  if (It != Done.end())
+    return It->second;
+  ExprIndex Result = InvalidExpr;
+  switch (getKind(Index)) {
+    case ExprKind::Number:
+      Result = CreateNumber(0.0);
+      break;
+    case ExprKind::Variable:
+      Result = CreateNumber(Variable == getName(Index) ? 1.0 : 0.0);
+      break;
+    case ExprKind::Binary:
+      Result = DerivativeBinary(Index, TheDriver, Variable, Done);
+      break;
+    case ExprKind::Call:
+      Result = DerivativeCall(Index, TheDriver, Variable, Done);
+      break;
+    case ExprKind::If: {
+      const ExprIndex DerivativeThen = Derivative(getOperand(Index, 1), TheDriver, Variable, Done);
+      const ExprIndex DerivativeElse = Derivative(getOperand(Index, 2), TheDriver, Variable, Done);
+      if (DerivativeThen == InvalidExpr || DerivativeElse == InvalidExpr)
+        return InvalidExpr;
+      Result = CreateIf(getOperand(Index, 0), DerivativeThen, DerivativeElse);
+      break;
+    }
+    case ExprKind::For: {
+      // TODO: I am still not sure how to take the derivative of a for loop...
+      // just simply assume we can take the derivative of the body
+      const ExprIndex DerivativeBody = Derivative(getOperand(Index, 3), TheDriver, Variable, Done);
+      if (DerivativeBody == InvalidExpr)
+        return InvalidExpr;
+      // further assume Variable is not changed in Start, End and Step
+      Result = CreateFor(getName(Index), getOperand(Index, 0), getOperand(Index, 1),
+                         getOperand(Index, 2), DerivativeBody);
+      break;
+    }
   }
+  if (Result != InvalidExpr)
+    Done.emplace(Index, Result);
+  return Result;
 }
 
-unique_ptr<ExprAST> BinaryExprAST::Derivative(Driver& TheDriver, const string& Variable) const {
-  auto LHSDeriv = mLHS->clone()->Derivative(TheDriver, Variable);
-  auto RHSDeriv = mRHS->clone()->Derivative(TheDriver, Variable);
-  if (mOperator == "+" || mOperator == "-") {
+ExprIndex ExprArena::DerivativeBinary(ExprIndex Index, Driver& TheDriver,
+                                      const string& Variable, DerivativeMap& Done) {
+  const BinaryOp Op = getOperator(Index);
+  const ExprIndex LHS = getOperand(Index, 0);
+  const ExprIndex RHS = getOperand(Index, 1);
+  if (Op == BinaryOp::Less) {
+    return Index;
+  }
+  const ExprIndex LHSDeriv = Derivative(LHS, TheDriver, Variable, Done);
+  const ExprIndex RHSDeriv = Derivative(RHS, TheDriver, Variable, Done);
+  if (LHSDeriv == InvalidExpr || RHSDeriv == InvalidExpr)
+    return InvalidExpr;
+  switch (Op) {
+  case BinaryOp::Add:
+  case BinaryOp::Subtract: {
     // Derivative of "f(x) + g(x)" or "f(x) - g(x)"
     // = "f'(x) + g'(x)" or "f'(x) - g'(x)"
-#ifdef OPTIMIZE_DERIVATIVE
-    // Optimization for specific cases
-    if (mLHS->Type() == "NumberExprAST" &&
-        mRHS->Type() == "NumberExprAST") {
-      return make_unique<NumberExprAST>(0.0);
-    } else if (mLHS->Type() == "NumberExprAST") {
-      if (mOperator == "+") {
-        return move(RHSDeriv);
-      } else {
-        return make_unique<BinaryExprAST>("*", make_unique<NumberExprAST>(-1.0), move(RHSDeriv));
-      }
-    } else if (mRHS->Type() == "NumberExprAST") {
-      return move(LHSDeriv);
-    }
-#endif
-    return make_unique<BinaryExprAST>(mOperator, move(LHSDeriv), move(RHSDeriv));
-  } else if (mOperator == "*") {
+    return CreateBinary(Op, LHSDeriv, RHSDeriv);
+  }
+  case BinaryOp::Multiply: {
     // Derivative of "f(x) * g(x)"
     // = "f'(x) * g(x) + g'(x) * f(x)"
-#ifdef OPTIMIZE_DERIVATIVE
-    // Optimization for specific cases
-    if (mLHS->Type() == "NumberExprAST" &&
-        mRHS->Type() == "NumberExprAST") {
-      return make_unique<NumberExprAST>(0.0);
-    } else if (mLHS->Type() == "NumberExprAST") {
-      return make_unique<BinaryExprAST>("*", move(RHSDeriv), mLHS->clone());
-    } else if (mRHS->Type() == "NumberExprAST") {
-      return make_unique<BinaryExprAST>("*", move(LHSDeriv), mRHS->clone());
-    }
-#endif
-    auto NewLHS = make_unique<BinaryExprAST>("*", move(LHSDeriv), mRHS->clone());
-    auto NewRHS = make_unique<BinaryExprAST>("*", move(RHSDeriv), mLHS->clone());
-    return make_unique<BinaryExprAST>("+", move(NewLHS), move(NewRHS));
-  } else if (mOperator == "/") {
+    const ExprIndex NewLHS = CreateBinary(BinaryOp::Multiply, LHSDeriv, RHS);
+    const ExprIndex NewRHS = CreateBinary(BinaryOp::Multiply, RHSDeriv, LHS);
+    return CreateBinary(BinaryOp::Add, NewLHS, NewRHS);
+  }
+  case BinaryOp::Divide: {
     // Derivative of "f(x) / g(x)"
     // = "(f'(x) * g(x) - g'(x) * f(x)) / (g(x) * g(x))"
-#ifdef OPTIMIZE_DERIVATIVE
-    // Optimization for specific cases
-    if (mLHS->Type() == "NumberExprAST" &&
-        mRHS->Type() == "NumberExprAST") {
-      return make_unique<NumberExprAST>(0.0);
-    } else if (mLHS->Type() == "NumberExprAST") {
-      auto factor = make_unique<BinaryExprAST>("-", make_unique<NumberExprAST>(0.0), mLHS->clone());
-      auto Denominator = make_unique<BinaryExprAST>("*", mRHS->clone(), mRHS->clone());
-      auto NewLHS = make_unique<BinaryExprAST>("/", move(factor), move(Denominator));
-      return make_unique<BinaryExprAST>("*", move(NewLHS), move(RHSDeriv));
-    } else if (mRHS->Type() == "NumberExprAST") {
-      return make_unique<BinaryExprAST>("/", move(LHSDeriv), mRHS->clone());
-    }
-#endif
-    auto NumeratorLHS = make_unique<BinaryExprAST>("*", move(LHSDeriv), mRHS->clone());
-    auto NumeratorRHS = make_unique<BinaryExprAST>("*", move(RHSDeriv), mLHS->clone());
-    auto Numerator = make_unique<BinaryExprAST>("-", move(NumeratorLHS), move(NumeratorRHS));
-    auto Denominator = make_unique<BinaryExprAST>("*", mRHS->clone(), mRHS->clone());
-    return make_unique<BinaryExprAST>("/", move(Numerator), move(Denominator));
-  } else if (mOperator == "^") {
+    const ExprIndex NumeratorLHS = CreateBinary(BinaryOp::Multiply, LHSDeriv, RHS);
+    const ExprIndex NumeratorRHS = CreateBinary(BinaryOp::Multiply, RHSDeriv, LHS);
+    const ExprIndex Numerator = CreateBinary(BinaryOp::Subtract, NumeratorLHS, NumeratorRHS);
+    const ExprIndex Denominator = CreateBinary(BinaryOp::Multiply, RHS, RHS);
+    return CreateBinary(BinaryOp::Divide, Numerator, Denominator);
+  }
+  case BinaryOp::Power: {
     // Derivative of "f(x) ^ g(x)"
     // let y = f(x) ^ g(x), then ln(y) = g(x) * ln(f(x))
     // y'/y = g'(x) * ln(f(x)) + g(x) * (1/f(x)) * f'(x)
     // y' = (g'(x) * ln(f(x))  + g(x) * (1/f(x)) * f'(x)) * (f(x) ^ g(x))
-#ifdef OPTIMIZE_DERIVATIVE
-    // Optimization for specific cases
-    if (mLHS->Type() == "NumberExprAST" &&
-        mRHS->Type() == "NumberExprAST") {
-      return make_unique<NumberExprAST>(0.0);
-    } else if (mLHS->Type() == "NumberExprAST") {
-      vector<unique_ptr<ExprAST>> Args;
-      Args.push_back(mLHS->clone());
-      auto LogLHS = make_unique<CallExprAST>("log", move(Args));
-      auto NewLHS = make_unique<BinaryExprAST>("*", move(RHSDeriv), move(LogLHS));
-      return make_unique<BinaryExprAST>("*", move(NewLHS), this->clone());
-    } else if (mRHS->Type() == "NumberExprAST") {
-      auto NewExp = make_unique<BinaryExprAST>("-", mRHS->clone(), make_unique<NumberExprAST>(1.0));
-      auto NewLHS = make_unique<BinaryExprAST>("^", mLHS->clone(), move(NewExp));
-      NewLHS = make_unique<BinaryExprAST>("*", mRHS->clone(), move(NewLHS));
-      return make_unique<BinaryExprAST>("*", move(NewLHS), move(LHSDeriv));
-    }
-#endif
-    vector<unique_ptr<ExprAST>> Args;
-    Args.push_back(mLHS->clone());
-    auto LogLHS = make_unique<CallExprAST>("log", move(Args));
-    auto NewLHS = make_unique<BinaryExprAST>("*", move(RHSDeriv), move(LogLHS));
-    auto NewRHS = make_unique<BinaryExprAST>("*", move(LHSDeriv), mRHS->clone());
-    auto TmpRHSRightFactor = make_unique<BinaryExprAST>("/", make_unique<NumberExprAST>(1.0), mLHS->clone());
-    NewRHS = make_unique<BinaryExprAST>("*", move(NewRHS), move(TmpRHSRightFactor));
-    NewLHS = make_unique<BinaryExprAST>("+", move(NewLHS), move(NewRHS));
-    return make_unique<BinaryExprAST>("*", move(NewLHS), this->clone());
-  } else if (mOperator == "<") {
-    return this->clone();
-  } else {
-    std::cerr << "Unknown operator " << mOperator << std::endl;
-    return nullptr;
+    const ExprIndex LogLHS = CreateCall("log", {LHS});
+    ExprIndex NewLHS = CreateBinary(BinaryOp::Multiply, RHSDeriv, LogLHS);
+    ExprIndex NewRHS = CreateBinary(BinaryOp::Multiply, LHSDeriv, RHS);
+    const ExprIndex TmpRHSRightFactor = CreateBinary(BinaryOp::Divide, CreateNumber(1.0), LHS);
+    NewRHS = CreateBinary(BinaryOp::Multiply, NewRHS, TmpRHSRightFactor);
+    NewLHS = CreateBinary(BinaryOp::Add, NewLHS, NewRHS);
+    return CreateBinary(BinaryOp::Multiply, NewLHS, Index);
+  }
+  default:
+    std::cerr << "Unknown operator " << GetOperatorSpelling(Op) << std::endl;
+    return InvalidExpr;
   }
 }
 
-unique_ptr<ExprAST> CallExprAST::Derivative(Driver& TheDriver, const string& Variable) const {
+ExprIndex ExprArena::DerivativeCall(ExprIndex Index, Driver& TheDriver,
+                                    const string& Variable, DerivativeMap& Done) {
   // crazy code!
-  vector<unique_ptr<ExprAST>> mArgsDerivative;
-  for (const auto& i : mArguments) {
-    mArgsDerivative.push_back(i->Derivative(TheDriver, Variable));
+  const string Callee = getName(Index);
+  // copy the operands, creating nodes below may reallocate mOperands
+  const vector<ExprIndex> Arguments(getOperands(Index).begin(),
+                                    getOperands(Index).end());
+  vector<ExprIndex> ArgsDerivative;
+  for (const ExprIndex Arg : Arguments) {
+    ArgsDerivative.push_back(Derivative(Arg, TheDriver, Variable, Done));
+    if (ArgsDerivative.back() == InvalidExpr)
+      return InvalidExpr;
   }
   // find the function from the proto map
-  auto FI = TheDriver.mFunctionProtos.find(mCallee);
+  auto FI = TheDriver.mFunctionProtos.find(Callee);
   if (FI != TheDriver.mFunctionProtos.end()) {
     const vector<string> ArgNames = FI->second->getArgumentNames();
-    vector<unique_ptr<CallExprAST>> DerivativeCalls;
-    if (ArgNames.size() == mArguments.size()) {
+    vector<ExprIndex> DerivativeCalls;
+    if (ArgNames.size() == Arguments.size()) {
       for (size_t i = 0; i < ArgNames.size(); ++i) {
-        const string DerivativeFuncName = "d" + mCallee + "_d" + ArgNames[i];
-        auto dFI = TheDriver.mDerivativeFunctions.find(DerivativeFuncName);
-        if (dFI != TheDriver.mDerivativeFunctions.end()) {
-          vector<unique_ptr<ExprAST>> ArgumentsClone;
-          for (size_t j = 0; j < mArguments.size(); ++j) {
-            ArgumentsClone.push_back(mArguments[j]->clone());
-          }
-          DerivativeCalls.push_back(make_unique<CallExprAST>(DerivativeFuncName, move(ArgumentsClone)));
+        const string DerivativeFuncName = "d" + Callee + "_d" + ArgNames[i];
+        if (TheDriver.mGradientFunctions.count(Callee)) {
+          // the call shares the argument nodes of the original call
+          DerivativeCalls.push_back(CreateCall(DerivativeFuncName, Arguments));
+        } else if (ExternFunctionsMap.count(Callee)) {
+          DerivativeCalls.push_back(LibraryPartial(Callee, Arguments, i));
+          if (DerivativeCalls.back() == InvalidExpr)
+            return InvalidExpr;
         } else {
-          std::cerr << "Function " << DerivativeFuncName << " not found!\n";
-          // TODO: can we on-the-fly generate a derivative here?
-          return make_unique<NumberExprAST>(0.0);
+          return LogError("Function " + DerivativeFuncName + " not found");
         }
       }
-      // multiply DerivativeCalls and mArgsDerivative
+      // multiply DerivativeCalls and ArgsDerivative
       if (ArgNames.size() > 0) {
-        auto LHS = make_unique<BinaryExprAST>("*", move(DerivativeCalls[0]), move(mArgsDerivative[0]));
+        ExprIndex LHS = CreateBinary(BinaryOp::Multiply, DerivativeCalls[0], ArgsDerivative[0]);
         for (size_t i = 1; i < ArgNames.size(); ++i) {
-          auto RHS = make_unique<BinaryExprAST>("*", move(DerivativeCalls[i]), move(mArgsDerivative[i]));
-          LHS = make_unique<BinaryExprAST>("+", move(LHS), move(RHS));
+          const ExprIndex RHS = CreateBinary(BinaryOp::Multiply, DerivativeCalls[i], ArgsDerivative[i]);
+          LHS = CreateBinary(BinaryOp::Add, LHS, RHS);
         }
-        return move(LHS);
+        return LHS;
       }
     } else {
-      std::cerr << "Function args mismatch!\n";
+      return LogError("Function args mismatch");
     }
   } else {
-    std::cerr << "The function call " << mCallee << " not found!\n";
+    return LogError("The function call " + Callee + " not found");
   }
-  return make_unique<NumberExprAST>(0.0);
+  return CreateNumber(0.0);
 }
 
-unique_ptr<FunctionAST> FunctionAST::Derivative(Driver& TheDriver, 
+ExprIndex ExprArena::LibraryPartial(const string& Callee,
+                                    const vector<ExprIndex>& Arguments,
+                                    size_t I) {
+  const ExprIndex One = CreateNumber(1.0);
+  auto Square = [this](ExprIndex X) {
+    return CreateBinary(BinaryOp::Multiply, X, X);
+  };
+  ExprIndex X = Arguments[0];
+  if (Callee == "exp")
+    return CreateCall("exp", {X});
+  if (Callee == "log")
+    return CreateBinary(BinaryOp::Divide, One, X);
+  if (Callee == "sin")
+    return CreateCall("cos", {X});
+  if (Callee == "cos")
+    return CreateBinary(BinaryOp::Subtract, CreateNumber(0.0), CreateCall("sin", {X}));
+  if (Callee == "tan")
+    return CreateBinary(BinaryOp::Add, One, Square(CreateCall("tan", {X})));
+  if (Callee == "asin" || Callee == "acos") {
+    const ExprIndex Root = CreateCall("sqrt", {CreateBinary(BinaryOp::Subtract, One, Square(X))});
+    return CreateBinary(BinaryOp::Divide, CreateNumber(Callee == "asin" ? 1.0 : -1.0), Root);
+  }
+  if (Callee == "atan")
+    return CreateBinary(BinaryOp::Divide, One, CreateBinary(BinaryOp::Add, One, Square(X)));
+  if (Callee == "atan2") {
+    const ExprIndex Y = Arguments[0];
+    X = Arguments[1];
+    const ExprIndex Norm = CreateBinary(BinaryOp::Add, Square(X), Square(Y));
+    return I == 0 ? CreateBinary(BinaryOp::Divide, X, Norm)
+                  : CreateBinary(BinaryOp::Divide,
+                                 CreateBinary(BinaryOp::Subtract, CreateNumber(0.0), Y), Norm);
+  }
+  if (Callee == "sqrt")
+    return CreateBinary(BinaryOp::Divide, CreateNumber(0.5), CreateCall("sqrt", {X}));
+  if (Callee == "fabs")
+    return CreateIf(CreateBinary(BinaryOp::Less, X, CreateNumber(0.0)), CreateNumber(-1.0), One);
+  if (Callee == "pow") {
+    // the rule of '^'
+    if (I == 1)
+      return CreateBinary(BinaryOp::Multiply, CreateCall("pow", Arguments), CreateCall("log", {X}));
+    const ExprIndex Exponent = CreateBinary(BinaryOp::Subtract, Arguments[1], One);
+    return CreateBinary(BinaryOp::Multiply, CreateCall("pow", {X, Exponent}), Arguments[1]);
+  }
+  return LogError("no derivative of the library function " + Callee);
+}
+
+unique_ptr<FunctionAST> FunctionAST::Derivative(Driver& TheDriver,
                                                 const string& Variable,
                                                 const string& FunctionName) const {
-  auto Derivative = mBody->Derivative(TheDriver, Variable);
+  const ExprIndex Derivative = mArena->Derivative(mBody, TheDriver, Variable);
+  if (Derivative == InvalidExpr)
+    return nullptr;
   auto DerivativePrototype = make_unique<PrototypeAST>(FunctionName, mPrototype->getArgumentNames());
-  return make_unique<FunctionAST>(move(DerivativePrototype), move(Derivative));
+  return make_unique<FunctionAST>(move(DerivativePrototype), mArena, Derivative);
+}
+
+// Reverse-mode differentiation.  The forward pass is the ordinary codegen of
+// the body; the reverse pass then visits the nodes in decreasing index order,
+// which is a topological order of the DAG since operands are always created
+// before their users, and pushes each node's adjoint to its operands.  The
+// branches of an if are swept in their own blocks, and the adjoints they
+// change are merged with phi nodes.
+bool ExprArena::codegenAdjoints(ExprIndex Root, Value *Seed,
+                                vector<bool>& InScope, AdjointMap& Adjoints,
+                                Driver& TheDriver, LLVMContext& TheContext,
+                                IRBuilder<>& Builder, Module& TheModule,
+                                map<string, AllocaInst*>& NamedValues) {
+  using llvm::ConstantFP;
+  using llvm::APFloat;
+  using llvm::BasicBlock;
+  using llvm::PHINode;
+  // Collect the nodes of this region.  Comparisons and loops have a zero
+  // derivative, and the branches of an if are regions of their own.
+  vector<ExprIndex> Region;
+  vector<ExprIndex> Stack{Root};
+  while (!Stack.empty()) {
+    const ExprIndex Index = Stack.back();
+    Stack.pop_back();
+    if (InScope[Index])
+      continue;
+    InScope[Index] = true;
+    Region.push_back(Index);
+    if ((getKind(Index) == ExprKind::Binary && getOperator(Index) != BinaryOp::Less) ||
+        getKind(Index) == ExprKind::Call) {
+      for (const ExprIndex Operand : getOperands(Index))
+        Stack.push_back(Operand);
+    }
+  }
+  std::sort(Region.begin(), Region.end(), std::greater<ExprIndex>());
+  auto Accumulate = [&](ExprIndex Index, Value *Contribution) {
+    const auto [It, Inserted] = Adjoints.try_emplace(Index, Contribution);
+    if (!Inserted)
+      It->second = Builder.CreateFAdd(It->second, Contribution, "adjtmp");
+  };
+  auto Forward = [&](ExprIndex Index) {
+    return codegen(Index, TheDriver, TheContext, Builder, TheModule, NamedValues);
+  };
+  Accumulate(Root, Seed);
+  bool Success = true;
+  for (const ExprIndex Index : Region) {
+    const auto It = Adjoints.find(Index);
+    if (It == Adjoints.end())
+      continue;
+    Value *Adjoint = It->second;
+    if (getKind(Index) == ExprKind::Binary) {
+      const BinaryOp Op = getOperator(Index);
+      const ExprIndex LHS = getOperand(Index, 0);
+      const ExprIndex RHS = getOperand(Index, 1);
+      // constants have no adjoint, don't emit code for them
+      const bool NeedLHS = !isNumber(LHS);
+      const bool NeedRHS = !isNumber(RHS);
+      switch (Op) {
+        case BinaryOp::Add:
+          if (NeedLHS) Accumulate(LHS, Adjoint);
+          if (NeedRHS) Accumulate(RHS, Adjoint);
+          break;
+        case BinaryOp::Subtract:
+          if (NeedLHS) Accumulate(LHS, Adjoint);
+          if (NeedRHS) Accumulate(RHS, Builder.CreateFNeg(Adjoint, "negtmp"));
+          break;
+        case BinaryOp::Multiply: {
+          Value *L = Forward(LHS);
+          Value *R = Forward(RHS);
+          if (!L || !R)
+            return false;
+          if (NeedLHS) Accumulate(LHS, Builder.CreateFMul(Adjoint, R, "multmp"));
+          if (NeedRHS) Accumulate(RHS, Builder.CreateFMul(Adjoint, L, "multmp"));
+          break;
+        }
+        case BinaryOp::Divide: {
+          // d(L/R) = dL / R - (L/R) * dR / R
+          Value *R = Forward(RHS);
+          Value *V = Forward(Index);
+          if (!R || !V)
+            return false;
+          if (NeedLHS) Accumulate(LHS, Builder.CreateFDiv(Adjoint, R, "divtmp"));
+          if (NeedRHS) {
+            Value *Tmp = Builder.CreateFMul(Adjoint, V, "multmp");
+            Tmp = Builder.CreateFDiv(Tmp, R, "divtmp");
+            Accumulate(RHS, Builder.CreateFNeg(Tmp, "negtmp"));
+          }
+          break;
+        }
+        case BinaryOp::Power: {
+          // d(L^R) = R * L^(R-1) * dL + L^R * log(L) * dR
+          Value *L = Forward(LHS);
+          Value *R = Forward(RHS);
+          if (!L || !R)
+            return false;
+          if (NeedLHS) {
+            Value *Exponent = Builder.CreateFSub(R, ConstantFP::get(TheContext, APFloat(1.0)), "subtmp");
+            Value *Tmp = CreatePower(L, Exponent, TheDriver, Builder);
+            if (!Tmp)
+              return false;
+            Tmp = Builder.CreateFMul(Tmp, R, "multmp");
+            Accumulate(LHS, Builder.CreateFMul(Adjoint, Tmp, "multmp"));
+          }
+          if (NeedRHS) {
+            Function *CallLog = TheDriver.getFunction("log");
+            Value *V = Forward(Index);
+            if (!CallLog || !V) {
+              LogError("unknown function referenced");
+              return false;
+            }
+            Value *Tmp = Builder.CreateCall(CallLog, {L}, "logtmp");
+            Tmp = Builder.CreateFMul(V, Tmp, "multmp");
+            Accumulate(RHS, Builder.CreateFMul(Adjoint, Tmp, "multmp"));
+          }
+          break;
+        }
+        default:
+          break;
+      }
+    } else if (getKind(Index) == ExprKind::Call) {
+      // the partial derivatives of a call come from the callee's gradient,
+      // or from the rules of the library functions
+      const string Callee = getName(Index);
+      const vector<ExprIndex> Arguments(getOperands(Index).begin(),
+                                        getOperands(Index).end());
+      if (!TheDriver.mGradientFunctions.count(Callee) && ExternFunctionsMap.count(Callee)) {
+        vector<Value *> ArgsV;
+        for (const ExprIndex Arg : Arguments) {
+          ArgsV.push_back(Forward(Arg));
+          if (!ArgsV.back())
+            return false;
+        }
+        Value *V = Forward(Index);
+        if (!V)
+          return false;
+        for (size_t i = 0; i < Arguments.size(); ++i) {
+          if (isNumber(Arguments[i]))
+            continue;
+          Value *Partial = CreateLibraryPartial(Callee, ArgsV, V, i, TheDriver, Builder);
+          if (!Partial)
+            return false;
+          Accumulate(Arguments[i], Builder.CreateFMul(Adjoint, Partial, "multmp"));
+        }
+        continue;
+      }
+      if (!TheDriver.mGradientFunctions.count(Callee)) {
+        LogError("Function " + GradientFunctionName(Callee) + " not found");
+        return false;
+      }
+      Function *GradF = TheDriver.getGradientFunction(Callee);
+      if (!GradF || GradF->arg_size() != Arguments.size() + 1) {
+        LogError("incorrect # arguments passed");
+        return false;
+      }
+      vector<Value *> ArgsV;
+      for (const ExprIndex Arg : Arguments) {
+        ArgsV.push_back(Forward(Arg));
+        if (!ArgsV.back())
+          return false;
+      }
+      Function *TheFunction = Builder.GetInsertBlock()->getParent();
+      IRBuilder<> TmpB(&TheFunction->getEntryBlock(),
+                       TheFunction->getEntryBlock().begin());
+      llvm::Type *DoubleTy = llvm::Type::getDoubleTy(TheContext);
+      AllocaInst *Partials = TmpB.CreateAlloca(DoubleTy, TmpB.getInt32(Arguments.size()), "partials");
+      ArgsV.push_back(Partials);
+      Builder.CreateCall(GradF, ArgsV);
+      for (size_t i = 0; i < Arguments.size(); ++i) {
+        if (isNumber(Arguments[i]))
+          continue;
+        Value *Ptr = Builder.CreateConstInBoundsGEP1_64(DoubleTy, Partials, i);
+        Value *Partial = Builder.CreateLoad(DoubleTy, Ptr, "partial");
+        Accumulate(Arguments[i], Builder.CreateFMul(Adjoint, Partial, "multmp"));
+      }
+    } else if (getKind(Index) == ExprKind::If) {
+      Value *CondV = Forward(getOperand(Index, 0));
+      if (!CondV)
+        return false;
+      CondV = Builder.CreateFCmpONE(CondV, ConstantFP::get(TheContext, APFloat(0.0)), "ifcond");
+      Function *TheFunction = Builder.GetInsertBlock()->getParent();
+      BasicBlock *ThenBB = BasicBlock::Create(TheContext, "then.adj", TheFunction);
+      BasicBlock *ElseBB = BasicBlock::Create(TheContext, "else.adj", TheFunction);
+      BasicBlock *MergeBB = BasicBlock::Create(TheContext, "ifcont.adj", TheFunction);
+      Builder.CreateCondBr(CondV, ThenBB, ElseBB);
+      const size_t CacheCheckpoint = mValueCacheLog.size();
+      AdjointMap ThenAdjoints = Adjoints;
+      AdjointMap ElseAdjoints = Adjoints;
+      Builder.SetInsertPoint(ThenBB);
+      Success = codegenAdjoints(getOperand(Index, 1), Adjoint, InScope, ThenAdjoints,
+                                TheDriver, TheContext, Builder, TheModule, NamedValues);
+      RollbackValueCache(CacheCheckpoint);
+      Builder.CreateBr(MergeBB);
+      ThenBB = Builder.GetInsertBlock();
+      Builder.SetInsertPoint(ElseBB);
+      Success = Success &&
+        codegenAdjoints(getOperand(Index, 2), Adjoint, InScope, ElseAdjoints,
+                        TheDriver, TheContext, Builder, TheModule, NamedValues);
+      RollbackValueCache(CacheCheckpoint);
+      Builder.CreateBr(MergeBB);
+      ElseBB = Builder.GetInsertBlock();
+      Builder.SetInsertPoint(MergeBB);
+      if (!Success)
+        return false;
+      // Merge the adjoints of the enclosing nodes that either branch changed.
+      // The branch-local entries are no longer in scope.
+      Value *Zero = ConstantFP::get(TheContext, APFloat(0.0));
+      auto Lookup = [Zero](const AdjointMap& Map, ExprIndex Key) {
+        const auto Found = Map.find(Key);
+        return Found == Map.end() ? Zero : Found->second;
+      };
+      vector<ExprIndex> Changed;
+      for (const auto& Entry : ThenAdjoints)
+        Changed.push_back(Entry.first);
+      for (const auto& Entry : ElseAdjoints)
+        Changed.push_back(Entry.first);
+      std::sort(Changed.begin(), Changed.end());
+      Changed.erase(std::unique(Changed.begin(), Changed.end()), Changed.end());
+      for (const ExprIndex Key : Changed) {
+        if (!InScope[Key])
+          continue;
+        Value *ThenV = Lookup(ThenAdjoints, Key);
+        Value *ElseV = Lookup(ElseAdjoints, Key);
+        if (ThenV == ElseV)
+          continue;
+        PHINode *PN = Builder.CreatePHI(llvm::Type::getDoubleTy(TheContext), 2, "adjtmp");
+        PN->addIncoming(ThenV, ThenBB);
+        PN->addIncoming(ElseV, ElseBB);
+        Adjoints[Key] = PN;
+      }
+    }
+  }
+  // The nodes of this region go out of scope with it.
+  for (const ExprIndex Index : Region)
+    InScope[Index] = false;
+  return Success;
+}
+
+Function *FunctionAST::codegenGradient(Driver& TheDriver,
+                                       LLVMContext& TheContext,
+                                       IRBuilder<>& Builder,
+                                       Module& TheModule,
+                                       map<string, AllocaInst*>& NamedValues) {
+  using llvm::Type;
+  using llvm::FunctionType;
+  using llvm::BasicBlock;
+  using llvm::ConstantFP;
+  using llvm::APFloat;
+  const vector<ExprIndex> Nodes = mArena->CollectNodes(mBody);
+  for (const ExprIndex Index : Nodes) {
+    if (mArena->getKind(Index) == ExprKind::Binary &&
+        mArena->getOperator(Index) == BinaryOp::Assign) {
+      LogError("cannot differentiate a function with '='");
+      return nullptr;
+    }
+  }
+  // double grad_f(double, ..., double*)
+  const vector<string> ArgNames = mPrototype->getArgumentNames();
+  vector<Type*> ArgTypes(ArgNames.size(), Type::getDoubleTy(TheContext));
+  ArgTypes.push_back(Type::getDoublePtrTy(TheContext));
+  FunctionType *FT = FunctionType::get(Type::getDoubleTy(TheContext), ArgTypes, false);
+  Function *TheFunction = Function::Create(FT, Function::ExternalLinkage,
+                                           GradientFunctionName(getName()), &TheModule);
+  BasicBlock *BB = BasicBlock::Create(TheContext, "entry", TheFunction);
+  Builder.SetInsertPoint(BB);
+  NamedValues.clear();
+  // Name all arguments before creating the allocas, which would otherwise
+  // take the names of later arguments.
+  for (size_t i = 0; i < ArgNames.size(); ++i) {
+    TheFunction->getArg(i)->setName(ArgNames[i]);
+  }
+  Value *Out = TheFunction->getArg(ArgNames.size());
+  Out->setName("out");
+  for (size_t i = 0; i < ArgNames.size(); ++i) {
+    AllocaInst *Alloca = TheDriver.CreateEntryBlockAlloca(TheFunction, ArgNames[i]);
+    Builder.CreateStore(TheFunction->getArg(i), Alloca);
+    NamedValues[ArgNames[i]] = Alloca;
+  }
+  // Forward pass
+  mArena->ClearValueCache();
+  Value *RetVal = mArena->codegen(mBody, TheDriver, TheContext, Builder, TheModule, NamedValues);
+  // Reverse pass.  Variables stay in scope throughout so that the branches
+  // report their contributions back.
+  vector<bool> InScope(mArena->size(), false);
+  map<string, ExprIndex> Variables;
+  for (const ExprIndex Index : Nodes) {
+    if (mArena->getKind(Index) == ExprKind::Variable) {
+      InScope[Index] = true;
+      Variables[mArena->getName(Index)] = Index;
+    }
+  }
+  ExprArena::AdjointMap Adjoints;
+  const bool Success = RetVal &&
+    mArena->codegenAdjoints(mBody, ConstantFP::get(TheContext, APFloat(1.0)),
+                            InScope, Adjoints, TheDriver, TheContext, Builder,
+                            TheModule, NamedValues);
+  mArena->ClearValueCache();
+  if (!Success) {
+    TheFunction->eraseFromParent();
+    return nullptr;
+  }
+  for (size_t i = 0; i < ArgNames.size(); ++i) {
+    Value *Partial = ConstantFP::get(TheContext, APFloat(0.0));
+    const auto Var = Variables.find(ArgNames[i]);
+    if (Var != Variables.end() && Adjoints.count(Var->second))
+      Partial = Adjoints[Var->second];
+    Value *Ptr = Builder.CreateConstInBoundsGEP1_64(Type::getDoubleTy(TheContext), Out, i);
+    Builder.CreateStore(Partial, Ptr);
+  }
+  Builder.CreateRet(RetVal);
+  llvm::verifyFunction(*TheFunction);
+  return TheFunction;
 }
 
+// Forward-mode differentiation.  Every node is emitted as a (value, tangent)
+// pair, so the value and the directional derivative of the function come out
+// of a single pass in which the intermediates are computed once.  Unlike the
+// reverse sweep this handles '=' and loops: each variable carries its
+// tangent in an alloca next to its value.
+DualValue ExprArena::codegenDual(ExprIndex Index,
+                                 Driver& TheDriver,
+                                 LLVMContext& TheContext,
+                                 IRBuilder<>& Builder,
+                                 Module& TheModule,
+                                 map<string, AllocaInst*>& NamedValues,
+                                 map<string, AllocaInst*>& NamedTangents) {
+  // the caching rules are those of codegen
+  const auto It = mDualCache.find(Index);
+  if (It != mDualCache.end())
+    return It->second;
+  const DualValue D = codegenDualNode(Index, TheDriver, TheContext, Builder,
+                                      TheModule, NamedValues, NamedTangents);
+  const bool HasSideEffects = getKind(Index) == ExprKind::For ||
+    (getKind(Index) == ExprKind::Binary && getOperator(Index) == BinaryOp::Assign);
+  if (D.mValue && !HasSideEffects) {
+    mDualCache.emplace(Index, D);
+    mValueCacheLog.push_back(Index);
+  }
+  return D;
+}
+
+// A known-zero tangent is null; this turns it into a value where one is
+// needed (phis, stores and call arguments).
+static Value *MaterializeTangent(Value *Tangent, LLVMContext& TheContext) {
+  if (Tangent)
+    return Tangent;
+  return llvm::ConstantFP::get(TheContext, llvm::APFloat(0.0));
+}
 
+DualValue ExprArena::codegenDualNode(ExprIndex Index,
+                                     Driver& TheDriver,
+                                     LLVMContext& TheContext,
+                                     IRBuilder<>& Builder,
+                                     Module& TheModule,
+                                     map<string, AllocaInst*>& NamedValues,
+                                     map<string, AllocaInst*>& NamedTangents) {
+  using llvm::ConstantFP;
+  using llvm::APFloat;
+  switch (getKind(Index)) {
+    case ExprKind::Number:
+      return {ConstantFP::get(TheContext, APFloat(getNumber(Index))), nullptr};
+    case ExprKind::Variable: {
+      AllocaInst *A = NamedValues[getName(Index)];
+      AllocaInst *T = NamedTangents[getName(Index)];
+      if (!A || !T) {
+        LogError("Unknown variable name");
+        return {};
+      }
+      const string TangentName = "d" + getName(Index);
+      return {Builder.CreateLoad(A->getAllocatedType(), A, getName(Index).c_str()),
+              Builder.CreateLoad(T->getAllocatedType(), T, TangentName.c_str())};
+    }
+    case ExprKind::Binary:
+      return codegenDualBinary(Index, TheDriver, TheContext, Builder, TheModule, NamedValues, NamedTangents);
+    case ExprKind::Call:
+      return codegenDualCall(Index, TheDriver, TheContext, Builder, TheModule, NamedValues, NamedTangents);
+    case ExprKind::If:
+      return codegenDualIf(Index, TheDriver, TheContext, Builder, TheModule, NamedValues, NamedTangents);
+    case ExprKind::For:
+      return codegenDualFor(Index, TheDriver, TheContext, Builder, TheModule, NamedValues, NamedTangents);
+  }
+  LogError("invalid expression node");
+  return {};
+}
 
-unique_ptr<ExprAST> IfExprAST::Derivative(Driver& TheDriver, const string &Variable) const {
-  auto DerivativeThen = mThen->Derivative(TheDriver, Variable);
-  auto DerivativeElse = mElse->Derivative(TheDriver, Variable);
-  return make_unique<IfExprAST>(mCond->clone(), move(DerivativeThen), move(DerivativeElse));
+DualValue ExprArena::codegenDualBinary(ExprIndex Index,
+                                       Driver& TheDriver,
+                                       LLVMContext& TheContext,
+                                       IRBuilder<>& Builder,
+                                       Module& TheModule,
+                                       map<string, AllocaInst*>& NamedValues,
+                                       map<string, AllocaInst*>& NamedTangents) {
+  using llvm::ConstantFP;
+  using llvm::APFloat;
+  const BinaryOp Op = getOperator(Index);
+  const ExprIndex LHS = getOperand(Index, 0);
+  const ExprIndex RHS = getOperand(Index, 1);
+  if (Op == BinaryOp::Assign) {
+    if (getKind(LHS) != ExprKind::Variable) {
+      LogError("destination of '=' must be a variable");
+      return {};
+    }
+    const DualValue Val = codegenDual(RHS, TheDriver, TheContext, Builder,
+                                      TheModule, NamedValues, NamedTangents);
+    if (!Val.mValue)
+      return {};
+    AllocaInst *Variable = NamedValues[getName(LHS)];
+    AllocaInst *Tangent = NamedTangents[getName(LHS)];
+    if (!Variable || !Tangent) {
+      LogError("Unknown variable name");
+      return {};
+    }
+    Builder.CreateStore(Val.mValue, Variable);
+    Builder.CreateStore(MaterializeTangent(Val.mTangent, TheContext), Tangent);
+    ClearValueCache();
+    return Val;
+  }
+  const DualValue L = codegenDual(LHS, TheDriver, TheContext, Builder,
+                                  TheModule, NamedValues, NamedTangents);
+  const DualValue R = codegenDual(RHS, TheDriver, TheContext, Builder,
+                                  TheModule, NamedValues, NamedTangents);
+  if (!L.mValue || !R.mValue)
+    return {};
+  // arithmetic on tangents that may be known zeros
+  auto Add = [&](Value *A, Value *B) -> Value* {
+    if (!A) return B;
+    if (!B) return A;
+    return Builder.CreateFAdd(A, B, "dtmp");
+  };
+  auto Mul = [&](Value *Tangent, Value *Factor) -> Value* {
+    if (!Tangent) return nullptr;
+    return Builder.CreateFMul(Tangent, Factor, "dtmp");
+  };
+  switch (Op) {
+    case BinaryOp::Add:
+      return {Builder.CreateFAdd(L.mValue, R.mValue, "addtmp"),
+              Add(L.mTangent, R.mTangent)};
+    case BinaryOp::Subtract: {
+      Value *Tangent = L.mTangent;
+      if (R.mTangent) {
+        Tangent = L.mTangent ? Builder.CreateFSub(L.mTangent, R.mTangent, "dtmp")
+                             : Builder.CreateFNeg(R.mTangent, "dtmp");
+      }
+      return {Builder.CreateFSub(L.mValue, R.mValue, "subtmp"), Tangent};
+    }
+    case BinaryOp::Multiply:
+      // d(L*R) = dL * R + dR * L
+      return {Builder.CreateFMul(L.mValue, R.mValue, "multmp"),
+              Add(Mul(L.mTangent, R.mValue), Mul(R.mTangent, L.mValue))};
+    case BinaryOp::Divide: {
+      // d(L/R) = (dL - (L/R) * dR) / R
+      Value *V = Builder.CreateFDiv(L.mValue, R.mValue, "divtmp");
+      Value *Tangent = L.mTangent;
+      if (R.mTangent) {
+        Value *Tmp = Builder.CreateFMul(V, R.mTangent, "dtmp");
+        Tangent = L.mTangent ? Builder.CreateFSub(L.mTangent, Tmp, "dtmp")
+                             : Builder.CreateFNeg(Tmp, "dtmp");
+      }
+      if (Tangent)
+        Tangent = Builder.CreateFDiv(Tangent, R.mValue, "dtmp");
+      return {V, Tangent};
+    }
+    case BinaryOp::Power: {
+      // d(L^R) = R * L^(R-1) * dL + L^R * log(L) * dR
+      Value *V = CreatePower(L.mValue, R.mValue, TheDriver, Builder);
+      if (!V)
+        return {};
+      Value *Tangent = nullptr;
+      if (L.mTangent) {
+        Value *Exponent = Builder.CreateFSub(R.mValue, ConstantFP::get(TheContext, APFloat(1.0)), "subtmp");
+        Value *Tmp = CreatePower(L.mValue, Exponent, TheDriver, Builder);
+        if (!Tmp)
+          return {};
+        Tmp = Builder.CreateFMul(Tmp, R.mValue, "multmp");
+        Tangent = Mul(L.mTangent, Tmp);
+      }
+      if (R.mTangent) {
+        Function *CallLog = TheDriver.getFunction("log");
+        if (!CallLog) {
+          LogError("unknown function referenced");
+          return {};
+        }
+        Value *Tmp = Builder.CreateCall(CallLog, {L.mValue}, "logtmp");
+        Tmp = Builder.CreateFMul(V, Tmp, "multmp");
+        Tangent = Add(Tangent, Mul(R.mTangent, Tmp));
+      }
+      return {V, Tangent};
+    }
+    case BinaryOp::Less: {
+      Value *Cmp = Builder.CreateFCmpULT(L.mValue, R.mValue, "cmptmp");
+      return {Builder.CreateUIToFP(Cmp, llvm::Type::getDoubleTy(TheContext), "booltmp"),
+              nullptr};
+    }
+    default:
+      LogError("invalid binary operator");
+      return {};
+  }
 }
 
-unique_ptr<ExprAST> ForExprAST::Derivative(Driver& TheDriver, const string &Variable) const {
-  // TODO: I am still not sure how to take the derivative of a for loop...
-  // just simply assume we can take the derivative of the body
-  auto DerivativeBody = mBody->Derivative(TheDriver, Variable);
-  // further assume Variable is not changed in Start, End and Step
-  return make_unique<ForExprAST>(mVarName, mStart->clone(), mEnd->clone(),
-                                 mStep->clone(), move(DerivativeBody));
+DualValue ExprArena::codegenDualCall(ExprIndex Index,
+                                     Driver& TheDriver,
+                                     LLVMContext& TheContext,
+                                     IRBuilder<>& Builder,
+                                     Module& TheModule,
+                                     map<string, AllocaInst*>& NamedValues,
+                                     map<string, AllocaInst*>& NamedTangents) {
+  const string Callee = getName(Index);
+  const vector<ExprIndex> Arguments(getOperands(Index).begin(),
+                                    getOperands(Index).end());
+  vector<DualValue> ArgsD;
+  bool HasTangent = false;
+  for (const ExprIndex Arg : Arguments) {
+    ArgsD.push_back(codegenDual(Arg, TheDriver, TheContext, Builder,
+                                TheModule, NamedValues, NamedTangents));
+    if (!ArgsD.back().mValue)
+      return {};
+    HasTangent = HasTangent || ArgsD.back().mTangent;
+  }
+  // the tangent of a call comes from the callee's dual function, or from the
+  // rules of the library functions; a call whose arguments have zero
+  // tangents is an ordinary call
+  Function *CalleeF = nullptr;
+  const bool IsLibraryCall = HasTangent && !TheDriver.mDualFunctions.count(Callee) &&
+                             ExternFunctionsMap.count(Callee);
+  if (HasTangent && !IsLibraryCall) {
+    CalleeF = TheDriver.getDualFunction(Callee);
+    if (!CalleeF) {
+      LogError("Function " + DualFunctionName(Callee) + " not found");
+      return {};
+    }
+  }
+  if (!CalleeF) {
+    Function *F = TheDriver.getFunction(Callee);
+    if (!F) {
+      LogError("unknown function referenced");
+      return {};
+    }
+    if (F->arg_size() != Arguments.size()) {
+      LogError("incorrect # arguments passed");
+      return {};
+    }
+    vector<Value *> ArgsV;
+    for (const DualValue& Arg : ArgsD)
+      ArgsV.push_back(Arg.mValue);
+    Value *V = Builder.CreateCall(F, ArgsV, "calltmp");
+    if (!IsLibraryCall)
+      return {V, nullptr};
+    Value *Tangent = nullptr;
+    for (size_t i = 0; i < ArgsD.size(); ++i) {
+      if (!ArgsD[i].mTangent)
+        continue;
+      Value *Partial = CreateLibraryPartial(Callee, ArgsV, V, i, TheDriver, Builder);
+      if (!Partial)
+        return {};
+      Value *Tmp = Builder.CreateFMul(ArgsD[i].mTangent, Partial, "dtmp");
+      Tangent = Tangent ? Builder.CreateFAdd(Tangent, Tmp, "dtmp") : Tmp;
+    }
+    return {V, Tangent};
+  }
+  if (CalleeF->arg_size() != 2 * Arguments.size() + 1) {
+    LogError("incorrect # arguments passed");
+    return {};
+  }
+  vector<Value *> ArgsV;
+  for (const DualValue& Arg : ArgsD)
+    ArgsV.push_back(Arg.mValue);
+  for (const DualValue& Arg : ArgsD)
+    ArgsV.push_back(MaterializeTangent(Arg.mTangent, TheContext));
+  Function *TheFunction = Builder.GetInsertBlock()->getParent();
+  AllocaInst *Tangent = TheDriver.CreateEntryBlockAlloca(TheFunction, "tangent");
+  ArgsV.push_back(Tangent);
+  Value *V = Builder.CreateCall(CalleeF, ArgsV, "calltmp");
+  return {V, Builder.CreateLoad(Tangent->getAllocatedType(), Tangent, "dcalltmp")};
+}
+
+DualValue ExprArena::codegenDualIf(ExprIndex Index,
+                                   Driver& TheDriver,
+                                   LLVMContext& TheContext,
+                                   IRBuilder<>& Builder,
+                                   Module& TheModule,
+                                   map<string, AllocaInst*>& NamedValues,
+                                   map<string, AllocaInst*>& NamedTangents) {
+  using llvm::PHINode;
+  using llvm::BasicBlock;
+  using llvm::ConstantFP;
+  using llvm::APFloat;
+  // the condition is piecewise constant, only its value matters
+  Value *CondV = codegenDual(getOperand(Index, 0), TheDriver, TheContext, Builder,
+                             TheModule, NamedValues, NamedTangents).mValue;
+  if (!CondV)
+    return {};
+  CondV = Builder.CreateFCmpONE(CondV, ConstantFP::get(TheContext, APFloat(0.0)), "ifcond");
+  Function *TheFunction = Builder.GetInsertBlock()->getParent();
+  BasicBlock *ThenBB = BasicBlock::Create(TheContext, "then", TheFunction);
+  BasicBlock *ElseBB = BasicBlock::Create(TheContext, "else");
+  BasicBlock *MergeBB = BasicBlock::Create(TheContext, "ifcont");
+  Builder.CreateCondBr(CondV, ThenBB, ElseBB);
+  const size_t CacheCheckpoint = mValueCacheLog.size();
+  Builder.SetInsertPoint(ThenBB);
+  const DualValue ThenD = codegenDual(getOperand(Index, 1), TheDriver, TheContext,
+                                      Builder, TheModule, NamedValues, NamedTangents);
+  if (!ThenD.mValue)
+    return {};
+  RollbackValueCache(CacheCheckpoint);
+  Builder.CreateBr(MergeBB);
+  ThenBB = Builder.GetInsertBlock();
+  TheFunction->getBasicBlockList().push_back(ElseBB);
+  Builder.SetInsertPoint(ElseBB);
+  const DualValue ElseD = codegenDual(getOperand(Index, 2), TheDriver, TheContext,
+                                      Builder, TheModule, NamedValues, NamedTangents);
+  if (!ElseD.mValue)
+    return {};
+  RollbackValueCache(CacheCheckpoint);
+  Builder.CreateBr(MergeBB);
+  ElseBB = Builder.GetInsertBlock();
+  TheFunction->getBasicBlockList().push_back(MergeBB);
+  Builder.SetInsertPoint(MergeBB);
+  llvm::Type *DoubleTy = llvm::Type::getDoubleTy(TheContext);
+  PHINode *PN = Builder.CreatePHI(DoubleTy, 2, "iftmp");
+  PN->addIncoming(ThenD.mValue, ThenBB);
+  PN->addIncoming(ElseD.mValue, ElseBB);
+  if (!ThenD.mTangent && !ElseD.mTangent)
+    return {PN, nullptr};
+  PHINode *TangentPN = Builder.CreatePHI(DoubleTy, 2, "diftmp");
+  TangentPN->addIncoming(MaterializeTangent(ThenD.mTangent, TheContext), ThenBB);
+  TangentPN->addIncoming(MaterializeTangent(ElseD.mTangent, TheContext), ElseBB);
+  return {PN, TangentPN};
+}
+
+DualValue ExprArena::codegenDualFor(ExprIndex Index,
+                                    Driver& TheDriver,
+                                    LLVMContext& TheContext,
+                                    IRBuilder<>& Builder,
+                                    Module& TheModule,
+                                    map<string, AllocaInst*>& NamedValues,
+                                    map<string, AllocaInst*>& NamedTangents) {
+  using llvm::BasicBlock;
+  using llvm::ConstantFP;
+  using llvm::APFloat;
+  using llvm::Constant;
+  const string& VarName = getName(Index);
+  const ExprIndex Start = getOperand(Index, 0);
+  const ExprIndex End = getOperand(Index, 1);
+  const ExprIndex Step = getOperand(Index, 2);
+  const ExprIndex Body = getOperand(Index, 3);
+  Function *TheFunction = Builder.GetInsertBlock()->getParent();
+  AllocaInst *Alloca = TheDriver.CreateEntryBlockAlloca(TheFunction, VarName);
+  AllocaInst *TangentAlloca = TheDriver.CreateEntryBlockAlloca(TheFunction, "d" + VarName);
+  const DualValue StartD = codegenDual(Start, TheDriver, TheContext, Builder,
+                                       TheModule, NamedValues, NamedTangents);
+  if (!StartD.mValue)
+    return {};
+  Builder.CreateStore(StartD.mValue, Alloca);
+  Builder.CreateStore(MaterializeTangent(StartD.mTangent, TheContext), TangentAlloca);
+  // see codegenFor
+  ClearValueCache();
+  BasicBlock *LoopBB = BasicBlock::Create(TheContext, "loop", TheFunction);
+  Builder.CreateBr(LoopBB);
+  Builder.SetInsertPoint(LoopBB);
+  AllocaInst *OldVal = NamedValues[VarName];
+  AllocaInst *OldTangent = NamedTangents[VarName];
+  NamedValues[VarName] = Alloca;
+  NamedTangents[VarName] = TangentAlloca;
+  if (!codegenDual(Body, TheDriver, TheContext, Builder, TheModule,
+                   NamedValues, NamedTangents).mValue)
+    return {};
+  DualValue StepD{ConstantFP::get(TheContext, APFloat(1.0)), nullptr};
+  if (Step != InvalidExpr) {
+    StepD = codegenDual(Step, TheDriver, TheContext, Builder, TheModule,
+                        NamedValues, NamedTangents);
+    if (!StepD.mValue)
+      return {};
+  }
+  Value *EndCond = codegenDual(End, TheDriver, TheContext, Builder, TheModule,
+                               NamedValues, NamedTangents).mValue;
+  if (!EndCond)
+    return {};
+  Value *CurVar = Builder.CreateLoad(Alloca->getAllocatedType(), Alloca,
+                                     VarName.c_str());
+  Builder.CreateStore(Builder.CreateFAdd(CurVar, StepD.mValue, "nextvar"), Alloca);
+  if (StepD.mTangent) {
+    Value *CurTangent = Builder.CreateLoad(TangentAlloca->getAllocatedType(),
+                                           TangentAlloca, "d" + VarName);
+    Builder.CreateStore(Builder.CreateFAdd(CurTangent, StepD.mTangent, "dnextvar"),
+                        TangentAlloca);
+  }
+  EndCond = Builder.CreateFCmpONE(
+      EndCond, ConstantFP::get(TheContext, APFloat(0.0)), "loopcond");
+  BasicBlock *AfterBB =
+      BasicBlock::Create(TheContext, "afterloop", TheFunction);
+  Builder.CreateCondBr(EndCond, LoopBB, AfterBB);
+  Builder.SetInsertPoint(AfterBB);
+  if (OldVal) {
+    NamedValues[VarName] = OldVal;
+    NamedTangents[VarName] = OldTangent;
+  } else {
+    NamedValues.erase(VarName);
+    NamedTangents.erase(VarName);
+  }
+  ClearValueCache();
+  // for expr always returns 0.0.
+  return {Constant::getNullValue(llvm::Type::getDoubleTy(TheContext)), nullptr};
+}
+
+Function *FunctionAST::codegenDual(Driver& TheDriver,
+                                   LLVMContext& TheContext,
+                                   IRBuilder<>& Builder,
+                                   Module& TheModule,
+                                   map<string, AllocaInst*>& NamedValues) {
+  using llvm::Type;
+  using llvm::FunctionType;
+  using llvm::BasicBlock;
+  // double dual_f(double, ..., double, ..., double*)
+  const vector<string> ArgNames = mPrototype->getArgumentNames();
+  const size_t N = ArgNames.size();
+  vector<Type*> ArgTypes(2 * N, Type::getDoubleTy(TheContext));
+  ArgTypes.push_back(Type::getDoublePtrTy(TheContext));
+  FunctionType *FT = FunctionType::get(Type::getDoubleTy(TheContext), ArgTypes, false);
+  Function *TheFunction = Function::Create(FT, Function::ExternalLinkage,
+                                           DualFunctionName(getName()), &TheModule);
+  BasicBlock *BB = BasicBlock::Create(TheContext, "entry", TheFunction);
+  Builder.SetInsertPoint(BB);
+  // see codegenGradient for why the arguments are named first
+  for (size_t i = 0; i < N; ++i) {
+    TheFunction->getArg(i)->setName(ArgNames[i]);
+    TheFunction->getArg(N + i)->setName("d" + ArgNames[i]);
+  }
+  Value *Out = TheFunction->getArg(2 * N);
+  Out->setName("tangent");
+  NamedValues.clear();
+  map<string, AllocaInst*> NamedTangents;
+  for (size_t i = 0; i < N; ++i) {
+    AllocaInst *Alloca = TheDriver.CreateEntryBlockAlloca(TheFunction, ArgNames[i]);
+    Builder.CreateStore(TheFunction->getArg(i), Alloca);
+    NamedValues[ArgNames[i]] = Alloca;
+    AllocaInst *Tangent = TheDriver.CreateEntryBlockAlloca(TheFunction, "d" + ArgNames[i]);
+    Builder.CreateStore(TheFunction->getArg(N + i), Tangent);
+    NamedTangents[ArgNames[i]] = Tangent;
+  }
+  mArena->ClearValueCache();
+  const DualValue RetVal = mArena->codegenDual(mBody, TheDriver, TheContext, Builder,
+                                               TheModule, NamedValues, NamedTangents);
+  mArena->ClearValueCache();
+  if (!RetVal.mValue) {
+    TheFunction->eraseFromParent();
+    return nullptr;
+  }
+  Builder.CreateStore(MaterializeTangent(RetVal.mTangent, TheContext), Out);
+  Builder.CreateRet(RetVal.mValue);
+  llvm::verifyFunction(*TheFunction);
+  return TheFunction;
+}
+
+Function *FunctionAST::codegenBatch(Driver& TheDriver,
+                                    LLVMContext& TheContext,
+                                    IRBuilder<>& Builder,
+                                    Module& TheModule,
+                                    map<string, AllocaInst*>& NamedValues) {
+  using llvm::Type;
+  using llvm::FunctionType;
+  using llvm::BasicBlock;
+  using llvm::PHINode;
+  // void f_batch(double**, double*, size_t)
+  Type *DoubleTy = Type::getDoubleTy(TheContext);
+  Type *DoublePtrTy = Type::getDoublePtrTy(TheContext);
+  Type *SizeTy = TheModule.getDataLayout().getIntPtrType(TheContext);
+  FunctionType *FT = FunctionType::get(Type::getVoidTy(TheContext),
+                                       {DoublePtrTy->getPointerTo(), DoublePtrTy, SizeTy},
+                                       false);
+  Function *TheFunction = Function::Create(FT, Function::ExternalLinkage,
+                                           BatchFunctionName(getName()), &TheModule);
+  Value *Columns = TheFunction->getArg(0);
+  Value *Out = TheFunction->getArg(1);
+  Value *N = TheFunction->getArg(2);
+  Columns->setName("cols");
+  Out->setName("out");
+  N->setName("n");
+  // Without this the vectorizer would need a runtime overlap check of out
+  // against every column.
+  TheFunction->addParamAttr(1, llvm::Attribute::NoAlias);
+  TheFunction->addParamAttr(0, llvm::Attribute::NoCapture);
+  TheFunction->addParamAttr(0, llvm::Attribute::ReadOnly);
+  BasicBlock *EntryBB = BasicBlock::Create(TheContext, "entry", TheFunction);
+  BasicBlock *LoopBB = BasicBlock::Create(TheContext, "row", TheFunction);
+  BasicBlock *AfterBB = BasicBlock::Create(TheContext, "afterrows", TheFunction);
+  Builder.SetInsertPoint(EntryBB);
+  const vector<string> ArgNames = mPrototype->getArgumentNames();
+  NamedValues.clear();
+  vector<Value*> ColumnPtrs;
+  for (size_t i = 0; i < ArgNames.size(); ++i) {
+    Value *Ptr = Builder.CreateConstInBoundsGEP1_64(DoublePtrTy, Columns, i);
+    ColumnPtrs.push_back(Builder.CreateLoad(DoublePtrTy, Ptr, ArgNames[i] + ".col"));
+    NamedValues[ArgNames[i]] = TheDriver.CreateEntryBlockAlloca(TheFunction, ArgNames[i]);
+  }
+  Value *Zero = llvm::ConstantInt::get(SizeTy, 0);
+  Builder.CreateCondBr(Builder.CreateICmpEQ(N, Zero, "empty"), AfterBB, LoopBB);
+  Builder.SetInsertPoint(LoopBB);
+  PHINode *Row = Builder.CreatePHI(SizeTy, 2, "i");
+  Row->addIncoming(Zero, EntryBB);
+  for (size_t i = 0; i < ArgNames.size(); ++i) {
+    Value *Ptr = Builder.CreateInBoundsGEP(DoubleTy, ColumnPtrs[i], Row);
+    Builder.CreateStore(Builder.CreateLoad(DoubleTy, Ptr, ArgNames[i]),
+                        NamedValues[ArgNames[i]]);
+  }
+  mArena->ClearValueCache();
+  Value *RetVal = mArena->codegen(mBody, TheDriver, TheContext, Builder, TheModule, NamedValues);
+  mArena->ClearValueCache();
+  if (!RetVal) {
+    TheFunction->eraseFromParent();
+    return nullptr;
+  }
+  Builder.CreateStore(RetVal, Builder.CreateInBoundsGEP(DoubleTy, Out, Row));
+  Value *NextRow = Builder.CreateAdd(Row, llvm::ConstantInt::get(SizeTy, 1), "nexti",
+                                     /*HasNUW=*/true);
+  // the body may have added blocks, the latch is wherever it ended
+  Row->addIncoming(NextRow, Builder.GetInsertBlock());
+  Builder.CreateCondBr(Builder.CreateICmpEQ(NextRow, N, "done"), AfterBB, LoopBB);
+  Builder.SetInsertPoint(AfterBB);
+  Builder.CreateRetVoid();
+  llvm::verifyFunction(*TheFunction);
+  return TheFunction;
 }
@@ -2,20 +2,29 @@
 #define ABSTRACTSYNTAXTREE_H
 // #include <llvm/IR/Type.h>
 // #include <llvm/IR/BasicBlock.h>
+#include <llvm/ADT/ArrayRef.h>
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/Value.h>
 #include <llvm/IR/Module.h>
-#include <llvm/IR/LegacyPassManager.h>
+#include <cstdint>
+#include <limits>
 #include <string>
+#include <string_view>
 #include <memory>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 #include <map>
 
+#include "Operation.h"
+
 using std::string;
+using std::string_view;
 using std::unique_ptr;
+using std::shared_ptr;
 using std::make_unique;
+using std::make_shared;
 using std::move;
 using std::vector;
 using std::map;
@@ -25,195 +34,214 @@ using llvm::LLVMContext;
 using llvm::IRBuilder;
 using llvm::Module;
 using llvm::Function;
-using llvm::legacy::FunctionPassManager;
 using llvm::AllocaInst;
+using llvm::ArrayRef;
 
 class Driver;
-class CallExprAST;
-class NumberExprAST;
 
-/// ExprAST - Base class for all expression nodes.
-class ExprAST {
-public:
-  virtual string Type() const {
-    return string{"ExprAST"};
-  }
-  virtual ~ExprAST() = default;
-  virtual Value *codegen(Driver& TheDriver,
-                         LLVMContext& TheContext,
-                         IRBuilder<>& Builder,
-                         Module& TheModule,
-                         map<string, AllocaInst*>& NamedValues) = 0;
-  virtual unique_ptr<ExprAST> clone() const = 0;
-  virtual unique_ptr<ExprAST> Derivative(Driver& TheDriver,
-                                         const string& Variable) const;
-};
+/// ExprIndex - A 32-bit reference to an expression node in an ExprArena.
+using ExprIndex = uint32_t;
+constexpr ExprIndex InvalidExpr = std::numeric_limits<ExprIndex>::max();
 
-/// IfExprAST - Expression class for if/then/else.
-class IfExprAST: public ExprAST {
-private:
-  unique_ptr<ExprAST> mCond;
-  unique_ptr<ExprAST> mThen;
-  unique_ptr<ExprAST> mElse;
-public:
-  IfExprAST(unique_ptr<ExprAST> Cond, unique_ptr<ExprAST> Then,
-            unique_ptr<ExprAST> Else)
-    : mCond(move(Cond)), mThen(move(Then)), mElse(move(Else)) {}
-  virtual string Type() const {
-    return string{"IfExprAST"};
-  }
-  virtual Value *codegen(Driver& TheDriver, LLVMContext& TheContext,
-                         IRBuilder<>& Builder, Module& TheModule,
-                         map<string, AllocaInst*>& NamedValues);
-  virtual unique_ptr<ExprAST> clone() const;
-  virtual unique_ptr<ExprAST> Derivative(Driver& TheDriver,
-                                         const string& Variable) const;
+/// ExprKind - The kinds of expression nodes.
+enum class ExprKind : uint8_t {
+  Number,    // numeric literal like "1.0"
+  Variable,  // reference to a variable, like "a"
+  Binary,    // binary operator, operands are (LHS, RHS)
+  Call,      // function call, operands are the arguments
+  If,        // if/then/else, operands are (Cond, Then, Else)
+  For,       // for/in, operands are (Start, End, Step, Body)
 };
 
-/// ForExprAST - Expression class for for/in.
-class ForExprAST: public ExprAST {
-private:
-  string mVarName;
-  unique_ptr<ExprAST> mStart;
-  unique_ptr<ExprAST> mEnd;
-  unique_ptr<ExprAST> mStep;
-  unique_ptr<ExprAST> mBody;
-public:
-  ForExprAST(const string& VarName, unique_ptr<ExprAST> Start,
-             unique_ptr<ExprAST> End, unique_ptr<ExprAST> Step,
-             unique_ptr<ExprAST> Body)
-    : mVarName(VarName), mStart(move(Start)), mEnd(move(End)),
-      mStep(move(Step)), mBody(move(Body)) {}
-  virtual Value *codegen(Driver& TheDriver, LLVMContext& TheContext,
-                         IRBuilder<>& Builder, Module& TheModule,
-                         map<string, AllocaInst*>& NamedValues);
-  virtual unique_ptr<ExprAST> clone() const;
-  virtual unique_ptr<ExprAST> Derivative(Driver& TheDriver,
-                                         const string& Variable) const;
+/// ExprNode - A compact expression node.  Children are not owned by the node
+/// but referred to by index: they are the mNumOperands entries of the
+/// arena's operand list starting at mFirstOperand.  mSymbol is the constant
+/// index of a number, or the symbol index of a variable name, a callee or a
+/// loop variable.
+struct ExprNode {
+  ExprKind mKind;
+  BinaryOp mOperator;
+  uint16_t mNumOperands;
+  uint32_t mSymbol;
+  uint32_t mFirstOperand;
 };
 
-/// NumberExprAST - Expression class for numeric literals like "1.0".
-class NumberExprAST: public ExprAST {
-private:
-  double mValue;
-public:
-  virtual string Type() const {
-    return string{"NumberExprAST"};
-  }
-  double getNumber() const {
-    return mValue;
-  }
-  NumberExprAST(double Val): mValue(Val) {}
-  virtual Value *codegen(Driver& TheDriver,
-                         LLVMContext& TheContext,
-                         IRBuilder<>& Builder,
-                         Module& TheModule,
-                         map<string, AllocaInst*>& NamedValues);
-  virtual unique_ptr<ExprAST> clone() const;
-  virtual unique_ptr<ExprAST> Derivative(Driver& TheDriver,
-                                         const string& Variable) const;
+/// DualValue - The value of an expression and its tangent, i.e. its
+/// derivative along the seed direction of a forward-mode sweep.  A null
+/// mTangent means the tangent is known to be zero, so no code is emitted for
+/// it.
+struct DualValue {
+  Value *mValue = nullptr;
+  Value *mTangent = nullptr;
 };
 
-/// VariableExprAST - Expression class for referencing a variable, like "a".
-class VariableExprAST: public ExprAST {
-private:
-  string mName;
+/// ExprArena - Owns all expression nodes of a definition (and of the
+/// derivatives generated from it) in a few contiguous arrays, so building a
+/// tree is a sequence of appends and the whole tree is dropped in one go.
+/// Nodes are immutable and hash-consed: creating a node that is structurally
+/// equal to an existing one returns the existing index, so the expressions
+/// form a DAG in which equal subexpressions are stored once.
+class ExprArena {
 public:
-  virtual string Type() const {
-    return string{"VariableExprAST"};
+  ExprIndex CreateNumber(double Val);
+  ExprIndex CreateVariable(string_view Name);
+  ExprIndex CreateBinary(BinaryOp Op, ExprIndex LHS, ExprIndex RHS);
+  ExprIndex CreateCall(string_view Callee, ArrayRef<ExprIndex> Args);
+  ExprIndex CreateIf(ExprIndex Cond, ExprIndex Then, ExprIndex Else);
+  // Step may be InvalidExpr, which means a step of 1.0.
+  ExprIndex CreateFor(string_view VarName, ExprIndex Start, ExprIndex End,
+                      ExprIndex Step, ExprIndex Body);
+  size_t size() const {
+    return mNodes.size();
   }
-  string getVariable() const {
-    return mName;
+  void clear();
+  const ExprNode& getNode(ExprIndex Index) const {
+    return mNodes[Index];
   }
-  VariableExprAST(string  Name): mName(move(Name)) {}
-  virtual Value *codegen(Driver& TheDriver,
-                         LLVMContext& TheContext,
-                         IRBuilder<>& Builder,
-                         Module& TheModule,
-                         map<string, AllocaInst*>& NamedValues);
-  virtual unique_ptr<ExprAST> clone() const;
-  virtual unique_ptr<ExprAST> Derivative(Driver& TheDriver,
-                                         const string& Variable) const;
-};
-
-/// BinaryExprAST - Expression class for a binary operator.
-class BinaryExprAST: public ExprAST {
-private:
-  std::string mOperator;
-  unique_ptr<ExprAST> mLHS;
-  unique_ptr<ExprAST> mRHS;
-public:
-  virtual string Type() const {
-    return string{"BinaryExprAST"};
+  ExprKind getKind(ExprIndex Index) const {
+    return mNodes[Index].mKind;
   }
-  string getOperator() const {
-    return mOperator;
+  BinaryOp getOperator(ExprIndex Index) const {
+    return mNodes[Index].mOperator;
   }
-  const ExprAST* getLHSExpr() const {
-    if (!mLHS) return nullptr;
-    return mLHS.get();
+  double getNumber(ExprIndex Index) const {
+    return mConstants[mNodes[Index].mSymbol];
   }
-  const ExprAST* getRHSExpr() const {
-    if (!mRHS) return nullptr;
-    return mRHS.get();
-  }
-  BinaryExprAST(string  Op, unique_ptr<ExprAST> LHS,
-                unique_ptr<ExprAST> RHS)
-    : mOperator{move(Op)}, mLHS(move(LHS)), mRHS(move(RHS)) {}
-  virtual Value *codegen(Driver& TheDriver,
-                         LLVMContext& TheContext,
-                         IRBuilder<>& Builder,
-                         Module& TheModule,
-                         map<string, AllocaInst*>& NamedValues);
-  virtual unique_ptr<ExprAST> clone() const;
-  virtual unique_ptr<ExprAST> Derivative(Driver& TheDriver,
-                                         const string& Variable) const;
-};
-
-/// UnaryExprAST - Expression class for a unary operator.
-// Do I need this??
-// class UnaryExprAST: public ExprAST {
-// private:
-//   char mOperator;
-//   unique_ptr<ExprAST> mRHS;
-// public:
-//   UnaryExprAST(char Op, unique_ptr<ExprAST> RHS)
-//     : mOperator(Op), mRHS(move(RHS)) {}
-// };
-
-/// CallExprAST - Expression class for function calls.
-class CallExprAST: public ExprAST {
-private:
-  string mCallee;
-  vector<unique_ptr<ExprAST>> mArguments;
-public:
-  virtual string Type() const {
-    return string{"CallExprAST"};
+  // The variable name, callee or loop variable of a node.
+  const string& getName(ExprIndex Index) const {
+    return mSymbols[mNodes[Index].mSymbol];
   }
-  string getCallee() const {
-    return mCallee;
+  ArrayRef<ExprIndex> getOperands(ExprIndex Index) const {
+    const ExprNode& Node = mNodes[Index];
+    return ArrayRef<ExprIndex>(mOperands).slice(Node.mFirstOperand,
+                                                Node.mNumOperands);
   }
-  size_t getNumberOfArguments() const {
-    return mArguments.size();
+  ExprIndex getOperand(ExprIndex Index, unsigned I) const {
+    return mOperands[mNodes[Index].mFirstOperand + I];
   }
-  vector<const ExprAST*> getArguments() const {
-    vector<const ExprAST*> result;
-    for (const auto& i : mArguments) {
-      if (!i) result.push_back(nullptr);
-      else result.push_back(i.get());
-    }
-    return result;
+  bool isNumber(ExprIndex Index) const {
+    return getKind(Index) == ExprKind::Number;
   }
-  CallExprAST(string  Callee, vector<unique_ptr<ExprAST>> Args)
-    : mCallee(move(Callee)), mArguments(move(Args)) {}
-  virtual Value *codegen(Driver& TheDriver,
-                         LLVMContext& TheContext,
-                         IRBuilder<>& Builder,
-                         Module& TheModule,
-                         map<string, AllocaInst*>& NamedValues);
-  virtual unique_ptr<ExprAST> clone() const;
-  virtual unique_ptr<ExprAST> Derivative(Driver& TheDriver,
-                                         const string& Variable) const;
+  // The distinct nodes reachable from Root.
+  vector<ExprIndex> CollectNodes(ExprIndex Root) const;
+  // Number of distinct nodes reachable from Root.
+  size_t CountNodes(ExprIndex Root) const;
+  // Number of nodes Root would have as a tree, i.e. with every shared
+  // subexpression copied (saturates at UINT64_MAX).
+  uint64_t CountTreeNodes(ExprIndex Root) const;
+  // Cost of evaluating Root unconditionally, as the arm of a select: the
+  // sum of the costs of its nodes, or infinity if Root must not be
+  // evaluated speculatively ('=', loops and calls of user functions, which
+  // may not terminate on the inputs the branch would have excluded).
+  double SpeculationCost(ExprIndex Root) const;
+  // Shared nodes are emitted once per function.  The cache of emitted values
+  // must be cleared before and after generating each function.
+  Value *codegen(ExprIndex Index,
+                 Driver& TheDriver,
+                 LLVMContext& TheContext,
+                 IRBuilder<>& Builder,
+                 Module& TheModule,
+                 map<string, AllocaInst*>& NamedValues);
+  void ClearValueCache();
+  ExprIndex Derivative(ExprIndex Index, Driver& TheDriver,
+                       const string& Variable);
+  // Adjoints of the nodes the reverse sweep has reached so far.
+  using AdjointMap = std::unordered_map<ExprIndex, Value*>;
+  // Reverse sweep over the expression at Root, whose adjoint is Seed.  The
+  // nodes marked in InScope belong to enclosing regions (or are variables):
+  // their adjoints are accumulated in Adjoints but not propagated further.
+  // Forward values are taken from the value cache or recomputed, so the
+  // expression must not contain '='.
+  bool codegenAdjoints(ExprIndex Root, Value *Seed, vector<bool>& InScope,
+                       AdjointMap& Adjoints, Driver& TheDriver,
+                       LLVMContext& TheContext, IRBuilder<>& Builder,
+                       Module& TheModule,
+                       map<string, AllocaInst*>& NamedValues);
+  // Forward-mode codegen: emit the value and the tangent of each node
+  // together.  NamedTangents holds the tangent of each variable.  Uses the
+  // same cache as codegen, so it must not be mixed with codegen in one
+  // function.
+  DualValue codegenDual(ExprIndex Index, Driver& TheDriver,
+                        LLVMContext& TheContext, IRBuilder<>& Builder,
+                        Module& TheModule,
+                        map<string, AllocaInst*>& NamedValues,
+                        map<string, AllocaInst*>& NamedTangents);
+private:
+  using DerivativeMap = std::unordered_map<ExprIndex, ExprIndex>;
+  ExprIndex CreateNode(ExprKind Kind, BinaryOp Op, uint32_t Symbol,
+                       ArrayRef<ExprIndex> Operands);
+  uint32_t InternSymbol(string_view Name);
+  void RollbackValueCache(size_t Checkpoint);
+  Value *codegenNode(ExprIndex Index, Driver& TheDriver,
+                     LLVMContext& TheContext, IRBuilder<>& Builder,
+                     Module& TheModule,
+                     map<string, AllocaInst*>& NamedValues);
+  Value *codegenBinary(ExprIndex Index, Driver& TheDriver,
+                       LLVMContext& TheContext, IRBuilder<>& Builder,
+                       Module& TheModule,
+                       map<string, AllocaInst*>& NamedValues);
+  Value *codegenCall(ExprIndex Index, Driver& TheDriver,
+                     LLVMContext& TheContext, IRBuilder<>& Builder,
+                     Module& TheModule,
+                     map<string, AllocaInst*>& NamedValues);
+  Value *codegenIf(ExprIndex Index, Driver& TheDriver,
+                   LLVMContext& TheContext, IRBuilder<>& Builder,
+                   Module& TheModule,
+                   map<string, AllocaInst*>& NamedValues);
+  Value *codegenFor(ExprIndex Index, Driver& TheDriver,
+                    LLVMContext& TheContext, IRBuilder<>& Builder,
+                    Module& TheModule,
+                    map<string, AllocaInst*>& NamedValues);
+  DualValue codegenDualNode(ExprIndex Index, Driver& TheDriver,
+                            LLVMContext& TheContext, IRBuilder<>& Builder,
+                            Module& TheModule,
+                            map<string, AllocaInst*>& NamedValues,
+                            map<string, AllocaInst*>& NamedTangents);
+  DualValue codegenDualBinary(ExprIndex Index, Driver& TheDriver,
+                              LLVMContext& TheContext, IRBuilder<>& Builder,
+                              Module& TheModule,
+                              map<string, AllocaInst*>& NamedValues,
+                              map<string, AllocaInst*>& NamedTangents);
+  DualValue codegenDualCall(ExprIndex Index, Driver& TheDriver,
+                            LLVMContext& TheContext, IRBuilder<>& Builder,
+                            Module& TheModule,
+                            map<string, AllocaInst*>& NamedValues,
+                            map<string, AllocaInst*>& NamedTangents);
+  DualValue codegenDualIf(ExprIndex Index, Driver& TheDriver,
+                          LLVMContext& TheContext, IRBuilder<>& Builder,
+                          Module& TheModule,
+                          map<string, AllocaInst*>& NamedValues,
+                          map<string, AllocaInst*>& NamedTangents);
+  DualValue codegenDualFor(ExprIndex Index, Driver& TheDriver,
+                           LLVMContext& TheContext, IRBuilder<>& Builder,
+                           Module& TheModule,
+                           map<string, AllocaInst*>& NamedValues,
+                           map<string, AllocaInst*>& NamedTangents);
+  ExprIndex Derivative(ExprIndex Index, Driver& TheDriver,
+                       const string& Variable, DerivativeMap& Done);
+  ExprIndex DerivativeBinary(ExprIndex Index, Driver& TheDriver,
+                             const string& Variable, DerivativeMap& Done);
+  ExprIndex DerivativeCall(ExprIndex Index, Driver& TheDriver,
+                           const string& Variable, DerivativeMap& Done);
+  // The partial derivative of the library function Callee with respect to
+  // its argument I, as an expression of Arguments.
+  ExprIndex LibraryPartial(const string& Callee, const vector<ExprIndex>& Arguments,
+                           size_t I);
+  vector<ExprNode> mNodes;
+  vector<ExprIndex> mOperands;
+  vector<double> mConstants;
+  vector<string> mSymbols;
+  std::unordered_map<string, uint32_t> mSymbolIndices;
+  // constants are keyed by their bit pattern so that 0.0 and -0.0 differ
+  std::unordered_map<uint64_t, uint32_t> mConstantIndices;
+  // node hash -> nodes with that hash
+  std::unordered_multimap<size_t, ExprIndex> mUniqueNodes;
+  // values emitted for the function being generated, and the order in which
+  // they were added so that branches can drop their own entries
+  std::unordered_map<ExprIndex, Value*> mValueCache;
+  // the same for codegenDual, which shares mValueCacheLog
+  std::unordered_map<ExprIndex, DualValue> mDualCache;
+  vector<ExprIndex> mValueCacheLog;
 };
 
 /// PrototypeAST - This class represents the "prototype" for a function,
@@ -244,11 +272,13 @@ public:
   virtual unique_ptr<PrototypeAST> clone() const;
 };
 
-/// FunctionAST - This class represents a function definition itself.
+/// FunctionAST - This class represents a function definition itself.  The
+/// body lives in an arena shared with the derivatives of the function.
 class FunctionAST {
 private:
   unique_ptr<PrototypeAST> mPrototype;
-  unique_ptr<ExprAST> mBody;
+  shared_ptr<ExprArena> mArena;
+  ExprIndex mBody;
 public:
   virtual string Type() const {
     return string{"FunctionAST"};
@@ -257,9 +287,18 @@ public:
     if (!mPrototype) return nullptr;
     return mPrototype.get();
   }
-  const ExprAST* getBody() const {
-    if (!mBody) return nullptr;
-    return mBody.get();
+  const ExprArena& getArena() const {
+    return *mArena;
+  }
+  ExprArena& getArena() {
+    return *mArena;
+  }
+  ExprIndex getBody() const {
+    return mBody;
+  }
+  // Body must be a node of this function's arena.
+  void setBody(ExprIndex Body) {
+    mBody = Body;
   }
   vector<string> getArgumentNames() const {
     return mPrototype->getArgumentNames();
@@ -267,21 +306,53 @@ public:
   string getName() const {
     return mPrototype->getName();
   }
-  FunctionAST(unique_ptr<PrototypeAST> Proto, unique_ptr<ExprAST> Body)
-    : mPrototype(move(Proto)), mBody(move(Body)) {}
+  FunctionAST(unique_ptr<PrototypeAST> Proto, shared_ptr<ExprArena> Arena,
+              ExprIndex Body)
+    : mPrototype(move(Proto)), mArena(move(Arena)), mBody(Body) {}
   Function *codegen(Driver& TheDriver,
                     LLVMContext& TheContext,
                     IRBuilder<>& Builder,
                     Module& TheModule,
-                    FunctionPassManager& FPM,
                     map<string, AllocaInst*>& NamedValues);
+  // Emit grad_<name>(args..., double* out), which returns the value of the
+  // function and stores its partial derivatives in out[0..N).
+  Function *codegenGradient(Driver& TheDriver,
+                            LLVMContext& TheContext,
+                            IRBuilder<>& Builder,
+                            Module& TheModule,
+                            map<string, AllocaInst*>& NamedValues);
+  // Emit dual_<name>(args..., tangents..., double* tangent), which returns
+  // the value of the function and stores its derivative along the direction
+  // given by tangents in *tangent.
+  Function *codegenDual(Driver& TheDriver,
+                        LLVMContext& TheContext,
+                        IRBuilder<>& Builder,
+                        Module& TheModule,
+                        map<string, AllocaInst*>& NamedValues);
+  // Emit <name>_batch(const double* const* cols, double* out, size_t n),
+  // which evaluates the body for each row i < n with the arguments taken
+  // from cols[0][i], cols[1][i], ... and stores the results in out[i].  The
+  // body is inlined into the loop so that it can be vectorized; out must not
+  // overlap the columns.
+  Function *codegenBatch(Driver& TheDriver,
+                         LLVMContext& TheContext,
+                         IRBuilder<>& Builder,
+                         Module& TheModule,
+                         map<string, AllocaInst*>& NamedValues);
+  // Replace the body by its algebraic simplification (see Simplifier).
+  void Simplify(bool FastMath = false);
+  // The copy shares the (immutable) nodes with this function.
   virtual unique_ptr<FunctionAST> clone() const;
   virtual unique_ptr<FunctionAST> Derivative(Driver& TheDriver,
                                              const string& Variable,
                                              const string& FunctionName) const;
 };
 
-unique_ptr<ExprAST> LogError(const string& Str);
+string GradientFunctionName(const string& FunctionName);
+string DualFunctionName(const string& FunctionName);
+string BatchFunctionName(const string& FunctionName);
+
+ExprIndex LogError(const string& Str);
 
 [[maybe_unused]] unique_ptr<FunctionAST> LogErrorF(const string& Str);
 unique_ptr<PrototypeAST> LogErrorP(const string& Str);
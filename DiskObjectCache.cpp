@@ -0,0 +1,72 @@
+#include "DiskObjectCache.h"
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/Process.h>
+#include <llvm/Support/raw_ostream.h>
+
+bool DiskObjectCache::setDirectory(const std::string& Directory) {
+  mDirectory.clear();
+  if (Directory.empty())
+    return true;
+  if (const std::error_code EC = llvm::sys::fs::create_directories(Directory)) {
+    llvm::errs() << "Cannot create the cache directory " << Directory << ": "
+                 << EC.message() << "\n";
+    return false;
+  }
+  mDirectory = Directory;
+  return true;
+}
+
+bool DiskObjectCache::contains(const std::string& Key) const {
+  return isEnabled() && llvm::sys::fs::exists(getFileName(Key));
+}
+
+void DiskObjectCache::notifyObjectCompiled(const llvm::Module *M,
+                                           llvm::MemoryBufferRef Object) {
+  const std::string Key = getKey(M);
+  if (Key.empty())
+    return;
+  // Another session may be reading the same file, so it only appears once
+  // it is complete.
+  const std::string FileName = getFileName(Key);
+  const std::string TemporaryName =
+    FileName + ".tmp" + std::to_string(llvm::sys::Process::getProcessId());
+  std::error_code EC;
+  {
+    llvm::raw_fd_ostream Output(TemporaryName, EC, llvm::sys::fs::OF_None);
+    if (!EC) {
+      Output << Object.getBuffer();
+      Output.close();
+      EC = Output.error();
+    }
+  }
+  if (!EC)
+    EC = llvm::sys::fs::rename(TemporaryName, FileName);
+  if (EC) {
+    llvm::errs() << "Cannot write " << FileName << ": " << EC.message() << "\n";
+    llvm::sys::fs::remove(TemporaryName);
+  }
+}
+
+std::unique_ptr<llvm::MemoryBuffer> DiskObjectCache::getObject(const llvm::Module *M) {
+  const std::string Key = getKey(M);
+  if (Key.empty())
+    return nullptr;
+  auto Buffer = llvm::MemoryBuffer::getFile(getFileName(Key));
+  if (!Buffer)
+    return nullptr;
+  return std::move(*Buffer);
+}
+
+std::string DiskObjectCache::getFileName(const std::string& Key) const {
+  llvm::SmallString<128> FileName(mDirectory);
+  llvm::sys::path::append(FileName, Key + ".o");
+  return std::string(FileName);
+}
+
+std::string DiskObjectCache::getKey(const llvm::Module *M) const {
+  llvm::StringRef Identifier = M->getModuleIdentifier();
+  if (!isEnabled() || !Identifier.consume_front(KeyPrefix))
+    return "";
+  return Identifier.str();
+}
@@ -0,0 +1,35 @@
+#ifndef DISKOBJECTCACHE_H
+#define DISKOBJECTCACHE_H
+
+#include <llvm/ExecutionEngine/ObjectCache.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <memory>
+#include <string>
+
+/// DiskObjectCache - An ObjectCache keeping compiled objects in a directory
+/// across sessions, one file per key.  Only the modules whose identifier is
+/// KeyPrefix followed by a key are cached, so the key has to cover
+/// everything the object depends on; other modules are always compiled.
+class DiskObjectCache: public llvm::ObjectCache {
+public:
+  static constexpr const char *KeyPrefix = "cache:";
+  // Keep the objects in Directory, creating it if needed; an empty
+  // Directory disables the cache.  Returns false if it cannot be created.
+  bool setDirectory(const std::string& Directory);
+  bool isEnabled() const {
+    return !mDirectory.empty();
+  }
+  // Whether an object has been stored for Key.
+  bool contains(const std::string& Key) const;
+  void notifyObjectCompiled(const llvm::Module *M,
+                            llvm::MemoryBufferRef Object) override;
+  std::unique_ptr<llvm::MemoryBuffer> getObject(const llvm::Module *M) override;
+private:
+  std::string getFileName(const std::string& Key) const;
+  // The key of M, empty if M is not cached.
+  std::string getKey(const llvm::Module *M) const;
+  std::string mDirectory;
+};
+
+#endif // DISKOBJECTCACHE_H
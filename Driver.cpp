@@ -1,39 +1,158 @@
 #include "Driver.h"
 #include "Library.h"
-#include <llvm/Transforms/InstCombine/InstCombine.h>
-#include <llvm/Transforms/Scalar.h>
-#include <llvm/Transforms/Scalar/GVN.h>
-#include <llvm/Transforms/Utils.h>
+#include "EGraph.h"
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/Linker/Linker.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/IR/PassTimingInfo.h>
+#include <llvm/Analysis/TargetTransformInfo.h>
+#include <llvm/Analysis/TargetLibraryInfo.h>
+#include <llvm/Config/llvm-config.h>
+#include <llvm/Support/DynamicLibrary.h>
+#include <llvm/Support/SHA1.h>
+#include <llvm/Transforms/Utils/BasicBlockUtils.h>
+#include <llvm/Transforms/Utils/ValueMapper.h>
 #include <llvm/Support/TargetSelect.h>
+#include <llvm/IR/Intrinsics.h>
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/MC/MCSubtargetInfo.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/Program.h>
+#include <llvm/IR/Verifier.h>
+#include <algorithm>
+#include <chrono>
+#include <cctype>
 #include <cmath>
+#include <sstream>
 
 // #define DEBUG_DRIVER
 
-Driver::Driver(const Parser& p):
+string_view GetFPModeName(FPMode Mode) {
+  switch (Mode) {
+    case FPMode::Strict: return "strict";
+    case FPMode::Contract: return "contract";
+    case FPMode::Fast: return "fast";
+  }
+  return "";
+}
+
+bool ParseFPMode(string_view Name, FPMode& Mode) {
+  for (const FPMode M : {FPMode::Strict, FPMode::Contract, FPMode::Fast}) {
+    if (Name == GetFPModeName(M)) {
+      Mode = M;
+      return true;
+    }
+  }
+  return false;
+}
+
+// The flags the builder puts on every floating-point instruction.
+static llvm::FastMathFlags GetFastMathFlags(FPMode Mode) {
+  llvm::FastMathFlags FMF;
+  if (Mode == FPMode::Contract)
+    FMF.setAllowContract();
+  else if (Mode == FPMode::Fast)
+    FMF.setFast();
+  return FMF;
+}
+
+// Contraction only needs the flags on the instructions, but the code
+// generator takes the rest of fast math from the target options, which it
+// resets from these attributes for each function.
+static void AddFPModeAttributes(Function& F, FPMode Mode) {
+  if (Mode != FPMode::Fast)
+    return;
+  for (const char *Attribute : {"unsafe-fp-math", "no-infs-fp-math", "no-nans-fp-math",
+                                "no-signed-zeros-fp-math", "approx-func-fp-math"})
+    F.addFnAttr(Attribute, "true");
+}
+
+static void AddFPModeAttributes(Module& M, FPMode Mode) {
+  for (Function& F : M) {
+    if (!F.isDeclaration())
+      AddFPModeAttributes(F, Mode);
+  }
+}
+
+Driver::Driver(const Parser& p, const string& CPU, const string& Features):
   mParser(p) {
   llvm::InitializeNativeTarget();
   llvm::InitializeNativeTargetAsmPrinter();
   llvm::InitializeNativeTargetAsmParser();
-  mBuilder = make_unique<IRBuilder<>>(*mContext);
-  mJIT = ExitOnErr(llvm::orc::KaleidoscopeJIT::Create());
+  mJIT = ExitOnErr(llvm::orc::KaleidoscopeJIT::Create(CPU, Features));
+  auto JTMB = mJIT->getTargetMachineBuilder();
+  mTargetMachine = ExitOnErr(JTMB.createTargetMachine());
+  // tier-0 code calls __calc_tier_up(__calc_driver, Id), both by name, so
+  // that no address of this session is baked into the IR
+  ExitOnErr(mJIT->defineAbsolute("__calc_tier_up", llvm::pointerToJITTargetAddress(&Driver::TierUpCallback)));
+  ExitOnErr(mJIT->defineAbsolute("__calc_driver", llvm::pointerToJITTargetAddress(this)));
   InitializeModuleAndPassManager();
 }
 
+Driver::~Driver() {
+  {
+    std::lock_guard<std::mutex> Lock(mTierUpMutex);
+    mTierUpStop = true;
+  }
+  mTierUpReady.notify_all();
+  if (mTierUpThread.joinable())
+    mTierUpThread.join();
+}
+
+void Driver::PrintTargetInfo() const {
+  // the subtarget knows the features implied by the CPU name as well
+  const llvm::MCSubtargetInfo *STI = mTargetMachine->getMCSubtargetInfo();
+  auto HasFeature = [&](const string& Feature) {
+    return STI->checkFeatures(Feature);
+  };
+  string ISA = "baseline";
+  if (mTargetMachine->getTargetTriple().isX86()) {
+    ISA = HasFeature("+avx512f") ? "AVX-512" : HasFeature("+avx2") ? "AVX2" :
+          HasFeature("+avx") ? "AVX" : "SSE2";
+    if (HasFeature("+fma"))
+      ISA += " + FMA";
+  }
+  // the widest vectors the vectorizer will use, which may be narrower than
+  // the registers (e.g. 256 bits on CPUs where 512-bit code downclocks)
+  LLVMContext Context;
+  Module M("target-info", Context);
+  Function *F = Function::Create(llvm::FunctionType::get(llvm::Type::getVoidTy(Context), false),
+                                 Function::ExternalLinkage, "f", M);
+  const auto TTI = mTargetMachine->getTargetTransformInfo(*F);
+  const auto Width = TTI.getRegisterBitWidth(llvm::TargetTransformInfo::RGK_FixedWidthVector);
+  std::cerr << "Target " << mTargetMachine->getTargetTriple().str()
+            << ", CPU " << mTargetMachine->getTargetCPU().str()
+            << ", " << ISA << ", " << Width.getFixedSize() << "-bit vectors\n";
+}
+
 void Driver::HandleTopLevelExpression() {
+  // the expression may call the definitions collected so far
+  SubmitDefinitions();
   if (auto FnAST = mParser.ParseTopLevelExpr()) {
 #ifdef TRAVERSE_AST
-    traverseAST(FnAST->clone().get());
+    traverseAST(FnAST.get());
 #endif
-    if (auto *FnIR = FnAST->codegen(*this, *mContext, *mBuilder, *mModule, *mFPM, mNamedValues)) {
+    SimplifyFunction(*FnAST);
+    SaturateFunction(*FnAST);
+    // Expressions run on the VM right away, with no module to build.  The
+    // other modes let the optimizer change the result.
+    double Result;
+    if (mInterpret && mFPMode == FPMode::Strict && InterpretExpression(*FnAST, Result)) {
+      std::cerr << "Interpreted a top-level expr\n";
+      std::cout << "Evaluated to " << Result << std::endl;
+      return;
+    }
+    if (auto *FnIR = FnAST->codegen(*this, *mContext, *mBuilder, *mModule, mNamedValues)) {
+      OptimizeModule(mFPMode, mTiered ? 0 : mOptLevel);
       std::cerr << "Read a top-level expr:\n";
       FnIR->print(llvm::errs());
       std::cerr << std::endl;
       // JIT the module containing the anonymous expression, keeping a handle so
       // we can free it later.
       auto RT = mJIT->getMainJITDylib().createResourceTracker();
-      auto TSM = ThreadSafeModule(std::move(mModule), std::move(mContext));
-      ExitOnErr(mJIT->addModule(move(TSM), RT));
-      InitializeModuleAndPassManager();
+      SubmitModule(RT, mTiered);
       // Search the JIT for the __anon_expr symbol.
       auto ExprSymbol = ExitOnErr(mJIT->lookup("__anon_expr"));
 //       assert(ExprSymbol && "Function not found");
@@ -44,7 +163,7 @@ void Driver::HandleTopLevelExpression() {
     }
     // TODO: read from a symbol table to replace the hard-coded "x"
 //     if (auto FnDerivAST = FnAST->Derivative("x", "_deriv")) {
-//       if (auto *FnDerivIR = FnDerivAST->codegen(*this, *mContext, *mBuilder, *mModule, *mFPM, mNamedValues)) {
+//       if (auto *FnDerivIR = FnDerivAST->codegen(*this, *mContext, *mBuilder, *mModule, mNamedValues)) {
 //         std::cerr << "Derivative function IR:\n";
 //         FnDerivIR->print(llvm::errs());
 //         std::cerr << std::endl;
@@ -59,43 +178,401 @@ void Driver::HandleTopLevelExpression() {
 
 void Driver::HandleDefinition() {
   if (auto FnAST = mParser.ParseDefinition()) {
-    // FIXME: after codegen this the function name and arg names are not available!!
-    auto FnAST_backup = FnAST->clone();
 #ifdef TRAVERSE_AST
-    traverseAST(FnAST_backup.get());
+    traverseAST(FnAST.get());
 #endif
-    if (auto *FnIR = FnAST->codegen(*this, *mContext, *mBuilder, *mModule, *mFPM, mNamedValues)) {
-      std::cerr << "Read function definition:\n";
-      FnIR->print(llvm::errs());
-      std::cerr << std::endl;
-      auto RT = mJIT->getMainJITDylib().createResourceTracker();
-      auto TSM = ThreadSafeModule(std::move(mModule), std::move(mContext));
-      ExitOnErr(mJIT->addModule(move(TSM), RT));
-      InitializeModuleAndPassManager();
-      // JIT all derivatives
-      const string FunctionName = FnAST_backup->getName();
-      const vector<string> ArgNames = FnAST_backup->getArgumentNames();
-      for (const auto& ArgName : ArgNames) {
-        const string DerivativeName = "d" + FunctionName + "_d" + ArgName;
-        if (auto FnDerivAST = FnAST_backup->Derivative(*this, ArgName, DerivativeName)) {
-          auto FnDerivAST_backup = FnDerivAST->clone();
-          if (auto *FnDerivIR = FnDerivAST->codegen(*this, *mContext, *mBuilder, *mModule, *mFPM, mNamedValues)) {
-            std::cerr << "Derivative function " + DerivativeName + " IR:\n";
-            FnDerivIR->print(llvm::errs());
-            std::cerr << std::endl;
-            TSM = ThreadSafeModule(std::move(mModule), std::move(mContext));
-            ExitOnErr(mJIT->addModule(move(TSM), RT));
-            InitializeModuleAndPassManager();
-          }
-          mDerivativeFunctions[DerivativeName] = std::move(FnDerivAST_backup);
+    // a module defines a function only once
+    for (const PendingDefinition& Definition : mPendingDefinitions) {
+      if (Definition.mName == FnAST->getName()) {
+        SubmitDefinitions();
+        break;
+      }
+    }
+    SimplifyFunction(*FnAST);
+    SaturateFunction(*FnAST);
+    if (auto *FnIR = FnAST->codegen(*this, *mContext, *mBuilder, *mModule, mNamedValues)) {
+      vector<Function *> Functions = {FnIR};
+      // All partial derivatives come from a single reverse sweep in
+      // grad_<f>, compiled into the same module as the function; registered
+      // first so that a recursive function can call its own gradient
+      mGradientFunctions.insert(FnAST->getName());
+      auto *GradIR = FnAST->codegenGradient(*this, *mContext, *mBuilder, *mModule, mNamedValues);
+      if (GradIR) {
+        Functions.push_back(GradIR);
+        // d<f>_d<x> stay callable from expressions
+        for (size_t i = 0; i < FnAST->getArgumentNames().size(); ++i) {
+          if (auto *PartialIR = CreatePartialDerivative(*FnAST, i))
+            Functions.push_back(PartialIR);
         }
+      } else {
+        mGradientFunctions.erase(FnAST->getName());
       }
+      // value and directional derivative in one call; registered first so
+      // that a recursive function can call its own dual
+      mDualFunctions.insert(FnAST->getName());
+      auto *DualIR = FnAST->codegenDual(*this, *mContext, *mBuilder, *mModule, mNamedValues);
+      if (DualIR)
+        Functions.push_back(DualIR);
+      else
+        mDualFunctions.erase(FnAST->getName());
+      mBatchFunctions.erase(FnAST->getName());
+      mDefinitionFPModes[FnAST->getName()] = mFPMode;
+      // the VM runs the bytecode until the definition is hot
+      if (mInterpret && mFPMode == FPMode::Strict)
+        mVM.AddFunction(FnAST->getName(), FnAST->getArgumentNames(),
+                        FnAST->getArena(), FnAST->getBody());
+      else
+        mVM.RemoveFunction(FnAST->getName());
+      if (!mDefinitions.count(FnAST->getName()))
+        mDefinitionOrder.push_back(FnAST->getName());
+      mPendingDefinitions.push_back({FnAST->getName(), move(Functions), FnIR, GradIR, DualIR});
+      mDefinitions[FnAST->getName()] = move(FnAST);
+      if (!mDefinitionBlock)
+        SubmitDefinitions();
     }
   } else {
     mParser.getNextToken();
   }
 }
 
+void Driver::SubmitDefinitions() {
+  if (mPendingDefinitions.empty())
+    return;
+  // The definitions of a block are optimized as one module, so that they
+  // can be inlined into each other, then split into a module for each
+  // definition, which the JIT compiles when it is first called.
+  const size_t N = mPendingDefinitions.size();
+  auto getPartKey = [N](const string& Key, size_t i) {
+    return N == 1 ? Key : Key + "-" + std::to_string(i);
+  };
+  // Unchanged definitions of an earlier session are loaded from the
+  // object cache, with no optimization or code generation.
+  const unsigned Level = mTiered ? 0 : mOptLevel;
+  string Key;
+  bool Cached = false;
+  if (!mTiered && mJIT->getObjectCache().isEnabled()) {
+    AddFPModeAttributes(*mModule, mFPMode);
+    Key = getCacheKey(*WriteBitcode(*mModule), Level);
+    Cached = true;
+    for (size_t i = 0; i < N && Cached; ++i)
+      Cached = mJIT->getObjectCache().contains(getPartKey(Key, i));
+  }
+  if (Cached) {
+    std::cerr << "Loading " << (N == 1 ? mPendingDefinitions.front().mName :
+                                std::to_string(N) + " definitions")
+              << " from the object cache\n";
+  } else {
+    // the functions are optimized together, so they show the inlining
+    OptimizeModule(mFPMode, Level);
+  }
+  vector<unique_ptr<Module>> Parts;
+  if (N == 1)
+    Parts.push_back(move(mModule));
+  else
+    Parts = SplitDefinitions();
+  llvm::orc::ThreadSafeContext Context(move(mContext));
+  for (size_t i = 0; i < N; ++i) {
+    const PendingDefinition& Definition = mPendingDefinitions[i];
+    const string& Name = Definition.mName;
+    if (!Key.empty())
+      Parts[i]->setModuleIdentifier(DiskObjectCache::KeyPrefix + getPartKey(Key, i));
+    // printing is linear in the size of the module, so it waits for the split
+    std::cerr << "Read function definition:\n";
+    Definition.mFunction->print(llvm::errs());
+    std::cerr << std::endl;
+    if (Definition.mGradient) {
+      std::cerr << "Gradient function " << Definition.mGradient->getName().str() << " IR:\n";
+      Definition.mGradient->print(llvm::errs());
+      std::cerr << std::endl;
+    }
+    if (Definition.mDual) {
+      std::cerr << "Dual function " << Definition.mDual->getName().str() << " IR:\n";
+      Definition.mDual->print(llvm::errs());
+      std::cerr << std::endl;
+    }
+    auto IR = WriteBitcode(*Parts[i]);
+    SaveBitcode(*Parts[i], IR);
+    // the VM looks the functions up again
+    for (const Function *F : Definition.mFunctions) {
+      mFunctionAddresses.erase(F->getName().str());
+      mVM.ForgetAddress(F->getName().str());
+    }
+    auto RT = mJIT->getMainJITDylib().createResourceTracker();
+    if (mTiered)
+      SubmitTierZero(Name, move(IR), ThreadSafeModule(move(Parts[i]), Context), RT);
+    else
+      ExitOnErr(mJIT->addModule(ThreadSafeModule(move(Parts[i]), Context), RT));
+    // The JIT only compiles what gets called; compile the new object now
+    // for the later sessions.
+    if (!Cached && !Key.empty())
+      ExitOnErr(mJIT->lookup(Name));
+  }
+  mPendingDefinitions.clear();
+  // the declarations left over from the split
+  mModule.reset();
+  InitializeModuleAndPassManager();
+}
+
+void Driver::HandleCommand(const string& Line) {
+  // the commands work on compiled definitions
+  SubmitDefinitions();
+  const size_t NameEnd = Line.find_first_of(" \t");
+  const string Command = Line.substr(0, NameEnd);
+  const string Arguments = NameEnd == string::npos ? "" : Line.substr(NameEnd + 1);
+  if (Command == ":dual") {
+    HandleDual(Arguments);
+  } else if (Command == ":batch") {
+    HandleBatch(Arguments);
+  } else if (Command == ":threads") {
+    HandleThreads(Arguments);
+  } else if (Command == ":fp") {
+    HandleFPMode(Arguments);
+  } else if (Command == ":opt") {
+    HandleOptLevel(Arguments);
+  } else if (Command == ":time-passes") {
+    HandleTimePasses(Arguments);
+  } else if (Command == ":inline") {
+    HandleInline(Arguments);
+  } else if (Command == ":tiered") {
+    HandleTiered(Arguments);
+  } else {
+    std::cerr << "Unknown command " << Command << "\n";
+  }
+}
+
+/// HandleDual - ":dual f(args...) [tangents...]" evaluates dual_f, printing
+/// the value of f and its derivative along the tangent direction, which
+/// defaults to the first argument.
+void Driver::HandleDual(const string& Arguments) {
+  using llvm::Type;
+  using llvm::FunctionType;
+  using llvm::BasicBlock;
+  using llvm::ConstantFP;
+  using llvm::APFloat;
+  // the call ends at the parenthesis matching the first one
+  size_t CallEnd = Arguments.find('(');
+  for (int Depth = 0; CallEnd < Arguments.size(); ++CallEnd) {
+    if (Arguments[CallEnd] == '(') ++Depth;
+    if (Arguments[CallEnd] == ')' && --Depth == 0) break;
+  }
+  if (CallEnd >= Arguments.size()) {
+    std::cerr << "Usage: :dual f(args...) [tangents...]\n";
+    return;
+  }
+  mParser.SetupInput(Arguments.substr(0, CallEnd + 1));
+  mParser.getNextToken();
+  auto FnAST = mParser.ParseTopLevelExpr();
+  if (!FnAST)
+    return;
+  const ExprArena& Arena = FnAST->getArena();
+  const ExprIndex Call = FnAST->getBody();
+  if (Arena.getKind(Call) != ExprKind::Call) {
+    std::cerr << "Usage: :dual f(args...) [tangents...]\n";
+    return;
+  }
+  const string& Callee = Arena.getName(Call);
+  const size_t N = Arena.getOperands(Call).size();
+  if (!mDualFunctions.count(Callee)) {
+    std::cerr << "Function " << DualFunctionName(Callee) << " not found!\n";
+    return;
+  }
+  vector<double> Tangents;
+  std::istringstream Rest(Arguments.substr(CallEnd + 1));
+  for (string Word; Rest >> Word;) {
+    std::replace(Word.begin(), Word.end(), ',', ' ');
+    std::istringstream Numbers(Word);
+    for (double T; Numbers >> T;)
+      Tangents.push_back(T);
+  }
+  if (Tangents.empty()) {
+    Tangents.assign(N, 0.0);
+    if (N > 0)
+      Tangents[0] = 1.0;
+  }
+  if (Tangents.size() != N) {
+    std::cerr << "Expected " << N << " tangents\n";
+    return;
+  }
+  Function *DualF = getDualFunction(Callee);
+  if (!DualF || DualF->arg_size() != 2 * N + 1) {
+    LogError("incorrect # arguments passed");
+    return;
+  }
+  // double __anon_dual(double* tangent) calls dual_f with the arguments
+  FunctionType *FT = FunctionType::get(Type::getDoubleTy(*mContext),
+                                       {Type::getDoublePtrTy(*mContext)}, false);
+  Function *TheFunction = Function::Create(FT, Function::ExternalLinkage,
+                                           "__anon_dual", mModule.get());
+  BasicBlock *BB = BasicBlock::Create(*mContext, "entry", TheFunction);
+  mBuilder->SetInsertPoint(BB);
+  mNamedValues.clear();
+  ExprArena& MutableArena = FnAST->getArena();
+  MutableArena.ClearValueCache();
+  vector<Value *> ArgsV;
+  for (const ExprIndex Arg : Arena.getOperands(Call)) {
+    ArgsV.push_back(MutableArena.codegen(Arg, *this, *mContext, *mBuilder, *mModule, mNamedValues));
+    if (!ArgsV.back()) {
+      MutableArena.ClearValueCache();
+      TheFunction->eraseFromParent();
+      return;
+    }
+  }
+  MutableArena.ClearValueCache();
+  for (const double T : Tangents)
+    ArgsV.push_back(ConstantFP::get(*mContext, APFloat(T)));
+  ArgsV.push_back(TheFunction->getArg(0));
+  mBuilder->CreateRet(mBuilder->CreateCall(DualF, ArgsV, "calltmp"));
+  llvm::verifyFunction(*TheFunction);
+  OptimizeModule(mFPMode, mTiered ? 0 : mOptLevel);
+  auto RT = mJIT->getMainJITDylib().createResourceTracker();
+  SubmitModule(RT, mTiered);
+  auto ExprSymbol = ExitOnErr(mJIT->lookup("__anon_dual"));
+  double (*FP)(double*) = (double (*)(double*))(intptr_t)ExprSymbol.getAddress();
+  double Tangent = 0;
+  const double Result = FP(&Tangent);
+  std::cout << "Evaluated to " << Result << ", tangent " << Tangent << std::endl;
+  ExitOnErr(RT->remove());
+}
+
+/// HandleBatch - ":batch f n" runs f_batch over n generated rows and reports
+/// the throughput.
+void Driver::HandleBatch(const string& Arguments) {
+  std::istringstream Input(Arguments);
+  string Name;
+  size_t N = 0;
+  if (!(Input >> Name >> N)) {
+    std::cerr << "Usage: :batch f rows\n";
+    return;
+  }
+  if (!getBatchFunction(Name))
+    return;
+  const size_t NumColumns = mFunctionProtos[Name]->getNumberOfArguments();
+  // column j holds values in [j+1, j+2)
+  vector<vector<double>> Data(NumColumns, vector<double>(N));
+  vector<const double*> Columns;
+  for (size_t j = 0; j < NumColumns; ++j) {
+    for (size_t i = 0; i < N; ++i)
+      Data[j][i] = j + 1.0 + (i % 1000) / 1000.0;
+    Columns.push_back(Data[j].data());
+  }
+  vector<double> Out(N);
+  const auto Start = std::chrono::steady_clock::now();
+  EvaluateBatch(Name, Columns.data(), Out.data(), N);
+  const std::chrono::duration<double> Elapsed = std::chrono::steady_clock::now() - Start;
+  double Sum = 0;
+  for (const double V : Out)
+    Sum += V;
+  std::cout << "Evaluated " << BatchFunctionName(Name) << " over " << N
+            << " rows on " << mThreadPool->getNumberOfThreads()
+            << " threads in " << Elapsed.count() * 1e3 << " ms ("
+            << (N ? Elapsed.count() * 1e9 / N : 0) << " ns/row), sum "
+            << Sum << std::endl;
+}
+
+void Driver::HandleThreads(const string& Arguments) {
+  std::istringstream Input(Arguments);
+  unsigned NumThreads = 0;
+  if (!(Input >> NumThreads)) {
+    std::cerr << "Usage: :threads count (0 for all hardware threads)\n";
+    return;
+  }
+  setThreads(NumThreads);
+}
+
+void Driver::HandleFPMode(const string& Arguments) {
+  std::istringstream Input(Arguments);
+  string Name;
+  if (!(Input >> Name)) {
+    std::cout << "Floating-point mode: " << GetFPModeName(mFPMode) << std::endl;
+    return;
+  }
+  FPMode Mode;
+  if (!ParseFPMode(Name, Mode)) {
+    std::cerr << "Usage: :fp [strict|contract|fast]\n";
+    return;
+  }
+  setFPMode(Mode);
+}
+
+void Driver::HandleOptLevel(const string& Arguments) {
+  std::istringstream Input(Arguments);
+  unsigned Level = 0;
+  if (!(Input >> Level)) {
+    std::cout << "Optimization level: " << mOptLevel << std::endl;
+    return;
+  }
+  if (Level > 3) {
+    std::cerr << "Usage: :opt [0|1|2|3]\n";
+    return;
+  }
+  setOptLevel(Level);
+}
+
+void Driver::HandleTimePasses(const string& Arguments) {
+  std::istringstream Input(Arguments);
+  string Switch;
+  if (!(Input >> Switch) || (Switch != "on" && Switch != "off")) {
+    std::cerr << "Usage: :time-passes on|off\n";
+    return;
+  }
+  setTimePasses(Switch == "on");
+}
+
+void Driver::HandleInline(const string& Arguments) {
+  std::istringstream Input(Arguments);
+  string Switch;
+  if (!(Input >> Switch) || (Switch != "on" && Switch != "off")) {
+    std::cerr << "Usage: :inline on|off\n";
+    return;
+  }
+  setInlineDefinitions(Switch == "on");
+}
+
+void Driver::HandleTiered(const string& Arguments) {
+  std::istringstream Input(Arguments);
+  string Switch;
+  if (!(Input >> Switch) || (Switch != "on" && Switch != "off")) {
+    std::cerr << "Usage: :tiered on|off\n";
+    return;
+  }
+  setTiered(Switch == "on");
+}
+
+void Driver::SimplifyFunction(FunctionAST& FnAST) const {
+  if (!mSimplify)
+    return;
+  const size_t NodesBefore = FnAST.getArena().CountNodes(FnAST.getBody());
+  // only the fast mode may change the result for NaNs, infinities or -0
+  FnAST.Simplify(mFPMode == FPMode::Fast);
+  const size_t NodesAfter = FnAST.getArena().CountNodes(FnAST.getBody());
+  if (NodesAfter != NodesBefore) {
+    std::cerr << "Simplified " << FnAST.getName() << ": " << NodesBefore
+              << " -> " << NodesAfter << " nodes\n";
+  }
+}
+
+void Driver::SaturateFunction(FunctionAST& FnAST) const {
+  if (!mEGraph)
+    return;
+  if (!EGraph::CanOptimize(FnAST.getArena(), FnAST.getBody())) {
+    std::cerr << "E-graph: skipping " << FnAST.getName()
+              << ", it contains '=' or a loop\n";
+    return;
+  }
+  EGraph Graph(FnAST.getArena(), mFPMode == FPMode::Fast);
+  const EClassId Root = Graph.AddExpr(FnAST.getBody());
+  const double CostBefore = Graph.getCost(Root);
+  Graph.Saturate();
+  const double CostAfter = Graph.getCost(Root);
+  std::cerr << "E-graph " << FnAST.getName() << ": "
+            << Graph.getNumberOfClasses() << " classes, "
+            << Graph.getNumberOfNodes() << " nodes, cost "
+            << CostBefore << " -> " << CostAfter << "\n";
+  if (CostAfter < CostBefore) {
+    FnAST.setBody(Graph.Extract(Root));
+  }
+}
+
 void Driver::HandleExtern() {
   if (auto ProtoAST = mParser.ParseExtern()) {
     if (auto *ProtoIR = ProtoAST->codegen(*this, *mContext, *mBuilder, *mModule, mNamedValues)) {
@@ -105,6 +582,8 @@ void Driver::HandleExtern() {
 #ifdef TRAVERSE_AST
       traverseAST(ProtoAST.get());
 #endif
+      mFunctionAddresses.erase(ProtoAST->getName());
+      mVM.ForgetAddress(ProtoAST->getName());
       mFunctionProtos[ProtoAST->getName()] = move(ProtoAST);
     }
   } else {
@@ -144,6 +623,20 @@ void Driver::MainLoop() {
     std::cerr << "ready> ";
     std::string line;
     std::getline(std::cin, line);
+    // the definitions between "begin" and "end" are compiled as one module
+    if (line == "begin") {
+      mDefinitionBlock = true;
+      continue;
+    }
+    if (line == "end") {
+      SubmitDefinitions();
+      mDefinitionBlock = false;
+      continue;
+    }
+    if (!line.empty() && line[0] == ':') {
+      HandleCommand(line);
+      continue;
+    }
 //     std::cout << "Current input line: " << line << std::endl;
     if (firsttime) {
       mParser.SetupInput(line);
@@ -157,7 +650,7 @@ void Driver::MainLoop() {
     std::cout << "Current buffer: " << mParser.getInputString() << std::endl;
     mParser.PrintCurrentToken();
 #endif
-    switch (std::get<0>(mParser.getCurrentToken())) {
+    switch (mParser.getTokenType()) {
       case Token::Eof: {
 #ifdef DEBUG_DRIVER
         std::cout << "Current string:\n";
@@ -185,71 +678,65 @@ void Driver::MainLoop() {
   }
 }
 
-tuple<string, double> Driver::traverseAST(const ExprAST* Node) const {
-  using std::make_tuple;
-  static int index = 0;
-  const string Type = Node->Type();
-  if (Type == "ExprAST") {
-    return make_tuple("", 0);
-  } else if (Type == "NumberExprAST") {
-#ifdef DEBUG_DRIVER
-    std::cout << "Visiting a " << Type << ": "
-              << static_cast<const NumberExprAST*>(Node)->getNumber() << std::endl;
-#endif
-    const string ResName = "res" + std::to_string(index);
-    std::cout << "Compute " << ResName << " = "
-              << dynamic_cast<const NumberExprAST*>(Node)->getNumber() << std::endl;
-    ++index;
-    return make_tuple(ResName, dynamic_cast<const NumberExprAST*>(Node)->getNumber());
-  } else if (Type == "VariableExprAST") {
-#ifdef DEBUG_DRIVER
-    std::cout << "Visiting a " << Type << ": "
-              << static_cast<const VariableExprAST*>(Node)->getVariable() << std::endl;
-#endif
-    const string ResName = "res" + std::to_string(index);
-    std::cout << "Compute " << ResName << " = "
-              << dynamic_cast<const VariableExprAST*>(Node)->getVariable() << std::endl;
-    ++index;
-    return make_tuple(ResName, 0.0);
-  } else if (Type == "BinaryExprAST") {
-    const string Op = dynamic_cast<const BinaryExprAST*>(Node)->getOperator();
-#ifdef DEBUG_DRIVER
-    std::cout << "Visiting a " << Type << ": " << Op << std::endl;
-    std::cout << "Visiting the LHS: " << std::endl;
-#endif
-    const auto [ResNameL, ValL] = traverseAST(dynamic_cast<const BinaryExprAST*>(Node)->getLHSExpr());
-#ifdef DEBUG_DRIVER
-    std::cout << "Visiting the RHS: " << std::endl;
-#endif
-    const auto [ResNameR, ValR] = traverseAST(dynamic_cast<const BinaryExprAST*>(Node)->getRHSExpr());
-    double result = 0;
-    if (Op == "+") {result = ValL + ValR;}
-    else if (Op == "-") {result = ValL - ValR;}
-    else if (Op == "*") {result = ValL * ValR;}
-    else if (Op == "/") {result = ValL / ValR;}
-    else if (Op == "^") {result = std::pow(ValL, ValR);}
-    else {result = 0;}
-    const string ResName = "res" + std::to_string(index);
-    std::cout << "Compute " << ResName << " = "
-              << ResNameL << " " << Op << " " << ResNameR << std::endl;
-    ++index;
-    return make_tuple(ResName, result);
-  } else if (Type == "CallExprAST") {
-#ifdef DEBUG_DRIVER
-    std::cout << "Visiting a " << Type << ": "
-              << static_cast<const CallExprAST*>(Node)->getCallee() << " ; numargs = "
-              << static_cast<const CallExprAST*>(Node)->getNumberOfArguments() << std::endl;
-    std::cout << "Visiting the arguments:\n";
-#endif
-    vector<const ExprAST*> v = dynamic_cast<const CallExprAST*>(Node)->getArguments();
-    vector<double> ArgumentResults;
-    ArgumentResults.reserve(v.size());
-    for (const auto& i : v) {
-      ArgumentResults.push_back(std::get<1>(traverseAST(i)));
+void Driver::RunFile(const string& FileName) {
+  if (!mParser.SetupInputFile(FileName))
+    return;
+  RunBufferedInput();
+}
+
+void Driver::RunSource(const string& Source) {
+  mParser.SetupInput(Source);
+  RunBufferedInput();
+}
+
+void Driver::RunBufferedInput() {
+  // scripts can be large, tokenize them once and parse from the buffer
+  mParser.BufferTokens();
+  mParser.getNextToken();
+  mDefinitionBlock = mSingleModule;
+  // the whole input is one token stream, so keep handling statements until EOF
+  while (true) {
+    switch (mParser.getTokenType()) {
+      case Token::Eof:
+        SubmitDefinitions();
+        mDefinitionBlock = false;
+        return;
+      case Token::Semicolon:
+        mParser.getNextToken();
+        break;
+      case Token::Definition:
+        HandleDefinition();
+        break;
+      case Token::Extern:
+        HandleExtern();
+        break;
+      default:
+        HandleTopLevelExpression();
+        break;
     }
-    // TODO: call the function with ArgumentResults
   }
-  return make_tuple("", 0);
+}
+
+bool Driver::InterpretExpression(const FunctionAST& FnAST, double& Result) {
+  // most expressions are evaluated as they are, the loops need bytecode
+  if (mVM.Evaluate(FnAST.getArena(), FnAST.getBody(), Result))
+    return true;
+  BytecodeFunction Expression;
+  return mVM.Compile(FnAST.getArena(), FnAST.getBody(), {}, Expression) &&
+         mVM.Run(Expression, nullptr, Result);
+}
+
+llvm::JITTargetAddress Driver::getFunctionAddress(const string& Name) {
+  const auto Found = mFunctionAddresses.find(Name);
+  if (Found != mFunctionAddresses.end())
+    return Found->second;
+  auto Symbol = mJIT->lookup(Name);
+  if (!Symbol) {
+    llvm::consumeError(Symbol.takeError());
+    return 0;
+  }
+  mFunctionAddresses[Name] = Symbol->getAddress();
+  return Symbol->getAddress();
 }
 
 void Driver::traverseAST(const PrototypeAST* Node) {
@@ -259,7 +746,7 @@ void Driver::traverseAST(const PrototypeAST* Node) {
 #endif
 }
 
-void Driver::traverseAST(const FunctionAST* Node) const {
+void Driver::traverseAST(const FunctionAST* Node) {
   const string Type = Node->Type();
 #ifdef DEBUG_DRIVER
   std::cout << "Visiting a " << Type << ":\n";
@@ -269,8 +756,15 @@ void Driver::traverseAST(const FunctionAST* Node) const {
 #ifdef DEBUG_DRIVER
   std::cout << "Visiting the function body:\n";
 #endif
-  const auto [ResName, result] = traverseAST(Node->getBody());
-  std::cout << "Result = " << result << std::endl;
+  BytecodeFunction Bytecode;
+  if (!mVM.Compile(Node->getArena(), Node->getBody(), Node->getArgumentNames(), Bytecode)) {
+    std::cout << "Cannot compile " << Node->getName() << " to bytecode\n";
+    return;
+  }
+  mVM.Print(Bytecode, std::cout);
+  double Result;
+  if (Bytecode.mNumArguments == 0 && mVM.Run(Bytecode, nullptr, Result))
+    std::cout << "Result = " << Result << std::endl;
 }
 
 void Driver::InitializeModuleAndPassManager() {
@@ -278,20 +772,23 @@ void Driver::InitializeModuleAndPassManager() {
   mModule = make_unique<Module>("calculator", *mContext);
   mModule->setDataLayout(mJIT->getDataLayout());
   mBuilder = make_unique<IRBuilder<>>(*mContext);
-  mFPM = make_unique<llvm::legacy::FunctionPassManager>(mModule.get());
-  
-  // Promote allocas to registers.
-  mFPM->add(llvm::createPromoteMemoryToRegisterPass());
-  // Do simple "peephole" optimizations and bit-twiddling optzns.
-  mFPM->add(llvm::createInstructionCombiningPass());
-  // Reassociate expressions.
-  mFPM->add(llvm::createReassociatePass());
-  // Eliminate Common SubExpressions.
-  mFPM->add(llvm::createGVNPass());
-  // Simplify the control flow graph (deleting unreachable blocks, etc).
-  mFPM->add(llvm::createCFGSimplificationPass());
-
-  mFPM->doInitialization();
+  mBuilder->setFastMathFlags(GetFastMathFlags(mFPMode));
+}
+
+// The library functions that LLVM knows as intrinsics, which it can
+// constant-fold, hoist and vectorize.  The rest stay plain calls.
+static llvm::Intrinsic::ID GetLibraryIntrinsic(const string& Name) {
+  static const map<string, llvm::Intrinsic::ID> Intrinsics = {
+    {"pow", llvm::Intrinsic::pow},
+    {"sin", llvm::Intrinsic::sin},
+    {"cos", llvm::Intrinsic::cos},
+    {"exp", llvm::Intrinsic::exp},
+    {"log", llvm::Intrinsic::log},
+    {"sqrt", llvm::Intrinsic::sqrt},
+    {"fabs", llvm::Intrinsic::fabs},
+  };
+  const auto Found = Intrinsics.find(Name);
+  return Found == Intrinsics.end() ? llvm::Intrinsic::not_intrinsic : Found->second;
 }
 
 Function* Driver::getFunction(const string& Name) {
@@ -299,6 +796,13 @@ Function* Driver::getFunction(const string& Name) {
   if (auto *F = mModule->getFunction(Name)) {
     return F;
   }
+  if (ExternFunctionsMap.count(Name)) {
+    const llvm::Intrinsic::ID ID = GetLibraryIntrinsic(Name);
+    if (ID != llvm::Intrinsic::not_intrinsic) {
+      return llvm::Intrinsic::getDeclaration(mModule.get(), ID,
+                                             {llvm::Type::getDoubleTy(*mContext)});
+    }
+  }
   // If not, check whether we can codegen the declaration from some existing
   // prototype.
   auto FI = mFunctionProtos.find(Name);
@@ -309,6 +813,430 @@ Function* Driver::getFunction(const string& Name) {
   return nullptr;
 }
 
+Function* Driver::getGradientFunction(const string& Name) {
+  using llvm::Type;
+  using llvm::FunctionType;
+  const string GradientName = GradientFunctionName(Name);
+  if (auto *F = mModule->getFunction(GradientName)) {
+    return F;
+  }
+  auto FI = mFunctionProtos.find(Name);
+  if (!mGradientFunctions.count(Name) || FI == mFunctionProtos.end()) {
+    return nullptr;
+  }
+  // double grad_f(double, ..., double*), defined in an earlier module
+  vector<Type*> ArgTypes(FI->second->getNumberOfArguments(),
+                         Type::getDoubleTy(*mContext));
+  ArgTypes.push_back(Type::getDoublePtrTy(*mContext));
+  FunctionType *FT = FunctionType::get(Type::getDoubleTy(*mContext), ArgTypes, false);
+  return Function::Create(FT, Function::ExternalLinkage, GradientName, mModule.get());
+}
+
+Function* Driver::getDualFunction(const string& Name) {
+  using llvm::Type;
+  using llvm::FunctionType;
+  const string DualName = DualFunctionName(Name);
+  if (auto *F = mModule->getFunction(DualName)) {
+    return F;
+  }
+  auto FI = mFunctionProtos.find(Name);
+  if (!mDualFunctions.count(Name) || FI == mFunctionProtos.end()) {
+    return nullptr;
+  }
+  // double dual_f(double, ..., double, ..., double*), defined in an earlier
+  // module
+  vector<Type*> ArgTypes(2 * FI->second->getNumberOfArguments(),
+                         Type::getDoubleTy(*mContext));
+  ArgTypes.push_back(Type::getDoublePtrTy(*mContext));
+  FunctionType *FT = FunctionType::get(Type::getDoubleTy(*mContext), ArgTypes, false);
+  return Function::Create(FT, Function::ExternalLinkage, DualName, mModule.get());
+}
+
+void Driver::setFPMode(FPMode Mode) {
+  mFPMode = Mode;
+  mBuilder->setFastMathFlags(GetFastMathFlags(Mode));
+}
+
+void Driver::OptimizeModule(Module& M, FPMode Mode, unsigned Level,
+                            llvm::TargetMachine& TM) {
+  AddFPModeAttributes(M, Mode);
+  // nothing is inlined at -O0
+  if (mInlineDefinitions && Level > 0)
+    LinkDefinitions(M);
+  const llvm::OptimizationLevel Levels[] = {
+    llvm::OptimizationLevel::O0, llvm::OptimizationLevel::O1,
+    llvm::OptimizationLevel::O2, llvm::OptimizationLevel::O3};
+  const llvm::OptimizationLevel OptLevel = Levels[std::min(Level, 3u)];
+  llvm::PassInstrumentationCallbacks PIC;
+  llvm::TimePassesHandler Timer(mTimePasses);
+  Timer.registerCallbacks(PIC);
+  // The vectorizers are off by default, clang turns them on from -O2.
+  llvm::PipelineTuningOptions PTO;
+  PTO.LoopVectorization = PTO.SLPVectorization = Level >= 2;
+  // the target's cost model drives the inliner, unrolling and vectorizers
+  llvm::PassBuilder PB(&TM, PTO, llvm::None, &PIC);
+  llvm::LoopAnalysisManager LAM;
+  llvm::FunctionAnalysisManager FAM;
+  llvm::CGSCCAnalysisManager CGAM;
+  llvm::ModuleAnalysisManager MAM;
+  // With a vector math library the vectorizer can widen sin(x) into a call
+  // of a vector variant like _ZGVbN2v_sin.
+  llvm::TargetLibraryInfoImpl TLII(TM.getTargetTriple());
+  if (mVectorLibrary && LoadVectorLibrary())
+    TLII.addVectorizableFunctionsFromVecLib(llvm::TargetLibraryInfoImpl::LIBMVEC_X86);
+  FAM.registerPass([&] { return llvm::TargetLibraryAnalysis(TLII); });
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+  llvm::ModulePassManager MPM = OptLevel == llvm::OptimizationLevel::O0 ?
+    PB.buildO0DefaultPipeline(OptLevel) : PB.buildPerModuleDefaultPipeline(OptLevel);
+  MPM.run(M, MAM);
+  if (mTimePasses)
+    Timer.print();
+}
+
+std::shared_ptr<const Driver::Bitcode> Driver::WriteBitcode(const Module& M) const {
+  auto IR = std::make_shared<Bitcode>();
+  llvm::raw_svector_ostream Output(*IR);
+  llvm::WriteBitcodeToFile(M, Output);
+  return IR;
+}
+
+void Driver::SaveBitcode(const Module& M, std::shared_ptr<const Bitcode> IR) {
+  std::lock_guard<std::mutex> Lock(mBitcodeMutex);
+  for (const Function& F : M) {
+    if (!F.isDeclarationForLinker())
+      mBitcode[F.getName().str()] = IR;
+  }
+}
+
+/// DeclarationMaterializer - Maps the globals of other modules used by the
+/// functions moved into a module to declarations in it; local constants,
+/// like the lookup tables of switches, are copied.
+class DeclarationMaterializer: public llvm::ValueMaterializer {
+public:
+  explicit DeclarationMaterializer(Module& M): mModule(M) {}
+  Value *materialize(Value *V) override {
+    auto *GV = llvm::dyn_cast<llvm::GlobalValue>(V);
+    if (!GV || GV->getParent() == &mModule)
+      return nullptr;
+    if (auto *F = llvm::dyn_cast<Function>(GV)) {
+      Function *Declaration = Function::Create(F->getFunctionType(), Function::ExternalLinkage,
+                                               F->getName(), mModule);
+      Declaration->setAttributes(F->getAttributes());
+      return Declaration;
+    }
+    if (auto *Variable = llvm::dyn_cast<llvm::GlobalVariable>(GV)) {
+      const bool Local = Variable->hasLocalLinkage();
+      auto *Copy = new llvm::GlobalVariable(
+        mModule, Variable->getValueType(), Variable->isConstant(),
+        Local ? Variable->getLinkage() : llvm::GlobalValue::ExternalLinkage,
+        Local ? Variable->getInitializer() : nullptr, Variable->getName());
+      Copy->copyAttributesFrom(Variable);
+      return Copy;
+    }
+    return nullptr;
+  }
+private:
+  Module& mModule;
+};
+
+vector<unique_ptr<Module>> Driver::SplitDefinitions() {
+  vector<unique_ptr<Module>> Parts;
+  for (const PendingDefinition& Definition : mPendingDefinitions) {
+    auto Part = make_unique<Module>(mModule->getModuleIdentifier(), *mContext);
+    Part->setDataLayout(mModule->getDataLayout());
+    // all the functions first, so that the calls between them stay direct
+    for (Function *F : Definition.mFunctions) {
+      F->removeFromParent();
+      Part->getFunctionList().push_back(F);
+    }
+    llvm::ValueToValueMapTy VMap;
+    DeclarationMaterializer Materializer(*Part);
+    for (Function *F : Definition.mFunctions)
+      llvm::RemapFunction(*F, VMap, llvm::RF_IgnoreMissingLocals, nullptr, &Materializer);
+    Parts.push_back(move(Part));
+  }
+  return Parts;
+}
+
+vector<std::shared_ptr<const Driver::Bitcode>> Driver::getCalleeBitcode(const Module& M) {
+  vector<std::shared_ptr<const Bitcode>> Callees;
+  std::lock_guard<std::mutex> Lock(mBitcodeMutex);
+  for (const Function& F : M) {
+    const auto Found = mBitcode.find(F.getName().str());
+    if (F.isDeclaration() && Found != mBitcode.end() &&
+        std::find(Callees.begin(), Callees.end(), Found->second) == Callees.end())
+      Callees.push_back(Found->second);
+  }
+  return Callees;
+}
+
+void Driver::LinkDefinitions(Module& M) {
+  for (const auto& IR : getCalleeBitcode(M)) {
+    llvm::MemoryBufferRef Buffer(llvm::StringRef(IR->data(), IR->size()), "definition");
+    unique_ptr<Module> Callee = ExitOnErr(llvm::parseBitcodeFile(Buffer, M.getContext()));
+    // The JIT already has these functions: the copies are only there to be
+    // inlined, and are dropped by the pipeline afterwards.
+    for (Function& F : *Callee) {
+      if (!F.isDeclaration())
+        F.setLinkage(Function::AvailableExternallyLinkage);
+    }
+    // only the functions the module refers to
+    if (llvm::Linker::linkModules(M, std::move(Callee), llvm::Linker::LinkOnlyNeeded))
+      std::cerr << "Failed to link the IR of a definition\n";
+  }
+}
+
+bool Driver::setCacheDirectory(const string& Directory) {
+  return mJIT->getObjectCache().setDirectory(Directory);
+}
+
+string Driver::getCacheKey(const Bitcode& IR, unsigned Level) {
+  // The IR is the normalized definition, after simplification and with the
+  // codegen settings applied; the rest is what turns it into an object.
+  string Description;
+  llvm::raw_string_ostream Output(Description);
+  Output << "LLVM " << LLVM_VERSION_STRING << "\n"
+         << mTargetMachine->getTargetTriple().str() << " "
+         << mTargetMachine->getTargetCPU() << " "
+         << mTargetMachine->getTargetFeatureString() << "\n"
+         << "-O" << Level << " " << GetFPModeName(mFPMode)
+         << " vector library " << mVectorLibrary
+         << " inline " << mInlineDefinitions << "\n";
+  Output << llvm::StringRef(IR.data(), IR.size());
+  // the bodies that LinkDefinitions will inline
+  if (mInlineDefinitions && Level > 0) {
+    for (const auto& Callee : getCalleeBitcode(*mModule))
+      Output << llvm::StringRef(Callee->data(), Callee->size());
+  }
+  Output.flush();
+  return llvm::toHex(llvm::SHA1::hash(llvm::arrayRefFromStringRef(Description)), true);
+}
+
+void Driver::SubmitModule(llvm::orc::ResourceTrackerSP RT, bool Baseline) {
+  auto TSM = ThreadSafeModule(std::move(mModule), std::move(mContext));
+  if (Baseline)
+    ExitOnErr(mJIT->addBaselineModule(move(TSM), RT));
+  else
+    ExitOnErr(mJIT->addModule(move(TSM), RT));
+  InitializeModuleAndPassManager();
+}
+
+void Driver::SubmitTierZero(const string& Name, std::shared_ptr<const Bitcode> IR,
+                            ThreadSafeModule TSM, llvm::orc::ResourceTrackerSP RT) {
+  Module& M = *TSM.getModuleUnlocked();
+  TieredDefinition Definition{Name, {}, move(IR), mFPMode};
+  for (const Function& F : M) {
+    if (!F.isDeclaration())
+      Definition.mFunctions.push_back(F.getName().str());
+  }
+  uint32_t Id;
+  {
+    std::lock_guard<std::mutex> Lock(mTierUpMutex);
+    Id = mTieredDefinitions.size();
+    mTieredDefinitions.push_back(Definition);
+  }
+  // one counter for all the functions of the definition
+  llvm::Type *Int64Ty = mBuilder->getInt64Ty();
+  auto *Calls = new llvm::GlobalVariable(M, Int64Ty, false, llvm::GlobalValue::InternalLinkage,
+                                         mBuilder->getInt64(0), Name + ".calls");
+  llvm::FunctionCallee Callback = M.getOrInsertFunction(
+    "__calc_tier_up", mBuilder->getVoidTy(), mBuilder->getInt8PtrTy(), mBuilder->getInt32Ty());
+  // the address of __calc_driver is the Driver
+  Value *This = M.getOrInsertGlobal("__calc_driver", mBuilder->getInt8Ty());
+  for (const string& FunctionName : Definition.mFunctions) {
+    Function *F = M.getFunction(FunctionName);
+    // count after the allocas, which have to stay in the entry block
+    auto IP = F->getEntryBlock().getFirstInsertionPt();
+    while (llvm::isa<AllocaInst>(*IP))
+      ++IP;
+    llvm::Instruction *Body = &*IP;
+    mBuilder->SetInsertPoint(Body);
+    Value *Count = mBuilder->CreateAtomicRMW(llvm::AtomicRMWInst::Add, Calls, mBuilder->getInt64(1),
+                                             llvm::MaybeAlign(8), llvm::AtomicOrdering::Monotonic);
+    Value *Hot = mBuilder->CreateICmpEQ(Count, mBuilder->getInt64(mTierUpCalls - 1), "hot");
+    mBuilder->SetInsertPoint(llvm::SplitBlockAndInsertIfThen(Hot, Body, false));
+    mBuilder->CreateCall(Callback, {This, mBuilder->getInt32(Id)});
+    F->setName(FunctionName + ".tier0");
+  }
+  ExitOnErr(mJIT->addBaselineModule(move(TSM), RT));
+  for (const string& FunctionName : Definition.mFunctions) {
+    auto Symbol = ExitOnErr(mJIT->lookup(FunctionName + ".tier0"));
+    ExitOnErr(mJIT->addStub(FunctionName, Symbol.getAddress()));
+  }
+}
+
+void Driver::TierUpCallback(Driver *TheDriver, uint32_t Id) {
+  std::lock_guard<std::mutex> Lock(TheDriver->mTierUpMutex);
+  if (!TheDriver->mTierUpThread.joinable())
+    TheDriver->mTierUpThread = std::thread(&Driver::TierUpLoop, TheDriver);
+  TheDriver->mTierUpQueue.push_back(Id);
+  TheDriver->mTierUpReady.notify_one();
+}
+
+void Driver::TierUpLoop() {
+  // the main thread keeps using mTargetMachine
+  auto JTMB = mJIT->getTargetMachineBuilder();
+  auto TM = ExitOnErr(JTMB.createTargetMachine());
+  std::unique_lock<std::mutex> Lock(mTierUpMutex);
+  while (true) {
+    mTierUpReady.wait(Lock, [this] { return mTierUpStop || !mTierUpQueue.empty(); });
+    if (mTierUpStop)
+      return;
+    const TieredDefinition Definition = mTieredDefinitions[mTierUpQueue.front()];
+    mTierUpQueue.pop_front();
+    Lock.unlock();
+    TierUp(Definition, *TM);
+    Lock.lock();
+  }
+}
+
+void Driver::TierUp(const TieredDefinition& Definition, llvm::TargetMachine& TM) {
+  const string Failed = "Failed to recompile " + Definition.mName + ": ";
+  auto Context = make_unique<LLVMContext>();
+  llvm::MemoryBufferRef Buffer(llvm::StringRef(Definition.mBitcode->data(), Definition.mBitcode->size()),
+                               Definition.mName);
+  auto M = llvm::parseBitcodeFile(Buffer, *Context);
+  if (!M) {
+    llvm::logAllUnhandledErrors(M.takeError(), llvm::errs(), Failed);
+    return;
+  }
+  for (const string& FunctionName : Definition.mFunctions)
+    (*M)->getFunction(FunctionName)->setName(FunctionName + ".tier1");
+  OptimizeModule(**M, Definition.mMode, 3, TM);
+  if (auto Err = mJIT->addModule(ThreadSafeModule(move(*M), move(Context)))) {
+    llvm::logAllUnhandledErrors(std::move(Err), llvm::errs(), Failed);
+    return;
+  }
+  for (const string& FunctionName : Definition.mFunctions) {
+    auto Symbol = mJIT->lookup(FunctionName + ".tier1");
+    if (!Symbol) {
+      llvm::logAllUnhandledErrors(Symbol.takeError(), llvm::errs(), Failed);
+      return;
+    }
+    if (auto Err = mJIT->updateStub(FunctionName, Symbol->getAddress())) {
+      llvm::logAllUnhandledErrors(std::move(Err), llvm::errs(), Failed);
+      return;
+    }
+  }
+  std::cerr << "Recompiled " << Definition.mName << " at -O3\n";
+}
+
+BatchFunction Driver::getBatchFunction(const string& Name) {
+  const auto Found = mBatchFunctions.find(Name);
+  if (Found != mBatchFunctions.end())
+    return Found->second;
+  const auto Definition = mDefinitions.find(Name);
+  if (Definition == mDefinitions.end()) {
+    std::cerr << "Function " << Name << " is not defined\n";
+    return nullptr;
+  }
+  // the kernel goes into a module of its own
+  SubmitDefinitions();
+  // the kernel is compiled with the mode of the definition
+  const FPMode Mode = mDefinitionFPModes[Name];
+  mBuilder->setFastMathFlags(GetFastMathFlags(Mode));
+  Function *KernelIR = Definition->second->codegenBatch(*this, *mContext, *mBuilder, *mModule, mNamedValues);
+  mBuilder->setFastMathFlags(GetFastMathFlags(mFPMode));
+  if (!KernelIR)
+    return nullptr;
+  // a kernel is only worth it vectorized
+  OptimizeModule(Mode, std::max(mOptLevel, 2u));
+  std::cerr << "Batch kernel " << KernelIR->getName().str() << " IR:\n";
+  KernelIR->print(llvm::errs());
+  std::cerr << std::endl;
+  const string KernelName = KernelIR->getName().str();
+  SubmitModule();
+  auto KernelSymbol = ExitOnErr(mJIT->lookup(KernelName));
+  BatchFunction Kernel = (BatchFunction)(intptr_t)KernelSymbol.getAddress();
+  mBatchFunctions[Name] = Kernel;
+  return Kernel;
+}
+
+void Driver::setThreads(unsigned NumThreads) {
+  mNumThreads = NumThreads;
+  mThreadPool.reset();
+}
+
+// Rows per task: enough to amortize the scheduling, few enough that the
+// columns and the output of a chunk stay in the L2 cache.
+static size_t BatchChunkRows(size_t NumColumns) {
+  constexpr size_t ChunkBytes = 256 * 1024;
+  const size_t Rows = ChunkBytes / ((NumColumns + 1) * sizeof(double));
+  // whole vectors, so that only the last chunk runs a scalar remainder
+  return std::max<size_t>(Rows & ~size_t(63), 1024);
+}
+
+bool Driver::EvaluateBatch(const string& Name, const double* const* Columns,
+                           double* Out, size_t N) {
+  BatchFunction Kernel = getBatchFunction(Name);
+  if (!Kernel)
+    return false;
+  if (!mThreadPool)
+    mThreadPool = make_unique<ThreadPool>(mNumThreads);
+  const size_t NumColumns = mFunctionProtos[Name]->getNumberOfArguments();
+  const size_t ChunkRows = BatchChunkRows(NumColumns);
+  const size_t NumChunks = (N + ChunkRows - 1) / ChunkRows;
+  // every chunk writes its own slice of Out, so the result does not depend
+  // on which thread ran it
+  mThreadPool->ParallelFor(NumChunks, [&](size_t Chunk) {
+    const size_t Begin = Chunk * ChunkRows;
+    llvm::SmallVector<const double*, 8> ChunkColumns;
+    for (size_t j = 0; j < NumColumns; ++j)
+      ChunkColumns.push_back(Columns[j] + Begin);
+    Kernel(ChunkColumns.data(), Out + Begin, std::min(ChunkRows, N - Begin));
+  });
+  return true;
+}
+
+bool Driver::LoadVectorLibrary() {
+  // libmvec only provides the x86-64 variants
+  static const bool Loaded = [this] {
+    const llvm::Triple& Triple = mTargetMachine->getTargetTriple();
+    if (Triple.getArch() != llvm::Triple::x86_64 || !Triple.isOSLinux())
+      return false;
+    string Error;
+    if (llvm::sys::DynamicLibrary::LoadLibraryPermanently("libmvec.so.1", &Error)) {
+      std::cerr << "Vector math library not available: " << Error << "\n";
+      return false;
+    }
+    return true;
+  }();
+  return Loaded;
+}
+
+/// CreatePartialDerivative - Emit d<f>_d<x>(args...) as a call to grad_<f>
+/// that returns one entry of the gradient.
+Function* Driver::CreatePartialDerivative(const FunctionAST& FnAST,
+                                          size_t ArgIndex) {
+  using llvm::BasicBlock;
+  const vector<string> ArgNames = FnAST.getArgumentNames();
+  const string Name = "d" + FnAST.getName() + "_d" + ArgNames[ArgIndex];
+  auto Proto = make_unique<PrototypeAST>(Name, ArgNames);
+  Function *TheFunction = Proto->codegen(*this, *mContext, *mBuilder, *mModule, mNamedValues);
+  Function *GradF = getGradientFunction(FnAST.getName());
+  if (!TheFunction || !GradF)
+    return nullptr;
+  mFunctionProtos[Name] = move(Proto);
+  BasicBlock *BB = BasicBlock::Create(*mContext, "entry", TheFunction);
+  mBuilder->SetInsertPoint(BB);
+  llvm::Type *DoubleTy = llvm::Type::getDoubleTy(*mContext);
+  AllocaInst *Partials = mBuilder->CreateAlloca(DoubleTy, mBuilder->getInt32(ArgNames.size()), "partials");
+  vector<Value *> ArgsV;
+  for (auto &Arg : TheFunction->args()) {
+    ArgsV.push_back(&Arg);
+  }
+  ArgsV.push_back(Partials);
+  mBuilder->CreateCall(GradF, ArgsV);
+  Value *Ptr = mBuilder->CreateConstInBoundsGEP1_64(DoubleTy, Partials, ArgIndex);
+  mBuilder->CreateRet(mBuilder->CreateLoad(DoubleTy, Ptr, "partial"));
+  llvm::verifyFunction(*TheFunction);
+  return TheFunction;
+}
+
 /// CreateEntryBlockAlloca - Create an alloca instruction in the entry block of
 /// the function.  This is used for mutable variables etc.
 AllocaInst* Driver::CreateEntryBlockAlloca(Function* TheFunction,
@@ -318,3 +1246,142 @@ AllocaInst* Driver::CreateEntryBlockAlloca(Function* TheFunction,
                    TheFunction->getEntryBlock().begin());
   return TmpB.CreateAlloca(llvm::Type::getDoubleTy(*mContext), 0, VarName.c_str());
 }
+
+// The C spelling of the types in the signatures of the compiled functions.
+static string GetCTypeName(const llvm::Type* Ty) {
+  if (Ty->isVoidTy())
+    return "void";
+  if (Ty->isIntegerTy())
+    return "size_t";
+  if (Ty->isPointerTy()) {
+    // only the columns of a batch kernel are a double**
+    const llvm::Type *Pointee = Ty->getPointerElementType();
+    return Pointee->isPointerTy() ? "const double* const*" : "double*";
+  }
+  return "double";
+}
+
+/// WriteHeader - Write the C prototypes of the functions defined in M.
+static bool WriteHeader(const Module& M, const string& HeaderName) {
+  std::error_code EC;
+  llvm::raw_fd_ostream Output(HeaderName, EC, llvm::sys::fs::OF_Text);
+  if (EC) {
+    std::cerr << "Cannot write " << HeaderName << ": " << EC.message() << "\n";
+    return false;
+  }
+  string Guard;
+  for (const char C : llvm::sys::path::filename(HeaderName))
+    Guard += std::isalnum(static_cast<unsigned char>(C)) ? std::toupper(C) : '_';
+  Output << "/* Generated by the calculator; link with -lm. */\n"
+         << "#ifndef " << Guard << "\n#define " << Guard << "\n\n"
+         << "#include <stddef.h>\n\n"
+         << "#ifdef __cplusplus\nextern \"C\" {\n#endif\n\n";
+  for (const Function& F : M) {
+    if (F.isDeclaration())
+      continue;
+    Output << GetCTypeName(F.getReturnType()) << " " << F.getName() << "(";
+    for (const auto& Arg : F.args()) {
+      if (Arg.getArgNo() > 0)
+        Output << ", ";
+      Output << GetCTypeName(Arg.getType()) << " " << Arg.getName();
+    }
+    Output << ");\n";
+  }
+  Output << "\n#ifdef __cplusplus\n}\n#endif\n\n#endif /* " << Guard << " */\n";
+  return true;
+}
+
+bool Driver::CompileDefinitions(const string& FileName, bool Batch) {
+  const bool SharedLibrary = llvm::sys::path::extension(FileName) == ".so";
+  // position-independent code for the CPU of the JIT, which --cpu can pin
+  auto JTMB = mJIT->getTargetMachineBuilder();
+  JTMB.setRelocationModel(llvm::Reloc::PIC_);
+  JTMB.setCodeGenOptLevel(mOptLevel == 0 ? llvm::CodeGenOpt::None :
+                          mOptLevel == 3 ? llvm::CodeGenOpt::Aggressive : llvm::CodeGenOpt::Default);
+  auto TM = JTMB.createTargetMachine();
+  if (!TM) {
+    llvm::logAllUnhandledErrors(TM.takeError(), llvm::errs(), "Cannot create the target: ");
+    return false;
+  }
+  mModule->setTargetTriple((*TM)->getTargetTriple().str());
+  mModule->setDataLayout((*TM)->createDataLayout());
+  // the definitions in the order of the script, so that the functions
+  // they call are already in the module
+  bool Success = true;
+  for (const string& Name : mDefinitionOrder) {
+    FunctionAST& FnAST = *mDefinitions[Name];
+    const FPMode Mode = mDefinitionFPModes[Name];
+    mBuilder->setFastMathFlags(GetFastMathFlags(Mode));
+    vector<Function *> Functions;
+    Functions.push_back(FnAST.codegen(*this, *mContext, *mBuilder, *mModule, mNamedValues));
+    if (mGradientFunctions.count(Name)) {
+      Functions.push_back(FnAST.codegenGradient(*this, *mContext, *mBuilder, *mModule, mNamedValues));
+      for (size_t i = 0; i < FnAST.getArgumentNames().size(); ++i)
+        Functions.push_back(CreatePartialDerivative(FnAST, i));
+    }
+    if (mDualFunctions.count(Name))
+      Functions.push_back(FnAST.codegenDual(*this, *mContext, *mBuilder, *mModule, mNamedValues));
+    if (Batch)
+      Functions.push_back(FnAST.codegenBatch(*this, *mContext, *mBuilder, *mModule, mNamedValues));
+    for (Function *F : Functions) {
+      if (F)
+        AddFPModeAttributes(*F, Mode);
+      else
+        Success = false;
+    }
+  }
+  mBuilder->setFastMathFlags(GetFastMathFlags(mFPMode));
+  // the attributes are set per definition above
+  if (Success)
+    OptimizeModule(*mModule, FPMode::Strict, Batch ? std::max(mOptLevel, 2u) : mOptLevel, **TM);
+  std::error_code EC;
+  llvm::SmallString<128> ObjectName(FileName);
+  if (Success && SharedLibrary) {
+    EC = llvm::sys::fs::createTemporaryFile("calculator", "o", ObjectName);
+    if (EC)
+      std::cerr << "Cannot create a temporary object file: " << EC.message() << "\n";
+  }
+  if (Success && !EC) {
+    llvm::raw_fd_ostream Output(ObjectName, EC, llvm::sys::fs::OF_None);
+    llvm::legacy::PassManager PM;
+    if (EC) {
+      std::cerr << "Cannot write " << ObjectName.str().str() << ": " << EC.message() << "\n";
+    } else if ((*TM)->addPassesToEmitFile(PM, Output, nullptr, llvm::CGFT_ObjectFile)) {
+      std::cerr << "The target cannot emit object files\n";
+      Success = false;
+    } else {
+      PM.run(*mModule);
+    }
+  }
+  Success = Success && !EC;
+  if (Success && SharedLibrary) {
+    // the system compiler driver knows how to link a shared library
+    auto Linker = llvm::sys::findProgramByName("cc");
+    if (!Linker) {
+      std::cerr << "Cannot find cc to link " << FileName << "\n";
+      Success = false;
+    } else {
+      vector<llvm::StringRef> Arguments = {*Linker, "-shared", "-o", FileName, ObjectName, "-lm"};
+      // the vector variants of libm the kernels may call
+      if (mVectorLibrary && LoadVectorLibrary())
+        Arguments.push_back("-lmvec");
+      string Error;
+      if (llvm::sys::ExecuteAndWait(*Linker, Arguments, llvm::None, {}, 0, 0, &Error) != 0) {
+        std::cerr << "Failed to link " << FileName << ": " << Error << "\n";
+        Success = false;
+      }
+    }
+    llvm::sys::fs::remove(ObjectName);
+  }
+  if (Success) {
+    llvm::SmallString<128> HeaderName(FileName);
+    llvm::sys::path::replace_extension(HeaderName, "h");
+    Success = WriteHeader(*mModule, HeaderName.str().str());
+    if (Success)
+      std::cerr << "Wrote " << FileName << " and " << HeaderName.str().str() << "\n";
+  }
+  // the module never goes to the JIT, so it has to go before its context
+  mModule.reset();
+  InitializeModuleAndPassManager();
+  return Success;
+}
@@ -5,18 +5,28 @@
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/Value.h>
 #include <llvm/IR/Module.h>
-#include <llvm/IR/LegacyPassManager.h>
 #include <llvm/Support/Error.h>
+#include <llvm/Target/TargetMachine.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <map>
+#include <set>
 #include <string>
 #include <memory>
+#include <mutex>
+#include <thread>
 #include <tuple>
 #include <vector>
 
 #include "Parser.h"
 #include "KaleidoscopeJIT.h"
+#include "ThreadPool.h"
+#include "VirtualMachine.h"
 
 using std::map;
+using std::set;
 using std::string;
 using std::unique_ptr;
 using std::tuple;
@@ -26,7 +36,6 @@ using llvm::LLVMContext;
 using llvm::IRBuilder;
 using llvm::Module;
 using llvm::Value;
-using llvm::legacy::FunctionPassManager;
 using llvm::orc::KaleidoscopeJIT;
 using llvm::AllocaInst;
 using llvm::orc::ThreadSafeModule;
@@ -34,32 +43,269 @@ using llvm::ExitOnError;
 
 static ExitOnError ExitOnErr;
 
+/// FPMode - How closely floating-point code follows IEEE semantics.
+enum class FPMode {
+  Strict,    // every operation is rounded as written
+  Contract,  // a*b+c may be fused into a multiply-add
+  Fast,      // all fast-math flags: reassociation, no NaNs or infinities...
+};
+
+string_view GetFPModeName(FPMode Mode);
+// Parse "strict", "contract" or "fast"; false for anything else.
+bool ParseFPMode(string_view Name, FPMode& Mode);
+
+/// BatchFunction - A compiled <name>_batch kernel, see
+/// FunctionAST::codegenBatch.
+using BatchFunction = void (*)(const double* const* Columns, double* Out,
+                               size_t N);
+
 class Driver {
 public:
-  Driver(const Parser& p);
+  // CPU and Features select the target of the JIT, see
+  // KaleidoscopeJIT::Create; by default it is the host CPU.
+  Driver(const Parser& p, const string& CPU = "", const string& Features = "");
+  ~Driver();
+  // Print the target CPU and the instruction sets the code will use.
+  void PrintTargetInfo() const;
   void HandleTopLevelExpression();
   void HandleExtern();
   void HandleDefinition();
+  // REPL commands are lines starting with ':'.
+  void HandleCommand(const string& Line);
   void LoadLibraryFunctions();
   void MainLoop();
-  tuple<string, double> traverseAST(const ExprAST* Node) const;
+  void RunFile(const string& FileName);
+  // Handle the statements in Source as if they were a script file.
+  void RunSource(const string& Source);
+  // Simplify function bodies before codegen (on by default).
+  void setSimplify(bool Simplify) {
+    mSimplify = Simplify;
+  }
+  // Run the e-graph optimizer on function bodies (off by default).
+  void setEGraph(bool EGraph) {
+    mEGraph = EGraph;
+  }
+  // An if whose arms cost at most this much in total (see
+  // ExprArena::SpeculationCost) is emitted as a select instead of branches;
+  // a negative value turns selects off.
+  void setSelectCost(double Cost) {
+    mSelectCost = Cost;
+  }
+  double getSelectCost() const {
+    return mSelectCost;
+  }
+  // Let the batch kernels call the vector variants of libm functions from
+  // glibc's libmvec, when it can be loaded (on by default).
+  void setVectorLibrary(bool VectorLibrary) {
+    mVectorLibrary = VectorLibrary;
+  }
+  // The mode of the definitions and expressions compiled from now on.  A
+  // definition keeps the mode it was compiled with, also for its kernel.
+  void setFPMode(FPMode Mode);
+  FPMode getFPMode() const {
+    return mFPMode;
+  }
+  // Optimization level 0 to 3 of the pipeline run over each module, like
+  // -O0 to -O3 of clang (2 by default).  Batch kernels get at least 2.
+  void setOptLevel(unsigned Level) {
+    mOptLevel = std::min(Level, 3u);
+  }
+  unsigned getOptLevel() const {
+    return mOptLevel;
+  }
+  // Link the IR of the definitions a module calls into it before it is
+  // optimized, so that they can be inlined (off by default).
+  void setInlineDefinitions(bool InlineDefinitions) {
+    mInlineDefinitions = InlineDefinitions;
+  }
+  // Compile new definitions quickly at -O0 behind stubs that count the
+  // calls, and recompile a definition at -O3 on a background thread once it
+  // has been called TierUpCalls times (off by default).
+  void setTiered(bool Tiered) {
+    mTiered = Tiered;
+  }
+  // The VM calls the native code of a definition after as many calls.
+  void setTierUpCalls(uint64_t TierUpCalls) {
+    mTierUpCalls = std::max<uint64_t>(TierUpCalls, 1);
+  }
+  uint64_t getTierUpCalls() const {
+    return mTierUpCalls;
+  }
+  // Keep the objects of the definitions in Directory and load them from
+  // there in later sessions; empty to disable (the default).
+  bool setCacheDirectory(const string& Directory);
+  // Print the time spent in each pass whenever a module is optimized.
+  void setTimePasses(bool TimePasses) {
+    mTimePasses = TimePasses;
+  }
+  // Run the top-level expressions and the definitions they call on the
+  // bytecode VM instead of the JIT in the strict floating-point mode, with
+  // the same results (on by default).
+  void setInterpret(bool Interpret) {
+    mInterpret = Interpret;
+  }
+  // Compile the consecutive definitions of a script into one module and
+  // optimize them together, when an expression or a command needs them,
+  // instead of one module per definition (off by default).  The JIT still
+  // compiles each definition on its first call.  In the REPL the lines
+  // between "begin" and "end" are compiled this way.
+  void setSingleModule(bool SingleModule) {
+    mSingleModule = SingleModule;
+  }
+  // Compile every definition with its derivatives (and its batch kernel if
+  // Batch) into one optimized module, written to FileName as a shared
+  // library if it ends in .so and as an object file otherwise, next to a C
+  // header of the prototypes with the extension .h.
+  bool CompileDefinitions(const string& FileName, bool Batch);
+  // Threads used by EvaluateBatch, 0 for one per hardware thread.
+  void setThreads(unsigned NumThreads);
+  // Evaluate the top-level expression FnAST on the VM.  False if it needs
+  // the JIT, e.g. for a call of a library function of more than 6
+  // arguments.
+  bool InterpretExpression(const FunctionAST& FnAST, double& Result);
   static void traverseAST(const PrototypeAST* Node) ;
-  void traverseAST(const FunctionAST* Node) const;
+  // Print the bytecode of Node, and run it if it has no arguments.
+  void traverseAST(const FunctionAST* Node);
+  // The address of the native code of a function, 0 if it has none.
+  llvm::JITTargetAddress getFunctionAddress(const string& Name);
   void InitializeModuleAndPassManager();
   Function *getFunction(const string& Name);
+  // Declaration of grad_<Name> in the current module.
+  Function *getGradientFunction(const string& Name);
+  // Declaration of dual_<Name> in the current module.
+  Function *getDualFunction(const string& Name);
+  // The <Name>_batch kernel of a definition, compiled on first use; null if
+  // Name is not a definition or the kernel fails to compile.
+  BatchFunction getBatchFunction(const string& Name);
+  // Evaluate Name over N rows with its batch kernel, in chunks spread over
+  // the thread pool.  Out[i] is the value for row i whatever the number of
+  // threads.  Returns false if there is no kernel for Name.
+  bool EvaluateBatch(const string& Name, const double* const* Columns,
+                     double* Out, size_t N);
   AllocaInst *CreateEntryBlockAlloca(Function* TheFunction, const string& VarName);
   // currently I do not have a clear idea for avoiding this public maps...
   // TODO: check the function signature!
   map<string, unique_ptr<PrototypeAST>> mFunctionProtos;
-  map<string, unique_ptr<FunctionAST>> mDerivativeFunctions;
+  // functions whose grad_<name> has been compiled
+  set<string> mGradientFunctions;
+  // functions whose dual_<name> has been compiled
+  set<string> mDualFunctions;
 private:
+  void HandleDual(const string& Arguments);
+  void HandleBatch(const string& Arguments);
+  void HandleThreads(const string& Arguments);
+  void HandleFPMode(const string& Arguments);
+  void HandleOptLevel(const string& Arguments);
+  void HandleTimePasses(const string& Arguments);
+  void HandleInline(const string& Arguments);
+  void HandleTiered(const string& Arguments);
+  using Bitcode = llvm::SmallVector<char, 0>;
+  std::shared_ptr<const Bitcode> WriteBitcode(const Module& M) const;
+  // Keep IR, the (optimized) module M, for the functions it defines.
+  void SaveBitcode(const Module& M, std::shared_ptr<const Bitcode> IR);
+  // A hash of IR, the current module, and of the settings its object
+  // depends on.
+  string getCacheKey(const Bitcode& IR, unsigned Level);
+  // The IR of the definitions M calls, in the order of M.
+  vector<std::shared_ptr<const Bitcode>> getCalleeBitcode(const Module& M);
+  // Link available_externally copies of the definitions M calls into it.
+  void LinkDefinitions(Module& M);
+  // Give the functions of M the attributes of Mode and run the -O<Level>
+  // pipeline, with the cost model of TM, over it.
+  void OptimizeModule(Module& M, FPMode Mode, unsigned Level, llvm::TargetMachine& TM);
+  void OptimizeModule(FPMode Mode, unsigned Level) {
+    OptimizeModule(*mModule, Mode, Level, *mTargetMachine);
+  }
+  // Hand the current module over to the JIT, to be compiled without
+  // optimization if Baseline, and start a new one.
+  void SubmitModule(llvm::orc::ResourceTrackerSP RT = nullptr, bool Baseline = false);
+  /// TieredDefinition - A definition whose functions are called through
+  /// stubs, and the IR to recompile them from.
+  struct TieredDefinition {
+    string mName;
+    vector<string> mFunctions;
+    std::shared_ptr<const Bitcode> mBitcode;
+    FPMode mMode;
+  };
+  /// PendingDefinition - A definition compiled into the current module,
+  /// waiting for SubmitDefinitions.
+  struct PendingDefinition {
+    string mName;
+    // every function of the definition: f, grad_f, d<f>_d<x>, dual_f
+    vector<Function *> mFunctions;
+    Function *mFunction;
+    Function *mGradient;
+    Function *mDual;
+  };
+  // Optimize the pending definitions and hand them over to the JIT.
+  void SubmitDefinitions();
+  // Move the functions of each pending definition out of the current
+  // module into a module of its own, calling the others through
+  // declarations.
+  vector<unique_ptr<Module>> SplitDefinitions();
+  // Submit TSM, the definition Name, as tier 0: every function f is
+  // compiled as f.tier0, counting its calls, and f becomes a stub jumping
+  // to it.
+  void SubmitTierZero(const string& Name, std::shared_ptr<const Bitcode> IR,
+                      ThreadSafeModule TSM, llvm::orc::ResourceTrackerSP RT);
+  // Called by tier-0 code once definition Id has been called often enough.
+  static void TierUpCallback(Driver *TheDriver, uint32_t Id);
+  void TierUpLoop();
+  // Compile the functions of Definition as f.tier1 at -O3 and point their
+  // stubs at them.
+  void TierUp(const TieredDefinition& Definition, llvm::TargetMachine& TM);
+  void RunBufferedInput();
+  // Load libmvec into the process for the JIT to link against.
+  bool LoadVectorLibrary();
+  Function *CreatePartialDerivative(const FunctionAST& FnAST, size_t ArgIndex);
+  void SimplifyFunction(FunctionAST& FnAST) const;
+  void SaturateFunction(FunctionAST& FnAST) const;
   Parser mParser;
   unique_ptr<LLVMContext> mContext;
   unique_ptr<IRBuilder<>> mBuilder;
   unique_ptr<Module> mModule;
-  unique_ptr<FunctionPassManager> mFPM;
   unique_ptr<KaleidoscopeJIT> mJIT;
+  // the JIT's target, whose cost model drives the vectorizers
+  unique_ptr<llvm::TargetMachine> mTargetMachine;
+  // the definitions, kept to build kernels from them later
+  map<string, unique_ptr<FunctionAST>> mDefinitions;
+  vector<string> mDefinitionOrder;
+  vector<PendingDefinition> mPendingDefinitions;
+  map<string, llvm::JITTargetAddress> mFunctionAddresses;
+  VirtualMachine mVM{*this};
+  map<string, BatchFunction> mBatchFunctions;
+  map<string, FPMode> mDefinitionFPModes;
+  // optimized bitcode of the module defining each function, shared by the
+  // functions of a module (f, grad_f, dual_f...)
+  map<string, std::shared_ptr<const Bitcode>> mBitcode;
+  std::mutex mBitcodeMutex;
+  // The tier-up thread is started by the first request.  mTierUpMutex
+  // guards the definitions, the queue of requests and mTierUpStop.
+  vector<TieredDefinition> mTieredDefinitions;
+  std::deque<uint32_t> mTierUpQueue;
+  std::mutex mTierUpMutex;
+  std::condition_variable mTierUpReady;
+  std::thread mTierUpThread;
+  bool mTierUpStop = false;
+  // created on the first EvaluateBatch
+  unique_ptr<ThreadPool> mThreadPool;
+  unsigned mNumThreads = 0;
   map<string, AllocaInst*> mNamedValues;
+  bool mSimplify = true;
+  bool mInterpret = true;
+  bool mEGraph = false;
+  double mSelectCost = 40.0;
+  // the settings read by the tier-up thread are atomic
+  std::atomic<bool> mVectorLibrary{true};
+  FPMode mFPMode = FPMode::Strict;
+  unsigned mOptLevel = 2;
+  std::atomic<bool> mInlineDefinitions{false};
+  std::atomic<bool> mTimePasses{false};
+  bool mTiered = false;
+  uint64_t mTierUpCalls = 1000;
+  bool mSingleModule = false;
+  // definitions are collected in the current module until SubmitDefinitions
+  bool mDefinitionBlock = false;
 };
 
 #endif // DRIVER_H
@@ -0,0 +1,637 @@
+#include "EGraph.h"
+#include "Library.h"
+#include <llvm/ADT/Hashing.h>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <utility>
+
+size_t ENodeHash::operator()(const ENode& Node) const {
+  return llvm::hash_combine(
+    static_cast<uint8_t>(Node.mKind), static_cast<uint8_t>(Node.mOperator),
+    Node.mSymbol,
+    llvm::hash_combine_range(Node.mChildren.begin(), Node.mChildren.end()));
+}
+
+bool EGraph::CanOptimize(const ExprArena& Arena, ExprIndex Root) {
+  for (const ExprIndex Index : Arena.CollectNodes(Root)) {
+    if (Arena.getKind(Index) == ExprKind::For ||
+        (Arena.getKind(Index) == ExprKind::Binary &&
+         Arena.getOperator(Index) == BinaryOp::Assign))
+      return false;
+  }
+  return true;
+}
+
+EClassId EGraph::AddExpr(ExprIndex Root) {
+  std::unordered_map<ExprIndex, EClassId> Added;
+  // operands are created before their users, so adding the reachable nodes
+  // in index order adds every operand first
+  vector<ExprIndex> Nodes = mArena.CollectNodes(Root);
+  std::sort(Nodes.begin(), Nodes.end());
+  for (const ExprIndex Index : Nodes) {
+    ENode Node{mArena.getKind(Index), mArena.getOperator(Index), 0, {}};
+    switch (Node.mKind) {
+      case ExprKind::Number:
+      case ExprKind::Variable:
+        Node.mSymbol = Index;
+        break;
+      case ExprKind::Call:
+        Node.mSymbol = InternName(mArena.getName(Index));
+        break;
+      default:
+        break;
+    }
+    for (const ExprIndex Operand : mArena.getOperands(Index))
+      Node.mChildren.push_back(Added.at(Operand));
+    Added[Index] = Add(move(Node));
+  }
+  Rebuild();
+  return Find(Added.at(Root));
+}
+
+uint32_t EGraph::InternName(const string& Name) {
+  const auto [It, Inserted] = mNameIndices.try_emplace(Name, mNames.size());
+  if (Inserted) {
+    mNames.push_back(Name);
+  }
+  return It->second;
+}
+
+EClassId EGraph::Find(EClassId Id) {
+  while (mParents[Id] != Id) {
+    mParents[Id] = mParents[mParents[Id]];
+    Id = mParents[Id];
+  }
+  return Id;
+}
+
+static std::optional<double> FoldBinary(BinaryOp Op, double L, double R) {
+  switch (Op) {
+    case BinaryOp::Add: return L + R;
+    case BinaryOp::Subtract: return L - R;
+    case BinaryOp::Multiply: return L * R;
+    case BinaryOp::Divide: return L / R;
+    // as codegen computes '^', like the simplifier
+    case BinaryOp::Power: return EvaluatePower(L, R, true, true);
+    case BinaryOp::Less: return !(L >= R) ? 1.0 : 0.0;
+    default: return std::nullopt;
+  }
+}
+
+EClassId EGraph::Add(ENode Node) {
+  for (auto& Child : Node.mChildren)
+    Child = Find(Child);
+  const auto Found = mMemo.find(Node);
+  if (Found != mMemo.end())
+    return Find(Found->second);
+  const EClassId Id = mClasses.size();
+  mParents.push_back(Id);
+  EClass Class;
+  std::optional<double> Folded;
+  if (Node.mKind == ExprKind::Number) {
+    Class.mConstant = mArena.getNumber(Node.mSymbol);
+  } else if (Node.mKind == ExprKind::Binary) {
+    const auto L = getConstant(Node.mChildren[0]);
+    const auto R = getConstant(Node.mChildren[1]);
+    if (L && R)
+      Folded = FoldBinary(Node.mOperator, *L, *R);
+  }
+  mMemo.emplace(Node, Id);
+  Class.mNodes.push_back(move(Node));
+  mClasses.push_back(move(Class));
+  mChanged = true;
+  if (Folded)
+    return Union(Id, AddNumber(*Folded));
+  return Id;
+}
+
+EClassId EGraph::Union(EClassId A, EClassId B) {
+  A = Find(A);
+  B = Find(B);
+  if (A == B)
+    return A;
+  if (mClasses[A].mNodes.size() < mClasses[B].mNodes.size())
+    std::swap(A, B);
+  mParents[B] = A;
+  auto& Nodes = mClasses[A].mNodes;
+  for (auto& Node : mClasses[B].mNodes)
+    Nodes.push_back(move(Node));
+  mClasses[B].mNodes.clear();
+  if (!mClasses[A].mConstant)
+    mClasses[A].mConstant = mClasses[B].mConstant;
+  mChanged = true;
+  return A;
+}
+
+// Restore the invariants after unions: the children of every node refer to
+// canonical classes, and congruent nodes (same operator, same children) are
+// in the same class.
+void EGraph::Rebuild() {
+  bool Merged = true;
+  while (Merged) {
+    Merged = false;
+    mMemo.clear();
+    vector<std::pair<EClassId, EClassId>> Congruent;
+    vector<std::pair<EClassId, double>> Folded;
+    for (EClassId Id = 0; Id < mClasses.size(); ++Id) {
+      if (Find(Id) != Id)
+        continue;
+      vector<ENode> Nodes;
+      for (ENode Node : mClasses[Id].mNodes) {
+        for (auto& Child : Node.mChildren)
+          Child = Find(Child);
+        const auto [It, Inserted] = mMemo.try_emplace(Node, Id);
+        if (!Inserted) {
+          // a duplicate within the class is dropped
+          if (It->second != Id)
+            Congruent.emplace_back(It->second, Id);
+          continue;
+        }
+        // a child may have become constant through a union
+        if (Node.mKind == ExprKind::Binary && !mClasses[Id].mConstant) {
+          const auto L = getConstant(Node.mChildren[0]);
+          const auto R = getConstant(Node.mChildren[1]);
+          if (L && R) {
+            if (const auto Val = FoldBinary(Node.mOperator, *L, *R))
+              Folded.emplace_back(Id, *Val);
+          }
+        }
+        Nodes.push_back(move(Node));
+      }
+      mClasses[Id].mNodes = move(Nodes);
+    }
+    for (const auto& [A, B] : Congruent) {
+      Merged |= Find(A) != Find(B);
+      Union(A, B);
+    }
+    for (const auto& [Id, Val] : Folded) {
+      const EClassId Number = AddNumber(Val);
+      Merged |= Find(Id) != Find(Number);
+      Union(Id, Number);
+    }
+  }
+}
+
+std::optional<double> EGraph::getConstant(EClassId Id) {
+  return mClasses[Find(Id)].mConstant;
+}
+
+vector<ENode> EGraph::getNodes(EClassId Id) {
+  return mClasses[Find(Id)].mNodes;
+}
+
+EClassId EGraph::AddNumber(double Val) {
+  return Add(ENode{ExprKind::Number, BinaryOp::None, mArena.CreateNumber(Val), {}});
+}
+
+EClassId EGraph::AddBinary(BinaryOp Op, EClassId LHS, EClassId RHS) {
+  return Add(ENode{ExprKind::Binary, Op, 0, {LHS, RHS}});
+}
+
+EClassId EGraph::AddCall(uint32_t Callee, EClassId Arg) {
+  return Add(ENode{ExprKind::Call, BinaryOp::None, Callee, {Arg}});
+}
+
+EClassId EGraph::AddIf(EClassId Cond, EClassId Then, EClassId Else) {
+  return Add(ENode{ExprKind::If, BinaryOp::None, 0, {Cond, Then, Else}});
+}
+
+void EGraph::Saturate(unsigned MaxIterations, size_t MaxNodes) {
+  mCosts.clear();
+  mMaxNodes = MaxNodes;
+  for (unsigned Iteration = 0; Iteration < MaxIterations; ++Iteration) {
+    mChanged = false;
+    const size_t NumClasses = mClasses.size();
+    for (EClassId Id = 0; Id < NumClasses && !isFull(); ++Id) {
+      // a constant is extracted as a number, rewriting it only adds
+      // arithmetic on constants (1*1, 1^2...) that folds to new constants
+      if (Find(Id) != Id || mClasses[Id].mConstant)
+        continue;
+      for (const ENode& Node : getNodes(Id)) {
+        if (isFull())
+          break;
+        ApplyRules(Find(Id), Node);
+      }
+    }
+    Rebuild();
+    if (!mChanged || isFull())
+      break;
+  }
+}
+
+void EGraph::ApplyRules(EClassId Id, const ENode& Node) {
+  switch (Node.mKind) {
+    case ExprKind::Binary:
+      ApplyBinaryRules(Id, Node);
+      break;
+    case ExprKind::Call:
+      if (Node.mChildren.size() == 1)
+        ApplyCallRules(Id, Node);
+      break;
+    case ExprKind::If:
+      ApplyIfRules(Id, Node);
+      break;
+    default:
+      break;
+  }
+}
+
+static bool IsBinary(const ENode& Node, BinaryOp Op) {
+  return Node.mKind == ExprKind::Binary && Node.mOperator == Op;
+}
+
+// Whether C is +0, or -0 if Negative.
+static bool IsZero(const std::optional<double>& C, bool Negative) {
+  return C && *C == 0.0 && std::signbit(*C) == Negative;
+}
+
+static bool IsInteger(const std::optional<double>& C) {
+  return C && std::isfinite(*C) && *C == std::trunc(*C);
+}
+
+static bool IsPositive(const std::optional<double>& C) {
+  return C && std::isfinite(*C) && *C > 0.0;
+}
+
+void EGraph::ApplyBinaryRules(EClassId Id, const ENode& Node) {
+  const BinaryOp Op = Node.mOperator;
+  const EClassId A = Find(Node.mChildren[0]);
+  const EClassId B = Find(Node.mChildren[1]);
+  const auto CA = getConstant(A);
+  const auto CB = getConstant(B);
+  const uint32_t Log = InternName("log");
+  const uint32_t Exp = InternName("exp");
+  auto IsCall = [](const ENode& N, uint32_t Callee) {
+    return N.mKind == ExprKind::Call && N.mSymbol == Callee && N.mChildren.size() == 1;
+  };
+  const vector<ENode> NodesA = getNodes(A);
+  const vector<ENode> NodesB = getNodes(B);
+  switch (Op) {
+    case BinaryOp::Add:
+    case BinaryOp::Subtract:
+      // x + (-0) and x - 0 are x, but -0 + 0 and -0 - (-0) are 0
+      if (mFastMath ? CB && *CB == 0.0 : IsZero(CB, Op == BinaryOp::Add))
+        Union(Id, A);
+      if (Op == BinaryOp::Add) {
+        // commutativity and associativity
+        Union(Id, AddBinary(Op, B, A));
+        if (mFastMath ? CA && *CA == 0.0 : IsZero(CA, true))
+          Union(Id, B);
+        if (mFastMath) {
+          for (const ENode& N : NodesA) {
+            if (IsBinary(N, BinaryOp::Add))
+              Union(Id, AddBinary(Op, N.mChildren[0], AddBinary(Op, N.mChildren[1], B)));
+          }
+        }
+        if (A == B)
+          Union(Id, AddBinary(BinaryOp::Multiply, AddNumber(2.0), A));
+      } else if (A == B && mFastMath) {
+        // x - x is NaN for infinite x
+        Union(Id, AddNumber(0.0));
+      }
+      if (!mFastMath)
+        break;
+      for (const ENode& NA : NodesA) {
+        if (isFull())
+          break;
+        for (const ENode& NB : NodesB) {
+          // factoring: a*b +- a*c = a*(b +- c), b*a +- c*a = (b +- c)*a
+          if (IsBinary(NA, BinaryOp::Multiply) && IsBinary(NB, BinaryOp::Multiply)) {
+            if (Find(NA.mChildren[0]) == Find(NB.mChildren[0]))
+              Union(Id, AddBinary(BinaryOp::Multiply, NA.mChildren[0],
+                                  AddBinary(Op, NA.mChildren[1], NB.mChildren[1])));
+            if (Find(NA.mChildren[1]) == Find(NB.mChildren[1]))
+              Union(Id, AddBinary(BinaryOp::Multiply,
+                                  AddBinary(Op, NA.mChildren[0], NB.mChildren[0]),
+                                  NA.mChildren[1]));
+          }
+          // log(a) +- log(b) = log(a */ b)
+          if (IsCall(NA, Log) && IsCall(NB, Log)) {
+            const BinaryOp Inner = Op == BinaryOp::Add ? BinaryOp::Multiply : BinaryOp::Divide;
+            Union(Id, AddCall(Log, AddBinary(Inner, NA.mChildren[0], NB.mChildren[0])));
+          }
+        }
+      }
+      break;
+    case BinaryOp::Multiply:
+      Union(Id, AddBinary(Op, B, A));
+      // 0 * x is NaN for infinite or NaN x
+      if (mFastMath && ((CA && *CA == 0.0) || (CB && *CB == 0.0)))
+        Union(Id, AddNumber(0.0));
+      if (CA && *CA == 1.0)
+        Union(Id, B);
+      if (CB && *CB == 1.0)
+        Union(Id, A);
+      if (A == B)
+        Union(Id, AddBinary(BinaryOp::Power, A, AddNumber(2.0)));
+      for (const ENode& N : NodesA) {
+        if (mFastMath && IsBinary(N, BinaryOp::Multiply))
+          Union(Id, AddBinary(Op, N.mChildren[0], AddBinary(Op, N.mChildren[1], B)));
+        // x^p * x = x^(p+1), which is 1 rather than NaN for x = 0, p = -1
+        if (IsBinary(N, BinaryOp::Power) && Find(N.mChildren[0]) == B &&
+            (mFastMath || (IsInteger(getConstant(N.mChildren[1])) &&
+                           *getConstant(N.mChildren[1]) >= 0.0)))
+          Union(Id, AddBinary(BinaryOp::Power, B,
+                              AddBinary(BinaryOp::Add, N.mChildren[1], AddNumber(1.0))));
+      }
+      if (!mFastMath)
+        break;
+      for (const ENode& N : NodesB) {
+        // distributivity
+        if (IsBinary(N, BinaryOp::Add) || IsBinary(N, BinaryOp::Subtract))
+          Union(Id, AddBinary(N.mOperator, AddBinary(Op, A, N.mChildren[0]),
+                              AddBinary(Op, A, N.mChildren[1])));
+      }
+      for (const ENode& NA : NodesA) {
+        if (isFull())
+          break;
+        for (const ENode& NB : NodesB) {
+          // x^p * x^q = x^(p+q)
+          if (IsBinary(NA, BinaryOp::Power) && IsBinary(NB, BinaryOp::Power) &&
+              Find(NA.mChildren[0]) == Find(NB.mChildren[0]))
+            Union(Id, AddBinary(BinaryOp::Power, NA.mChildren[0],
+                                AddBinary(BinaryOp::Add, NA.mChildren[1], NB.mChildren[1])));
+          // exp(a) * exp(b) = exp(a+b)
+          if (IsCall(NA, Exp) && IsCall(NB, Exp))
+            Union(Id, AddCall(Exp, AddBinary(BinaryOp::Add, NA.mChildren[0], NB.mChildren[0])));
+        }
+      }
+      break;
+    case BinaryOp::Divide:
+      if (CB && *CB == 1.0)
+        Union(Id, A);
+      if (!mFastMath)
+        break;
+      // x / x is NaN for x = 0 or infinite x
+      if (A == B)
+        Union(Id, AddNumber(1.0));
+      for (const ENode& NA : NodesA) {
+        if (isFull())
+          break;
+        for (const ENode& NB : NodesB) {
+          // x^p / x^q = x^(p-q)
+          if (IsBinary(NA, BinaryOp::Power) && IsBinary(NB, BinaryOp::Power) &&
+              Find(NA.mChildren[0]) == Find(NB.mChildren[0]))
+            Union(Id, AddBinary(BinaryOp::Power, NA.mChildren[0],
+                                AddBinary(BinaryOp::Subtract, NA.mChildren[1], NB.mChildren[1])));
+          // exp(a) / exp(b) = exp(a-b)
+          if (IsCall(NA, Exp) && IsCall(NB, Exp))
+            Union(Id, AddCall(Exp, AddBinary(BinaryOp::Subtract, NA.mChildren[0], NB.mChildren[0])));
+        }
+      }
+      break;
+    case BinaryOp::Power:
+      if (CB) {
+        if (*CB == 0.0) {
+          Union(Id, AddNumber(1.0));
+        } else if (*CB == 1.0) {
+          Union(Id, A);
+        } else if (*CB == -1.0) {
+          Union(Id, AddBinary(BinaryOp::Divide, AddNumber(1.0), A));
+        } else if (*CB >= 2.0 && *CB <= 8.0 && *CB == std::floor(*CB)) {
+          // small integer powers as products: x^n = x * x^(n-1)
+          Union(Id, AddBinary(BinaryOp::Multiply, A,
+                              AddBinary(BinaryOp::Power, A, AddNumber(*CB - 1.0))));
+        }
+      }
+      if (CA && *CA == 1.0)
+        Union(Id, AddNumber(1.0));
+      for (const ENode& N : NodesA) {
+        // (x^p)^q = x^(p*q) holds for integers p and q, or a positive x;
+        // (x^2)^0.5 is |x|
+        if (IsBinary(N, BinaryOp::Power) &&
+            (mFastMath || (IsInteger(getConstant(N.mChildren[1])) && IsInteger(CB)) ||
+             IsPositive(getConstant(N.mChildren[0]))))
+          Union(Id, AddBinary(BinaryOp::Power, N.mChildren[0],
+                              AddBinary(BinaryOp::Multiply, N.mChildren[1], B)));
+      }
+      break;
+    default:
+      break;
+  }
+  // if hoisting: (if c then x else y) op b = if c then x op b else y op b
+  if (Op == BinaryOp::Less || isFull())
+    return;
+  for (const ENode& N : NodesA) {
+    if (N.mKind == ExprKind::If)
+      Union(Id, AddIf(N.mChildren[0], AddBinary(Op, N.mChildren[1], B),
+                      AddBinary(Op, N.mChildren[2], B)));
+  }
+  for (const ENode& N : NodesB) {
+    if (N.mKind == ExprKind::If)
+      Union(Id, AddIf(N.mChildren[0], AddBinary(Op, A, N.mChildren[1]),
+                      AddBinary(Op, A, N.mChildren[2])));
+  }
+}
+
+void EGraph::ApplyCallRules(EClassId Id, const ENode& Node) {
+  const uint32_t Log = InternName("log");
+  const uint32_t Exp = InternName("exp");
+  const EClassId X = Find(Node.mChildren[0]);
+  if (Node.mSymbol != Log && Node.mSymbol != Exp)
+    return;
+  const uint32_t Inverse = Node.mSymbol == Log ? Exp : Log;
+  // Outside the fast mode, the identities are only used where they are known
+  // to hold: log of a non-positive number is NaN or -inf, and exp overflows.
+  // a^b and exp(b * log(a)) differ for a = 1 and an infinite b.
+  auto IsPositiveNotOne = [this](EClassId Id) {
+    const auto C = getConstant(Id);
+    return IsPositive(C) && *C != 1.0;
+  };
+  for (const ENode& N : getNodes(X)) {
+    // log(exp(y)) = y and exp(log(y)) = y
+    if (N.mKind == ExprKind::Call && N.mSymbol == Inverse && N.mChildren.size() == 1) {
+      if (mFastMath || (Inverse == Log && IsPositive(getConstant(N.mChildren[0]))))
+        Union(Id, N.mChildren[0]);
+      continue;
+    }
+    if (N.mKind != ExprKind::Binary)
+      continue;
+    const EClassId A = N.mChildren[0];
+    const EClassId B = N.mChildren[1];
+    if (Node.mSymbol == Log) {
+      const bool InDomain = mFastMath ||
+        (IsPositive(getConstant(A)) && IsPositive(getConstant(B)));
+      switch (N.mOperator) {
+        case BinaryOp::Multiply:
+          if (InDomain)
+            Union(Id, AddBinary(BinaryOp::Add, AddCall(Log, A), AddCall(Log, B)));
+          break;
+        case BinaryOp::Divide:
+          if (InDomain)
+            Union(Id, AddBinary(BinaryOp::Subtract, AddCall(Log, A), AddCall(Log, B)));
+          break;
+        case BinaryOp::Power:
+          if (mFastMath || IsPositiveNotOne(A))
+            Union(Id, AddBinary(BinaryOp::Multiply, B, AddCall(Log, A)));
+          break;
+        default:
+          break;
+      }
+    } else {
+      switch (N.mOperator) {
+        case BinaryOp::Add:
+          if (mFastMath)
+            Union(Id, AddBinary(BinaryOp::Multiply, AddCall(Exp, A), AddCall(Exp, B)));
+          break;
+        case BinaryOp::Subtract:
+          if (mFastMath)
+            Union(Id, AddBinary(BinaryOp::Divide, AddCall(Exp, A), AddCall(Exp, B)));
+          break;
+        case BinaryOp::Multiply:
+          // exp(b * log(a)) = a^b
+          for (const ENode& M : getNodes(A)) {
+            if (M.mKind == ExprKind::Call && M.mSymbol == Log && M.mChildren.size() == 1 &&
+                (mFastMath || IsPositiveNotOne(M.mChildren[0])))
+              Union(Id, AddBinary(BinaryOp::Power, M.mChildren[0], B));
+          }
+          break;
+        default:
+          break;
+      }
+    }
+  }
+}
+
+void EGraph::ApplyIfRules(EClassId Id, const ENode& Node) {
+  const EClassId C = Find(Node.mChildren[0]);
+  const EClassId T = Find(Node.mChildren[1]);
+  const EClassId E = Find(Node.mChildren[2]);
+  if (const auto CC = getConstant(C)) {
+    Union(Id, (*CC < 0.0 || *CC > 0.0) ? T : E);
+    return;
+  }
+  if (T == E) {
+    Union(Id, T);
+    return;
+  }
+  // the reverse of the hoisting in ApplyBinaryRules:
+  // if c then x op b else y op b = (if c then x else y) op b
+  const vector<ENode> NodesE = getNodes(E);
+  for (const ENode& NT : getNodes(T)) {
+    if (isFull())
+      break;
+    for (const ENode& NE : NodesE) {
+      if (NT.mKind == ExprKind::Binary && NE.mKind == ExprKind::Binary &&
+          NT.mOperator == NE.mOperator && NT.mOperator != BinaryOp::Less) {
+        if (Find(NT.mChildren[1]) == Find(NE.mChildren[1]))
+          Union(Id, AddBinary(NT.mOperator, AddIf(C, NT.mChildren[0], NE.mChildren[0]),
+                              NT.mChildren[1]));
+        if (Find(NT.mChildren[0]) == Find(NE.mChildren[0]))
+          Union(Id, AddBinary(NT.mOperator, NT.mChildren[0],
+                              AddIf(C, NT.mChildren[1], NE.mChildren[1])));
+      }
+      // if c then f(x) else f(y) = f(if c then x else y)
+      if (NT.mKind == ExprKind::Call && NE.mKind == ExprKind::Call &&
+          NT.mSymbol == NE.mSymbol && NT.mChildren.size() == 1 &&
+          NE.mChildren.size() == 1)
+        Union(Id, AddCall(NT.mSymbol, AddIf(C, NT.mChildren[0], NE.mChildren[0])));
+    }
+  }
+}
+
+// Approximate latencies in cycles.  Calls into libm cost far more than any
+// arithmetic instruction, and pow is one of the slowest of them.
+double EGraph::NodeCost(const ENode& Node) {
+  switch (Node.mKind) {
+    case ExprKind::Number:
+    case ExprKind::Variable:
+      return 0.0;
+    case ExprKind::Binary:
+      if (Node.mOperator == BinaryOp::Power) {
+        // constant exponents are lowered to cheaper code
+        if (const auto Exponent = getConstant(Node.mChildren[1]))
+          return GetPowerCost(*Exponent);
+      }
+      return GetOperatorCost(Node.mOperator);
+    case ExprKind::Call:
+      return GetCallCost(mNames[Node.mSymbol]);
+    case ExprKind::If:
+      return 2.0;
+    default:
+      return std::numeric_limits<double>::infinity();
+  }
+}
+
+void EGraph::ComputeCosts() {
+  constexpr double Infinity = std::numeric_limits<double>::infinity();
+  mCosts.assign(mClasses.size(), Infinity);
+  mBestNodes.assign(mClasses.size(), ENode{});
+  mExtracted.clear();
+  bool Changed = true;
+  while (Changed) {
+    Changed = false;
+    for (EClassId Id = 0; Id < mClasses.size(); ++Id) {
+      if (Find(Id) != Id)
+        continue;
+      for (const ENode& Node : mClasses[Id].mNodes) {
+        double Cost = NodeCost(Node);
+        if (Node.mKind == ExprKind::If) {
+          // only one branch is executed
+          Cost += mCosts[Find(Node.mChildren[0])] +
+                  std::max(mCosts[Find(Node.mChildren[1])], mCosts[Find(Node.mChildren[2])]);
+        } else {
+          for (const EClassId Child : Node.mChildren)
+            Cost += mCosts[Find(Child)];
+        }
+        if (Cost < mCosts[Id]) {
+          mCosts[Id] = Cost;
+          mBestNodes[Id] = Node;
+          Changed = true;
+        }
+      }
+    }
+  }
+}
+
+double EGraph::getCost(EClassId Id) {
+  ComputeCosts();
+  return mCosts[Find(Id)];
+}
+
+ExprIndex EGraph::Extract(EClassId Id) {
+  if (mCosts.size() != mClasses.size())
+    ComputeCosts();
+  Id = Find(Id);
+  const auto Found = mExtracted.find(Id);
+  if (Found != mExtracted.end())
+    return Found->second;
+  const ENode Node = mBestNodes[Id];
+  vector<ExprIndex> Operands;
+  for (const EClassId Child : Node.mChildren)
+    Operands.push_back(Extract(Child));
+  ExprIndex Result = InvalidExpr;
+  switch (Node.mKind) {
+    case ExprKind::Number:
+    case ExprKind::Variable:
+      Result = Node.mSymbol;
+      break;
+    case ExprKind::Binary:
+      Result = mArena.CreateBinary(Node.mOperator, Operands[0], Operands[1]);
+      break;
+    case ExprKind::Call:
+      Result = mArena.CreateCall(mNames[Node.mSymbol], Operands);
+      break;
+    case ExprKind::If:
+      Result = mArena.CreateIf(Operands[0], Operands[1], Operands[2]);
+      break;
+    default:
+      break;
+  }
+  mExtracted.emplace(Id, Result);
+  return Result;
+}
+
+size_t EGraph::getNumberOfClasses() const {
+  size_t Count = 0;
+  for (EClassId Id = 0; Id < mParents.size(); ++Id) {
+    if (mParents[Id] == Id)
+      ++Count;
+  }
+  return Count;
+}
+
+size_t EGraph::getNumberOfNodes() const {
+  return mMemo.size();
+}
@@ -0,0 +1,101 @@
+#ifndef EGRAPH_H
+#define EGRAPH_H
+
+#include <llvm/ADT/SmallVector.h>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "AbstractSyntaxTree.h"
+
+using EClassId = uint32_t;
+
+/// ENode - An operator applied to e-classes.  Leaves (numbers and variables)
+/// refer to their node in the arena through mSymbol; for calls mSymbol is
+/// the index of the callee in the e-graph's name table.
+struct ENode {
+  ExprKind mKind;
+  BinaryOp mOperator;
+  uint32_t mSymbol;
+  llvm::SmallVector<EClassId, 3> mChildren;
+  bool operator==(const ENode& Other) const {
+    return mKind == Other.mKind && mOperator == Other.mOperator &&
+           mSymbol == Other.mSymbol && mChildren == Other.mChildren;
+  }
+};
+
+struct ENodeHash {
+  size_t operator()(const ENode& Node) const;
+};
+
+/// EGraph - Equality saturation over the expressions of an ExprArena.  An
+/// expression is loaded into the e-graph, algebraic rewrites add equivalent
+/// forms to the e-classes until nothing changes (or a size limit is hit), and
+/// the cheapest form under a latency-weighted cost model is extracted back
+/// into the arena.  Evaluation order is not preserved, so only expressions
+/// without '=' or loops can be loaded.
+/// By default the rewrites give the result of the original expression for
+/// every input, NaNs, infinities and negative numbers included: the
+/// identities of log, exp and powers are only used where their operands are
+/// known to be in range (e.g. log(a*b) = log(a) + log(b) for constants
+/// a, b > 0), and reassociation, distributivity, x-x = 0 and x/x = 1 are
+/// left out.  With FastMath every rewrite applies.
+class EGraph {
+public:
+  explicit EGraph(ExprArena& Arena, bool FastMath = false):
+    mArena(Arena), mFastMath(FastMath) {}
+  // Whether the expression at Root can be loaded.
+  static bool CanOptimize(const ExprArena& Arena, ExprIndex Root);
+  EClassId AddExpr(ExprIndex Root);
+  // Apply the rewrites until saturation, MaxIterations or MaxNodes.
+  void Saturate(unsigned MaxIterations = 8, size_t MaxNodes = 10000);
+  // Cost of the cheapest expression of an e-class.
+  double getCost(EClassId Id);
+  ExprIndex Extract(EClassId Id);
+  size_t getNumberOfClasses() const;
+  size_t getNumberOfNodes() const;
+private:
+  struct EClass {
+    vector<ENode> mNodes;
+    std::optional<double> mConstant;
+  };
+  // The rules stop adding nodes once the e-graph has reached mMaxNodes (a
+  // single rule may still overshoot it a little).
+  bool isFull() const {
+    return mMemo.size() >= mMaxNodes;
+  }
+  EClassId Find(EClassId Id);
+  EClassId Add(ENode Node);
+  EClassId Union(EClassId A, EClassId B);
+  void Rebuild();
+  void ComputeCosts();
+  double NodeCost(const ENode& Node);
+  uint32_t InternName(const string& Name);
+  // helpers for the rewrites
+  EClassId AddNumber(double Val);
+  EClassId AddBinary(BinaryOp Op, EClassId LHS, EClassId RHS);
+  EClassId AddCall(uint32_t Callee, EClassId Arg);
+  EClassId AddIf(EClassId Cond, EClassId Then, EClassId Else);
+  std::optional<double> getConstant(EClassId Id);
+  vector<ENode> getNodes(EClassId Id);
+  void ApplyRules(EClassId Id, const ENode& Node);
+  void ApplyBinaryRules(EClassId Id, const ENode& Node);
+  void ApplyCallRules(EClassId Id, const ENode& Node);
+  void ApplyIfRules(EClassId Id, const ENode& Node);
+  ExprArena& mArena;
+  const bool mFastMath;
+  vector<EClassId> mParents;
+  vector<EClass> mClasses;
+  std::unordered_map<ENode, EClassId, ENodeHash> mMemo;
+  vector<string> mNames;
+  std::unordered_map<string, uint32_t> mNameIndices;
+  vector<double> mCosts;
+  vector<ENode> mBestNodes;
+  std::unordered_map<EClassId, ExprIndex> mExtracted;
+  size_t mMaxNodes = 0;
+  bool mChanged = false;
+};
+
+#endif // EGRAPH_H
@@ -20,6 +20,7 @@
 #include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
 #include "llvm/ExecutionEngine/Orc/ExecutorProcessControl.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
 #include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
 #include "llvm/ExecutionEngine/SectionMemoryManager.h"
@@ -27,6 +28,8 @@
 #include "llvm/IR/LLVMContext.h"
 #include <memory>
 
+#include "DiskObjectCache.h"
+
 namespace llvm {
 namespace orc {
 
@@ -34,27 +37,48 @@ class KaleidoscopeJIT {
 private:
   std::unique_ptr<ExecutionSession> ES;
 
+  JITTargetMachineBuilder JTMB;
   DataLayout DL;
   MangleAndInterner Mangle;
 
+  // objects of earlier sessions, used by CompileLayer
+  DiskObjectCache ObjCache;
+
   RTDyldObjectLinkingLayer ObjectLayer;
   IRCompileLayer CompileLayer;
+  // code generation without optimization, for tier 0
+  IRCompileLayer BaselineCompileLayer;
 
   JITDylib &MainJD;
 
+  // stubs whose target can be switched while the program runs
+  std::unique_ptr<IndirectStubsManager> StubsMgr;
+
+  static JITTargetMachineBuilder
+  getBaselineTargetMachineBuilder(JITTargetMachineBuilder JTMB) {
+    JTMB.setCodeGenOptLevel(CodeGenOpt::None);
+    return JTMB;
+  }
+
 public:
   KaleidoscopeJIT(std::unique_ptr<ExecutionSession> ES,
                   JITTargetMachineBuilder JTMB, DataLayout DL)
-      : ES(std::move(ES)), DL(std::move(DL)), Mangle(*this->ES, this->DL),
+      : ES(std::move(ES)), JTMB(JTMB), DL(std::move(DL)),
+        Mangle(*this->ES, this->DL),
         ObjectLayer(*this->ES,
                     []() { return std::make_unique<SectionMemoryManager>(); }),
         CompileLayer(*this->ES, ObjectLayer,
-                     std::make_unique<ConcurrentIRCompiler>(std::move(JTMB))),
-        MainJD(this->ES->createBareJITDylib("<main>")) {
+                     std::make_unique<ConcurrentIRCompiler>(JTMB, &ObjCache)),
+        BaselineCompileLayer(*this->ES, ObjectLayer,
+                             std::make_unique<ConcurrentIRCompiler>(
+                                 getBaselineTargetMachineBuilder(JTMB))),
+        MainJD(this->ES->createBareJITDylib("<main>")),
+        StubsMgr(createLocalIndirectStubsManagerBuilder(
+            this->JTMB.getTargetTriple())()) {
     MainJD.addGenerator(
         cantFail(DynamicLibrarySearchGenerator::GetForCurrentProcess(
             DL.getGlobalPrefix())));
-    if (JTMB.getTargetTriple().isOSBinFormatCOFF()) {
+    if (this->JTMB.getTargetTriple().isOSBinFormatCOFF()) {
       ObjectLayer.setOverrideObjectFlagsWithResponsibilityFlags(true);
       ObjectLayer.setAutoClaimResponsibilityForObjectSymbols(true);
     }
@@ -65,7 +89,11 @@ public:
       ES->reportError(std::move(Err));
   }
 
-  static Expected<std::unique_ptr<KaleidoscopeJIT>> Create() {
+  // CPU is the name of the CPU to generate code for, empty or "native" for
+  // the host CPU with the features it reports.  Features is a
+  // comma-separated list like "+avx2,-avx512f" applied on top.
+  static Expected<std::unique_ptr<KaleidoscopeJIT>>
+  Create(const std::string &CPU = "", const std::string &Features = "") {
     auto EPC = SelfExecutorProcessControl::Create();
     if (!EPC)
       return EPC.takeError();
@@ -74,6 +102,20 @@ public:
 
     JITTargetMachineBuilder JTMB(
         ES->getExecutorProcessControl().getTargetTriple());
+    if (CPU.empty() || CPU == "native") {
+      auto Host = JITTargetMachineBuilder::detectHost();
+      if (!Host)
+        return Host.takeError();
+      JTMB = std::move(*Host);
+    } else {
+      JTMB.setCPU(CPU);
+    }
+    if (!Features.empty()) {
+      SmallVector<StringRef, 8> FeatureList;
+      StringRef(Features).split(FeatureList, ',', -1, false);
+      JTMB.addFeatures(
+          std::vector<std::string>(FeatureList.begin(), FeatureList.end()));
+    }
 
     auto DL = JTMB.getDefaultDataLayoutForTarget();
     if (!DL)
@@ -85,14 +127,50 @@ public:
 
   const DataLayout &getDataLayout() const { return DL; }
 
+  const JITTargetMachineBuilder &getTargetMachineBuilder() const {
+    return JTMB;
+  }
+
   JITDylib &getMainJITDylib() { return MainJD; }
 
+  DiskObjectCache &getObjectCache() { return ObjCache; }
+
   Error addModule(ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr) {
     if (!RT)
       RT = MainJD.getDefaultResourceTracker();
     return CompileLayer.add(RT, std::move(TSM));
   }
 
+  // Like addModule, but the code generator does not optimize, which takes
+  // a fraction of the time.
+  Error addBaselineModule(ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr) {
+    if (!RT)
+      RT = MainJD.getDefaultResourceTracker();
+    return BaselineCompileLayer.add(RT, std::move(TSM));
+  }
+
+  // Define Name as a stub that jumps to Target.
+  Error addStub(StringRef Name, JITTargetAddress Target) {
+    if (auto Err = StubsMgr->createStub(Name.str(), Target,
+                                        JITSymbolFlags::Exported))
+      return Err;
+    return MainJD.define(absoluteSymbols(
+        {{Mangle(Name.str()), StubsMgr->findStub(Name, true)}}));
+  }
+
+  // Make the stub Name jump to Target.  The pointer is swapped in a single
+  // store, so a concurrent caller goes either to the old or the new target.
+  Error updateStub(StringRef Name, JITTargetAddress Target) {
+    return StubsMgr->updatePointer(Name.str(), Target);
+  }
+
+  // Define Name as a function or variable of the host program.
+  Error defineAbsolute(StringRef Name, JITTargetAddress Address) {
+    return MainJD.define(absoluteSymbols(
+        {{Mangle(Name.str()),
+          JITEvaluatedSymbol(Address, JITSymbolFlags::Exported)}}));
+  }
+
   Expected<JITEvaluatedSymbol> lookup(StringRef Name) {
     return ES->lookup({&MainJD}, Mangle(Name.str()));
   }
@@ -1,12 +1,7 @@
 #include "Lexer.h"
 
-const extern map<string, Token> keywords = {{"extern", Token::Extern},
-                                            {"def", Token::Definition},
-                                            {"if", Token::If},
-                                            {"then", Token::Then},
-                                            {"else", Token::Else},
-                                            {"for", Token::For},
-                                            {"in", Token::In}};
+#include <array>
+#include <charconv>
 
 Lexer::Lexer(): mCurrentPosition(0) {}
 
@@ -15,116 +10,181 @@ Lexer::Lexer(const string& input): Lexer() {
 }
 
 void Lexer::AppendString(const string& input) {
+  if (mMappedFile) {
+    // switching from a mapped file: the appended text continues after it
+    mInputString.assign(mMappedFile->getBufferStart(),
+                        mMappedFile->getBufferSize());
+    mMappedFile.reset();
+  }
   mInputString.append(input);
 }
 
-bool Lexer::CurrentChar(char& c) const {
-  if (mCurrentPosition >= mInputString.size()) {
+bool Lexer::OpenFile(const string& FileName) {
+  // MemoryBuffer maps the file read-only when it is large enough to be worth
+  // it; no null terminator is needed since we always check the size.
+  auto FileOrErr = llvm::MemoryBuffer::getFile(FileName, /*IsText=*/false,
+                                               /*RequiresNullTerminator=*/false);
+  if (!FileOrErr) {
+    std::cerr << "Cannot open " << FileName << ": "
+              << FileOrErr.getError().message() << std::endl;
     return false;
-  } else {
-    c = mInputString[mCurrentPosition];
-    return true;
   }
+  mMappedFile = std::move(*FileOrErr);
+  mInputString.clear();
+  mCurrentPosition = 0;
+  return true;
 }
 
-tuple<Token, variant<string, double>> Lexer::getToken() {
-  char c = ' ';
-  if (mCurrentPosition >= mInputString.size()) {
-    return make_tuple(Token::Eof, string{"EOF"});
+string_view Lexer::str() const {
+  if (mMappedFile) {
+    return string_view(mMappedFile->getBufferStart(),
+                       mMappedFile->getBufferSize());
   }
-  CurrentChar(c);
-  while (std::isspace(c)){
-    ++mCurrentPosition;
-    if (CurrentChar(c)) {
-      if (!std::isspace(c)) {
-        // if we meet the first non-whitespace character, break the loop
-        break;
-      }
-    } else {
-      // EOF
-      return make_tuple(Token::Eof, string{c});
-    }
+  return mInputString;
+}
+
+namespace {
+
+enum CharClass : unsigned char {
+  Space = 1,
+  IdentifierStart = 2,
+  IdentifierBody = 4,
+  NumberStart = 8,
+};
+
+constexpr std::array<unsigned char, 256> MakeCharClassTable() {
+  std::array<unsigned char, 256> Table{};
+  for (const char c : {' ', '\t', '\n', '\v', '\f', '\r'}) {
+    Table[static_cast<unsigned char>(c)] |= Space;
+  }
+  for (int c = 'a'; c <= 'z'; ++c) {
+    Table[c] |= IdentifierStart | IdentifierBody;
+    Table[c - 'a' + 'A'] |= IdentifierStart | IdentifierBody;
   }
+  Table['_'] |= IdentifierStart | IdentifierBody;
+  for (int c = '0'; c <= '9'; ++c) {
+    Table[c] |= IdentifierBody | NumberStart;
+  }
+  Table['.'] |= NumberStart;
+  return Table;
+}
+
+constexpr std::array<unsigned char, 256> CharClassTable = MakeCharClassTable();
+
+inline bool IsCharClass(char c, CharClass Class) {
+  return CharClassTable[static_cast<unsigned char>(c)] & Class;
+}
+
+// Perfect hash of the keywords: (6 * first + last + length) mod 16 has no
+// collisions among them, so a keyword match is one table probe and compare.
+struct KeywordEntry {
+  string_view mText;
+  Token mType;
+};
+
+constexpr size_t KeywordHash(string_view Word) {
+  return (static_cast<unsigned char>(Word.front()) * 6 +
+          static_cast<unsigned char>(Word.back()) + Word.size()) & 15;
+}
+
+constexpr std::array<KeywordEntry, 16> MakeKeywordTable() {
+  std::array<KeywordEntry, 16> Table{};
+  for (const KeywordEntry& Entry : {KeywordEntry{"extern", Token::Extern},
+                                    KeywordEntry{"def", Token::Definition},
+                                    KeywordEntry{"if", Token::If},
+                                    KeywordEntry{"then", Token::Then},
+                                    KeywordEntry{"else", Token::Else},
+                                    KeywordEntry{"for", Token::For},
+                                    KeywordEntry{"in", Token::In}}) {
+    Table[KeywordHash(Entry.mText)] = Entry;
+  }
+  return Table;
+}
+
+constexpr std::array<KeywordEntry, 16> KeywordTable = MakeKeywordTable();
+
+constexpr Token LookupIdentifier(string_view Word) {
+  const KeywordEntry& Entry = KeywordTable[KeywordHash(Word)];
+  return Entry.mText == Word ? Entry.mType : Token::Identifier;
+}
+
+static_assert(LookupIdentifier("extern") == Token::Extern &&
+              LookupIdentifier("def") == Token::Definition &&
+              LookupIdentifier("if") == Token::If &&
+              LookupIdentifier("then") == Token::Then &&
+              LookupIdentifier("else") == Token::Else &&
+              LookupIdentifier("for") == Token::For &&
+              LookupIdentifier("in") == Token::In,
+              "keyword hash collision");
+
+} // namespace
+
+TokenSpan Lexer::getToken() {
+  const string_view Input = str();
+  const char* const Begin = Input.data();
+  const char* const End = Begin + Input.size();
+  const char* Current = Begin + mCurrentPosition;
+  // skip whitespaces
+  while (Current != End && IsCharClass(*Current, Space)) {
+    ++Current;
+  }
+  if (Current == End) {
+    mCurrentPosition = Input.size();
+    return TokenSpan{Token::Eof, Input.substr(Input.size())};
+  }
+  const size_t Start = Current - Begin;
+  const char c = *Current;
   Token t;
-  string result{c};
   bool match_in_switch = true;
   switch (c) {
     case '(': t = Token::LeftParenthesis; break;
     case ')': t = Token::RightParenthesis; break;
     case ',': t = Token::Comma; break;
     case ';': t = Token::Semicolon; break;
-//     case '=': t = Token::Assignment; break;
-    case '*':
-    case '/':
-    case '+':
-    case '-':
-    case '^': t = Token::Operator; break;
-    default: match_in_switch = false; // may be a digit or alphabet
+    default: match_in_switch = false; // may be an operator, digit or alphabet
   }
   if (match_in_switch) {
-    ++mCurrentPosition;
-    CurrentChar(c);
-    return make_tuple(t, result);
-  } else {
-    // check identifier [_a-zA-Z][_a-zA-Z0-9]*
-    if (std::isalpha(c) || c == '_') {
-      do {
-        ++mCurrentPosition;
-        if (CurrentChar(c)) {
-          if (std::isalnum(c) || c == '_') result += c;
-          else break;
-        } else {
-          break;
-        }
-      } while (true);
-      const auto find_result = keywords.find(result);
-      if (find_result != keywords.end()) {
-        return make_tuple(find_result->second, result);
-      } else {
-        return make_tuple(Token::Identifier, result);
-      }
-    } else if (std::isdigit(c) || c == '.') {
-      t = Token::Number;
-      int num_e = 0;
-      int num_dot = (c == '.') ? 1 : 0;
-      int num_digit = (std::isdigit(c)) ? 1 : 0;
-      ++mCurrentPosition;
-      while (CurrentChar(c)) {
-        if (c == 'e' || c == 'E') {
-          // check if this is an 'e'
-          if (num_digit >= 1) {
-            result += c;
-            ++num_e;
-          } else {
-            t = Token::Unknown;
-            break;
-          }
-        } else if (std::isdigit(c)) {
-          ++num_digit;
-          result += c;
-        } else if (c == '.') {
-          ++num_dot;
-          result += c;
-        } else {
-          if (num_e == 1 && (c == '+' || c == '-')) {
-            // 'e' can only appear once
-            result += c;
-          } else {
-            break;
-          }
-        }
-        ++mCurrentPosition;
+    mCurrentPosition = Start + 1;
+    return TokenSpan{t, Input.substr(Start, 1)};
+  }
+  if (const BinaryOp Op = GetBinaryOp(c); Op != BinaryOp::None) {
+    mCurrentPosition = Start + 1;
+    return TokenSpan{Token::Operator, Input.substr(Start, 1), 0.0, Op};
+  }
+  // check identifier [_a-zA-Z][_a-zA-Z0-9]*
+  if (IsCharClass(c, IdentifierStart)) {
+    do {
+      ++Current;
+    } while (Current != End && IsCharClass(*Current, IdentifierBody));
+    mCurrentPosition = Current - Begin;
+    const string_view Result = Input.substr(Start, mCurrentPosition - Start);
+    return TokenSpan{LookupIdentifier(Result), Result};
+  }
+  if (IsCharClass(c, NumberStart)) {
+    // from_chars finds the end of the number itself and does not allocate
+    double Number = 0.0;
+    const auto [Ptr, Ec] = std::from_chars(Current, End, Number);
+    if (Ptr != Current) {
+      mCurrentPosition = Ptr - Begin;
+      if (Ptr != End && *Ptr == '.') {
+        // a second '.', as in 1.2.3, is not the number 1.2 followed by .3
+        const char *Rest = Ptr;
+        while (Rest != End && IsCharClass(*Rest, NumberStart))
+          ++Rest;
+        mCurrentPosition = Rest - Begin;
+        const string_view Result = Input.substr(Start, mCurrentPosition - Start);
+        std::cerr << "Malformed number: " << Result << '\n';
+        return TokenSpan{Token::Unknown, Result};
       }
-      try {
-        const double number = std::stod(result);
-        return make_tuple(t, number);
-      } catch (std::exception& e) {
-        std::cerr << e.what() << '\n';
-        return make_tuple(t, 0.0);
+      if (Ec == std::errc::result_out_of_range) {
+        std::cerr << "Number out of range: "
+                  << Input.substr(Start, mCurrentPosition - Start) << '\n';
+        Number = 0.0;
       }
-    } else {
-      ++mCurrentPosition;
+      return TokenSpan{Token::Number,
+                       Input.substr(Start, mCurrentPosition - Start), Number};
     }
-    return make_tuple(Token::Unknown, result);
   }
+  mCurrentPosition = Start + 1;
+  return TokenSpan{Token::Unknown, Input.substr(Start, 1)};
 }
@@ -1,23 +1,31 @@
 #ifndef LEXER_H
 #define LEXER_H
 
+#include <llvm/Support/MemoryBuffer.h>
 #include <string>
+#include <string_view>
 #include <sstream>
 #include <cctype>
+#include <cstdint>
 #include <exception>
 #include <iostream>
+#include <memory>
 #include <tuple>
 #include <variant>
 #include <map>
 
+#include "Operation.h"
+
 using std::tuple;
 using std::variant;
 using std::istream;
 using std::string;
+using std::string_view;
 using std::make_tuple;
 using std::map;
+using std::shared_ptr;
 
-enum class Token {
+enum class Token : int16_t {
   Eof = -1,
   LeftParenthesis = -2,
   RightParenthesis = -3,
@@ -37,19 +45,30 @@ enum class Token {
   Unknown = -255,
 };
 
-const extern map<string, Token> keywords;
+/// TokenSpan - A token produced by the lexer.  mText refers to the lexer's
+/// source buffer instead of owning a copy, so it stays valid only until the
+/// buffer is replaced or appended to.  mNumber is set for Token::Number and
+/// mOperator for Token::Operator.
+struct TokenSpan {
+  Token mType = Token::Eof;
+  string_view mText;
+  double mNumber = 0.0;
+  BinaryOp mOperator = BinaryOp::None;
+};
 
 class Lexer {
 public:
   Lexer();
   Lexer(const string& input);
   void AppendString(const string& input);
-  tuple<Token, variant<string, double>> getToken();
-  [[nodiscard]] string str() const {return mInputString;}
+  // Lex directly from a read-only mapping of the file (no copy into a string).
+  bool OpenFile(const string& FileName);
+  TokenSpan getToken();
+  [[nodiscard]] string_view str() const;
 private:
   string mInputString;
+  shared_ptr<const llvm::MemoryBuffer> mMappedFile;
   size_t mCurrentPosition;
-  bool CurrentChar(char& c) const;
 };
 
 #endif // LEXER_H
@@ -9,4 +9,14 @@ const extern map<string, vector<string>> ExternFunctionsMap = {{"pow", vector<st
                                                                {"asin", vector<string>{"x1"}},
                                                                {"acos", vector<string>{"x1"}},
                                                                {"atan", vector<string>{"x1"}},
-                                                               {"atan2", vector<string>{"x1", "x2"}}};
+                                                               {"atan2", vector<string>{"x1", "x2"}},
+                                                               {"sqrt", vector<string>{"x1"}},
+                                                               {"fabs", vector<string>{"x1"}}};
+
+double GetCallCost(const string& Callee) {
+  if (Callee == "fabs")
+    return 4.0;
+  if (Callee == "log" || Callee == "exp" || Callee == "sqrt")
+    return 20.0;
+  return 40.0;
+}
@@ -11,4 +11,7 @@ using std::map;
 
 const extern map<string, vector<string>> ExternFunctionsMap;
 
+// Rough latency in cycles of a call to Callee, see OperatorInfo::mCost.
+double GetCallCost(const string& Callee);
+
 #endif
@@ -1 +1,76 @@
- 
+#include "Operation.h"
+#include <cmath>
+
+namespace {
+
+// Every operator must round-trip through its spelling, otherwise the lexer
+// and the operator table disagree.
+constexpr bool CheckOperatorTable() {
+  for (size_t i = 0; i < static_cast<size_t>(BinaryOp::None); ++i) {
+    const BinaryOp Op = static_cast<BinaryOp>(i);
+    const string_view Spelling = GetOperatorSpelling(Op);
+    if (Spelling.size() != 1 || GetBinaryOp(Spelling[0]) != Op)
+      return false;
+  }
+  return true;
+}
+
+static_assert(CheckOperatorTable(), "operator table out of sync with BinaryOp");
+
+} // namespace
+
+double GetPowerCost(double Exponent) {
+  const double N = std::fabs(Exponent);
+  if (Exponent == std::trunc(Exponent) && N <= MaxPowerChainExponent) {
+    // repeated squaring, plus a division for negative exponents
+    double Multiplications = 0;
+    for (uint64_t n = static_cast<uint64_t>(N); n > 1; n >>= 1)
+      Multiplications += (n & 1) ? 2 : 1;
+    return Multiplications * GetOperatorCost(BinaryOp::Multiply) +
+           (Exponent < 0 ? GetOperatorCost(BinaryOp::Divide) : 0.0);
+  }
+  if (Exponent == 0.5)
+    return 20.0;
+  return GetOperatorCost(BinaryOp::Power);
+}
+
+double EvaluatePowerInteger(double Base, int32_t N) {
+  double Result = 1.0;
+  for (int32_t n = N;; Base *= Base) {
+    if (n & 1)
+      Result *= Base;
+    n /= 2;
+    if (n == 0)
+      break;
+  }
+  return N < 0 ? 1.0 / Result : Result;
+}
+
+double EvaluateSquareRoot(double Base) {
+  return Base == -std::numeric_limits<double>::infinity() ?
+    std::numeric_limits<double>::infinity() : std::fabs(std::sqrt(Base));
+}
+
+namespace {
+
+// The lowering of '^' on numbers.
+struct NumberPowerLowering {
+  bool mConstantBase;
+  double Constant(double Val) { return Val; }
+  double Multiply(double L, double R) { return L * R; }
+  double Divide(double L, double R) { return L / R; }
+  double PowerInteger(double Base, int32_t N) {
+    return mConstantBase ? std::pow(Base, N) : EvaluatePowerInteger(Base, N);
+  }
+  double SquareRoot(double Base) { return EvaluateSquareRoot(Base); }
+  double Power(double Base, double Exponent) { return std::pow(Base, Exponent); }
+};
+
+} // namespace
+
+double EvaluatePower(double Base, double Exponent, bool ConstantBase,
+                     bool ConstantExponent) {
+  NumberPowerLowering Lowering{ConstantBase};
+  return LowerPower(Lowering, Base, Exponent,
+                    ConstantExponent ? std::optional<double>(Exponent) : std::nullopt);
+}
@@ -1 +1,139 @@
- 
+#ifndef OPERATION_H
+#define OPERATION_H
+
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <string_view>
+
+using std::string_view;
+
+/// BinaryOp - The operators of the language.  The lexer classifies operator
+/// characters once, and the parser, the AST, codegen and the derivative
+/// engine all work on this enum instead of comparing strings.
+enum class BinaryOp : uint8_t {
+  Assign,
+  Less,
+  Add,
+  Subtract,
+  Multiply,
+  Divide,
+  Power,
+  None,
+};
+
+/// OperatorInfo - Static properties of an operator.  A precedence of -1
+/// means the operator cannot be used in that position.  mCost is a rough
+/// latency in cycles, used by the optimizers to compare expressions.
+struct OperatorInfo {
+  string_view mSpelling;
+  int mBinaryPrecedence;
+  int mUnaryPrecedence;
+  bool mRightAssociative;
+  double mCost;
+};
+
+constexpr std::array<OperatorInfo, static_cast<size_t>(BinaryOp::None) + 1>
+OperatorTable = {{
+  /* Assign   */ {"=", 10, -1, false, 4.0},
+  /* Less     */ {"<", 50, -1, false, 4.0},
+  /* Add      */ {"+", 100, 250, false, 4.0},
+  /* Subtract */ {"-", 100, 250, false, 4.0},
+  /* Multiply */ {"*", 200, -1, false, 4.0},
+  /* Divide   */ {"/", 200, -1, false, 14.0},
+  /* Power    */ {"^", 300, -1, true, 60.0},
+  /* None     */ {"", -1, -1, false, 0.0},
+}};
+
+constexpr const OperatorInfo& GetOperatorInfo(BinaryOp Op) {
+  return OperatorTable[static_cast<size_t>(Op)];
+}
+
+constexpr int GetBinaryPrecedence(BinaryOp Op) {
+  return GetOperatorInfo(Op).mBinaryPrecedence;
+}
+
+constexpr int GetUnaryPrecedence(BinaryOp Op) {
+  return GetOperatorInfo(Op).mUnaryPrecedence;
+}
+
+constexpr bool IsRightAssociative(BinaryOp Op) {
+  return GetOperatorInfo(Op).mRightAssociative;
+}
+
+constexpr double GetOperatorCost(BinaryOp Op) {
+  return GetOperatorInfo(Op).mCost;
+}
+
+/// Exponents up to this magnitude are lowered to multiplications.
+constexpr double MaxPowerChainExponent = 64.0;
+
+/// Cost of x^Exponent for a constant exponent, following the lowering in
+/// codegen: multiplications for small integers, a square root for 0.5.
+double GetPowerCost(double Exponent);
+
+/// LowerPower - Build Base^Exponent the way '^' is lowered, with the
+/// operations of Lowering: Constant(double), Multiply(L, R), Divide(L, R),
+/// PowerInteger(Base, int32_t) for llvm.powi, SquareRoot(Base) for |sqrt|
+/// and Power(Base, Exponent) for pow.  N is the exponent if it is a
+/// constant.  Codegen, the VM and the constant folders all lower '^' here.
+template <typename LoweringT, typename ValueT>
+ValueT LowerPower(LoweringT& Lowering, ValueT Base, ValueT Exponent,
+                  std::optional<double> N) {
+  if (N && *N == std::trunc(*N) && std::fabs(*N) <= MaxPowerChainExponent) {
+    // pow(x, 0) is 1 even for a NaN x
+    ValueT Result = Lowering.Constant(1.0);
+    ValueT Square = Base;
+    bool First = true;
+    for (uint64_t n = static_cast<uint64_t>(std::fabs(*N)); n; n >>= 1) {
+      if (n & 1) {
+        Result = First ? Square : Lowering.Multiply(Result, Square);
+        First = false;
+      }
+      if (n > 1)
+        Square = Lowering.Multiply(Square, Square);
+    }
+    return *N < 0 ? Lowering.Divide(Lowering.Constant(1.0), Result) : Result;
+  }
+  if (N && *N == std::trunc(*N) &&
+      std::fabs(*N) <= std::numeric_limits<int32_t>::max())
+    return Lowering.PowerInteger(Base, static_cast<int32_t>(*N));
+  if (N && *N == 0.5)
+    return Lowering.SquareRoot(Base);
+  return Lowering.Power(Base, Exponent);
+}
+
+/// Base^N as computed by __powidf2, which llvm.powi calls at run time.
+double EvaluatePowerInteger(double Base, int32_t N);
+
+/// Base^0.5 as lowered by LowerPower: |sqrt(Base)|, which is +0 for -0,
+/// and +inf for -inf.
+double EvaluateSquareRoot(double Base);
+
+/// Base^Exponent as computed by the code LowerPower builds, where the base
+/// and the exponent are constants or not.  llvm.powi is folded with pow for
+/// a constant base and runs __powidf2 otherwise.
+double EvaluatePower(double Base, double Exponent, bool ConstantBase,
+                     bool ConstantExponent);
+
+constexpr string_view GetOperatorSpelling(BinaryOp Op) {
+  return GetOperatorInfo(Op).mSpelling;
+}
+
+/// Map an operator character to its BinaryOp, or BinaryOp::None.
+constexpr BinaryOp GetBinaryOp(char c) {
+  switch (c) {
+    case '=': return BinaryOp::Assign;
+    case '<': return BinaryOp::Less;
+    case '+': return BinaryOp::Add;
+    case '-': return BinaryOp::Subtract;
+    case '*': return BinaryOp::Multiply;
+    case '/': return BinaryOp::Divide;
+    case '^': return BinaryOp::Power;
+    default: return BinaryOp::None;
+  }
+}
+
+#endif // OPERATION_H
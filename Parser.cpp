@@ -10,23 +10,6 @@ using std::vector;
 
 // #define DEBUG_PARSER
 
-map<string, int> Parser::mBinaryOpPrecedence = {{"=", 10},
-                                                {"<", 50},
-                                                {"+", 100},
-                                                {"-", 100},
-                                                {"*", 200},
-                                                {"/", 200},
-                                                {"^", 300}};
-
-map<string, int> Parser::mUnaryOpPrecedence = {{"+", 250},
-                                               {"-", 250}};
-
-map<string, bool> Parser::mRightAssociative = {{"+", false},
-                                               {"-", false},
-                                               {"*", false},
-                                               {"/", false},
-                                               {"^", true}};
-
 Parser::Parser() = default;
 
 Parser::Parser(const string& Str) {
@@ -39,92 +22,80 @@ void Parser::AppendString(const string& Str) {
 
 void Parser::SetupInput(const string& Str) {
   mLexer = Lexer(Str);
+  mCurrentToken = TokenSpan();
+  mUseTokenBuffer = false;
 }
 
-string Parser::getInputString() const {
-  return mLexer.str();
+bool Parser::SetupInputFile(const string& FileName) {
+  mCurrentToken = TokenSpan();
+  mUseTokenBuffer = false;
+  return mLexer.OpenFile(FileName);
 }
 
-int Parser::GetBinaryPrecedence(const string& Op) {
-  auto FindRes = mBinaryOpPrecedence.find(Op);
-  if (FindRes != mBinaryOpPrecedence.end()) {
-    return FindRes->second;
-  } else {
-    return -1;
-  }
+void Parser::BufferTokens() {
+  mTokens.Tokenize(mLexer);
+  mUseTokenBuffer = true;
+  // getNextToken() moves to index 0
+  mTokenIndex = static_cast<size_t>(-1);
 }
 
-int Parser::GetUnaryPrecedence(const string& Op) {
-  auto FindRes = mUnaryOpPrecedence.find(Op);
-  if (FindRes != mUnaryOpPrecedence.end()) {
-    return FindRes->second;
-  } else {
-    return -1;
-  }
+string_view Parser::getInputString() const {
+  return mLexer.str();
 }
 
-bool Parser::IsRightAssociative(const string& Op) {
-  auto FindRes = mRightAssociative.find(Op);
-  if (FindRes != mRightAssociative.end()) {
-    return FindRes->second;
-  } else {
-    return false;
+void Parser::getNextToken() {
+  if (mUseTokenBuffer) {
+    // the buffer ends with Eof, which is never passed
+    if (mTokenIndex + 1 < mTokens.size()) ++mTokenIndex;
+    return;
   }
-}
-
-tuple<Token, variant<string, double>> Parser::getNextToken() {
-  return mCurrentToken = mLexer.getToken();
-}
-
-tuple<Token, variant<string, double>> Parser::getCurrentToken() const {
-  return mCurrentToken;
+  mCurrentToken = mLexer.getToken();
 }
 
 void Parser::PrintCurrentToken() const {
   using std::cout;
-  using std::get;
   using std::endl;
-  const Token T = get<0>(mCurrentToken);
-  const auto V = get<1>(mCurrentToken);
+  const Token T = getTokenType();
+  const string_view V = getTokenText();
   cout << "Current token: " << static_cast<int>(T) << " ";
   switch (T) {
-    case Token::Eof: cout << "Eof: " << get<string>(V); break;
-    case Token::LeftParenthesis: cout << "LeftParenthesis: " << get<string>(V); break;
-    case Token::RightParenthesis: cout << "RightParenthesis: " << get<string>(V); break;
-    case Token::Identifier: cout << "Identifier: " << get<string>(V); break;
-    case Token::Number: cout << "Number: " << get<double>(V); break;
-    case Token::Operator: cout << "Operator: " << get<string>(V); break;
-    case Token::Comma: cout << "Comma: " << get<string>(V); break;
-    case Token::Semicolon: cout << "Semicolon: " << get<string>(V); break;
-    case Token::Extern: cout << "Extern: " << get<string>(V); break;
-    case Token::Definition: cout << "Definition: " << get<string>(V); break;
-    case Token::Unknown: cout << "Unknown: " << get<string>(V); break;
+    case Token::Eof: cout << "Eof: " << V; break;
+    case Token::LeftParenthesis: cout << "LeftParenthesis: " << V; break;
+    case Token::RightParenthesis: cout << "RightParenthesis: " << V; break;
+    case Token::Identifier: cout << "Identifier: " << V; break;
+    case Token::Number: cout << "Number: " << getTokenNumber(); break;
+    case Token::Operator: cout << "Operator: " << V; break;
+    case Token::Comma: cout << "Comma: " << V; break;
+    case Token::Semicolon: cout << "Semicolon: " << V; break;
+    case Token::Extern: cout << "Extern: " << V; break;
+    case Token::Definition: cout << "Definition: " << V; break;
+    default: cout << "Other: " << V; break;
   }
   cout << endl;
 }
 
-unique_ptr<ExprAST> Parser::ParseNumberExpr() {
+ExprIndex Parser::ParseNumberExpr() {
 #ifdef DEBUG_PARSER
-  std::cout << "unique_ptr<ExprAST> Parser::ParseNumberExpr()\n";
+  std::cout << "ExprIndex Parser::ParseNumberExpr()\n";
   PrintCurrentToken();
 #endif
-  auto Result = make_unique<NumberExprAST>(std::get<double>(std::get<1>(mCurrentToken)));
+  const ExprIndex Result = mArena->CreateNumber(getTokenNumber());
   getNextToken();
-  return move(Result);
+  return Result;
 }
 
-unique_ptr<ExprAST> Parser::ParseParenExpr() {
+ExprIndex Parser::ParseParenExpr() {
 #ifdef DEBUG_PARSER
-  std::cout << "unique_ptr<ExprAST> Parser::ParseParenExpr()\n";
+  std::cout << "ExprIndex Parser::ParseParenExpr()\n";
   PrintCurrentToken();
 #endif
   getNextToken(); // eat (.
-  auto V = ParseExpression();
-  if (!V) {
+  const ExprIndex V = ParseExpression();
+  if (V == InvalidExpr) {
     std::cout << "NULL HERE!\n";
-    return nullptr;
+    return InvalidExpr;
   }
-  if (std::get<0>(mCurrentToken) != Token::RightParenthesis)
+  if (getTokenType() != Token::RightParenthesis)
     return LogError("expected ')'");
   getNextToken(); // eat ).
 #ifdef DEBUG_PARSER
@@ -133,57 +104,58 @@ unique_ptr<ExprAST> Parser::ParseParenExpr() {
   return V;
 }
 
-unique_ptr<ExprAST> Parser::ParseIdentifierExpr() {
-  using std::get;
+ExprIndex Parser::ParseIdentifierExpr() {
   using std::vector;
 #ifdef DEBUG_PARSER
-  std::cout << "unique_ptr<ExprAST> Parser::ParseIdentifierExpr()\n";
+  std::cout << "ExprIndex Parser::ParseIdentifierExpr()\n";
   PrintCurrentToken();
 #endif
-  const string IdName = get<string>(get<1>(mCurrentToken));
+  // the name is a view into the source buffer, which outlives the parse
+  const string_view IdName = getTokenText();
   getNextToken(); // eat identifier
-  if (get<0>(mCurrentToken) != Token::LeftParenthesis) {
+  if (getTokenType() != Token::LeftParenthesis) {
     // Simple variable ref.
-    return make_unique<VariableExprAST>(IdName);
+    return mArena->CreateVariable(IdName);
   }
   // '(' appears after an identifier, so this is a function call
   getNextToken();
-  vector<unique_ptr<ExprAST>> Args;
-  if (get<0>(mCurrentToken) != Token::RightParenthesis) {
+  vector<ExprIndex> Args;
+  if (getTokenType() != Token::RightParenthesis) {
     while (true) {
-      if (auto Arg = ParseExpression())
-        Args.push_back(move(Arg));
+      const ExprIndex Arg = ParseExpression();
+      if (Arg != InvalidExpr)
+        Args.push_back(Arg);
       else
-        return nullptr;
-      if (get<0>(mCurrentToken) == Token::RightParenthesis)
+        return InvalidExpr;
+      if (getTokenType() == Token::RightParenthesis)
         break;
-      if (get<0>(mCurrentToken) != Token::Comma)
+      if (getTokenType() != Token::Comma)
         return LogError("Expected ')' or ',' in argument list");
       getNextToken();
     }
   }
   // Eat the ')'.
   getNextToken();
-  return make_unique<CallExprAST>(IdName, move(Args));
+  return mArena->CreateCall(IdName, Args);
 }
 
-unique_ptr<ExprAST> Parser::ParsePrimary() {
+ExprIndex Parser::ParsePrimary() {
 #ifdef DEBUG_PARSER
-  std::cout << "unique_ptr<ExprAST> Parser::ParsePrimary()\n";
+  std::cout << "ExprIndex Parser::ParsePrimary()\n";
   PrintCurrentToken();
 #endif
-  switch (std::get<0>(mCurrentToken)) {
+  switch (getTokenType()) {
     default: return LogError("unknown token when expecting an expression");
     case Token::Identifier: return ParseIdentifierExpr();
     case Token::Number: return ParseNumberExpr();
     case Token::LeftParenthesis: return ParseParenExpr();
     case Token::Operator: {
       // Parse a signed number
-      const char Op = std::get<string>(std::get<1>(mCurrentToken))[0];
-      if ((Op == '-') || (Op == '+')) {
+      if (GetUnaryPrecedence(getTokenOperator()) >= 0) {
         return ParseUnaryOpRHS();
       } else {
-        const string ErrorMsg = string("Expect a number before ") + Op;
+        const string ErrorMsg = string("Expect a number before ") +
+                                string(getTokenText());
         return LogError(ErrorMsg);
       }
     }
@@ -195,174 +167,147 @@ unique_ptr<ExprAST> Parser::ParsePrimary() {
 #endif
 }
 
-unique_ptr<ExprAST> Parser::ParseExpression() {
+ExprIndex Parser::ParseExpression() {
 #ifdef DEBUG_PARSER
-  std::cout << "unique_ptr<ExprAST> Parser::ParseExpression()\n";
+  std::cout << "ExprIndex Parser::ParseExpression()\n";
   PrintCurrentToken();
 #endif
-  auto LHS = ParsePrimary();
-  if (!LHS)
-    return nullptr;
+  const ExprIndex LHS = ParsePrimary();
+  if (LHS == InvalidExpr)
+    return InvalidExpr;
 #ifdef DEBUG_PARSER
   std::cout << "End of ParseExpression()\n";
 #endif
-  return ParseBinOpRHS(0, move(LHS));
+  return ParseBinOpRHS(0, LHS);
 }
 
-unique_ptr<ExprAST> Parser::ParseForExpr() {
+ExprIndex Parser::ParseForExpr() {
   using std::get;
   // eat up "for"
   getNextToken();
-  if (get<0>(mCurrentToken) != Token::Identifier)
+  if (getTokenType() != Token::Identifier)
     return LogError("expected identifier after for");
-  string IdName = get<string>(get<1>(mCurrentToken));
+  const string_view IdName = getTokenText();
   // eat up identifier
   getNextToken();
-  if (get<0>(mCurrentToken) != Token::Operator && get<string>(get<1>(mCurrentToken)) != "=")
+  if (getTokenType() != Token::Operator ||
+      getTokenOperator() != BinaryOp::Assign)
     return LogError("expected = after identifier in for");
   // eat up "="
   getNextToken();
-  auto Start = ParseExpression();
-  if (!Start)
-    return nullptr;
-  if (get<0>(mCurrentToken) != Token::Comma)
+  const ExprIndex Start = ParseExpression();
+  if (Start == InvalidExpr)
+    return InvalidExpr;
+  if (getTokenType() != Token::Comma)
     return LogError("expected , after start value in for");
   // eat up ","
   getNextToken();
-  auto End = ParseExpression();
-  if (!End)
-    return nullptr;
+  const ExprIndex End = ParseExpression();
+  if (End == InvalidExpr)
+    return InvalidExpr;
   // the step value is optional
-  unique_ptr<ExprAST> Step;
-  if (get<0>(mCurrentToken) == Token::Comma) {
+  ExprIndex Step = InvalidExpr;
+  if (getTokenType() == Token::Comma) {
     // parse step expression if we have for
     getNextToken();
     Step = ParseExpression();
-    if (!Step)
-      return nullptr;
+    if (Step == InvalidExpr)
+      return InvalidExpr;
   }
-  if (get<0>(mCurrentToken) != Token::In) {
+  if (getTokenType() != Token::In) {
     PrintCurrentToken();
     return LogError("expected 'in' at the end of for loop");
   }
   getNextToken();
-  auto Body = ParseExpression();
-  if (!Body)
-    return nullptr;
-  return make_unique<ForExprAST>(IdName, move(Start), move(End), move(Step),
-                                 move(Body));
+  const ExprIndex Body = ParseExpression();
+  if (Body == InvalidExpr)
+    return InvalidExpr;
+  return mArena->CreateFor(IdName, Start, End, Step, Body);
 }
 
-unique_ptr<ExprAST> Parser::ParseUnaryOpRHS() {
-  // TODO: I am new to writing a parser. Does the code work for all cases??
+ExprIndex Parser::ParseUnaryOpRHS() {
 #ifdef DEBUG_PARSER
-  std::cout << "unique_ptr<ExprAST> Parser::ParseUnaryOpRHS()\n";
+  std::cout << "ExprIndex Parser::ParseUnaryOpRHS()\n";
   PrintCurrentToken();
 #endif
-  using std::get;
   // treat LHS as a zero number for signed values
-  auto LHS = make_unique<NumberExprAST>(0.0);
-  unique_ptr<ExprAST> RHS;
+  const ExprIndex LHS = mArena->CreateNumber(0.0);
   // get the precedence of the current unary operator
-  const string Op = get<string>(get<1>(mCurrentToken));
+  const BinaryOp Op = getTokenOperator();
   const int TokPrec = GetUnaryPrecedence(Op);
   // eat up the operator
   getNextToken();
   // expect a primary expression after the sign
-  RHS = ParsePrimary();
-  if (!RHS)
-    return nullptr;
-  // continue to parse the next operator
-  int NextPrec = GetBinaryPrecedence(get<string>(get<1>(mCurrentToken)));
-  // NextPrec is -1 for non-operator tokens
-  // The case that NextPrec is larger than TokPrec only happens when
-  // there is a ^ (power operator).
-  if (TokPrec < NextPrec) {
-    // take the current RHS as the LHS of the new operator,
-    // and parse the binary expression for the new one again.
-    RHS = ParseBinOpRHS(TokPrec + 1, move(RHS));
-    if (!RHS)
-      return nullptr;
-  }
-  return make_unique<BinaryExprAST>(Op, move(LHS), move(RHS));
+  ExprIndex RHS = ParsePrimary();
+  if (RHS == InvalidExpr)
+    return InvalidExpr;
+  // only operators binding tighter than the sign (i.e. ^) belong to the
+  // operand, so "-x^2" is "-(x^2)" but "-x*2" is "(-x)*2".
+  RHS = ParseBinOpRHS(TokPrec + 1, RHS);
+  if (RHS == InvalidExpr)
+    return InvalidExpr;
+  return mArena->CreateBinary(Op, LHS, RHS);
 }
 
-unique_ptr<ExprAST> Parser::ParseBinOpRHS(int ExprPrec,
-                                          unique_ptr<ExprAST> LHS) {
+/// ParseBinOpRHS - Pratt-style (precedence climbing) parsing of binary
+/// operators.  Consumes operators whose precedence is at least MinPrec and
+/// returns the combined expression with LHS as its leftmost operand.
+ExprIndex Parser::ParseBinOpRHS(int MinPrec, ExprIndex LHS) {
 #ifdef DEBUG_PARSER
-  std::cout << "unique_ptr<ExprAST> Parser::ParseBinOpRHS()" << " ExprPrec = " << ExprPrec << "\n";
+  std::cout << "ExprIndex Parser::ParseBinOpRHS()" << " MinPrec = " << MinPrec << "\n";
 #endif
-  using std::get;
-  // TODO: figure out what happens in the following code
   while (true) {
-    const string Op = get<string>(get<1>(mCurrentToken));
-    int TokPrec = GetBinaryPrecedence(Op);
+    // non-operator tokens have BinaryOp::None and thus precedence -1
+    const BinaryOp Op = getTokenOperator();
+    const int TokPrec = GetBinaryPrecedence(Op);
 #ifdef DEBUG_PARSER
     std::cout << "Current token in Parser::ParseBinOpRHS(): ";
     PrintCurrentToken();
     std::cout << "Current precedence: TokPrec = " << TokPrec << "\n";
 #endif
-    if (TokPrec < ExprPrec)
+    if (TokPrec < 0 || TokPrec < MinPrec)
       return LHS;
     getNextToken();
-    auto RHS = ParsePrimary();
-    if (!RHS)
-      return nullptr;
-    const string NextOp = get<string>(get<1>(mCurrentToken));
-    const int NextPrec = GetBinaryPrecedence(NextOp);
-#ifdef DEBUG_PARSER
-    std::cout << "Next token in Parser::ParseBinOpRHS(): ";
-    PrintCurrentToken();
-    std::cout << "Next precedence: NextPrec = " << NextPrec << "\n";
-#endif
-    if (Op == NextOp) {
-      // check if the same operators are right-associative
-      const bool Ra = IsRightAssociative(Op);
-      if (Ra) {
-#ifdef DEBUG_PARSER
-        std::cout << "This is a right-associative operator\n";
-#endif
-        RHS = ParseBinOpRHS(TokPrec, move(RHS));
-        if (!RHS)
-          return nullptr;
-      }
-    }
-    if (TokPrec < NextPrec) {
-      RHS = ParseBinOpRHS(TokPrec + 1, move(RHS));
-      if (!RHS)
-        return nullptr;
-    }
-    LHS = make_unique<BinaryExprAST>(Op, move(LHS), move(RHS));
+    ExprIndex RHS = ParsePrimary();
+    if (RHS == InvalidExpr)
+      return InvalidExpr;
+    // A right-associative operator lets the same operator bind its right
+    // operand, a left-associative one only tighter operators.
+    const int RHSPrec = IsRightAssociative(Op) ? TokPrec : TokPrec + 1;
+    RHS = ParseBinOpRHS(RHSPrec, RHS);
+    if (RHS == InvalidExpr)
+      return InvalidExpr;
+    LHS = mArena->CreateBinary(Op, LHS, RHS);
   }
 }
 
 unique_ptr<PrototypeAST> Parser::ParsePrototype() {
   using std::get;
-  if (get<0>(mCurrentToken) != Token::Identifier) {
-    std::cerr << "Token: " << get<string>(get<1>(mCurrentToken)) << std::endl;
+  if (getTokenType() != Token::Identifier) {
+    std::cerr << "Token: " << getTokenText() << std::endl;
     return LogErrorP("Expected function name in prototype");
   }
-  string FnName = get<string>(get<1>(mCurrentToken));
+  string FnName{getTokenText()};
   getNextToken();
-  if (get<0>(mCurrentToken) != Token::LeftParenthesis)
+  if (getTokenType() != Token::LeftParenthesis)
     return LogErrorP("Expected '(' in prototype");
   vector<string> ArgNames;
   getNextToken();
-  Token t = get<0>(mCurrentToken);
+  Token t = getTokenType();
   while (t == Token::Identifier) {
-    const string IdStr = get<string>(get<1>(mCurrentToken));
-    ArgNames.push_back(IdStr);
+    const string_view IdStr = getTokenText();
+    ArgNames.emplace_back(IdStr);
     getNextToken();
-    t = get<0>(mCurrentToken);
+    t = getTokenType();
     if (t == Token::RightParenthesis) break;
     if (t != Token::Comma) {
-      const string ErrorMsg = string{"Expected a comma(,) after "} + IdStr +
-                              " but got " +
-                              get<string>(get<1>(mCurrentToken));
+      const string ErrorMsg = string{"Expected a comma(,) after "} +
+                              string(IdStr) + " but got " +
+                              string(getTokenText());
       return LogErrorP(ErrorMsg);
     }
     getNextToken();
-    t = get<0>(mCurrentToken);
+    t = getTokenType();
   }
   if (t != Token::RightParenthesis)
     return LogErrorP("Expected ')' in prototype");
@@ -375,17 +320,24 @@ unique_ptr<FunctionAST> Parser::ParseDefinition() {
   auto Proto = ParsePrototype();
   if (!Proto)
     return nullptr;
-  if (auto E = ParseExpression())
-    return make_unique<FunctionAST>(move(Proto), move(E));
+  // every definition gets a fresh arena for its nodes
+  mArena = make_shared<ExprArena>();
+  const ExprIndex E = ParseExpression();
+  if (E != InvalidExpr)
+    return make_unique<FunctionAST>(move(Proto), move(mArena), E);
+  mArena.reset();
   return nullptr;
 }
 
 unique_ptr<FunctionAST> Parser::ParseTopLevelExpr() {
-  if (auto E = ParseExpression()) {
+  mArena = make_shared<ExprArena>();
+  const ExprIndex E = ParseExpression();
+  if (E != InvalidExpr) {
     // Make an anonymous proto.
     auto Proto = make_unique<PrototypeAST>("__anon_expr", vector<string>());
-    return make_unique<FunctionAST>(move(Proto), move(E));
+    return make_unique<FunctionAST>(move(Proto), move(mArena), E);
   }
+  mArena.reset();
   return nullptr;
 }
 
@@ -394,25 +346,25 @@ unique_ptr<PrototypeAST> Parser::ParseExtern() {
   return ParsePrototype();
 }
 
-unique_ptr<ExprAST> Parser::ParseIfExpr() {
+ExprIndex Parser::ParseIfExpr() {
   using std::get;
   getNextToken(); // eat the if.
-  auto Cond = ParseExpression();
-  if (!Cond)
-    return nullptr;
-  Token t = get<0>(mCurrentToken);
+  const ExprIndex Cond = ParseExpression();
+  if (Cond == InvalidExpr)
+    return InvalidExpr;
+  Token t = getTokenType();
   if (t != Token::Then)
     return LogError("expected then");
   getNextToken(); // eat the then
-  auto Then = ParseExpression();
-  if (!Then)
-    return nullptr;
-  t = get<0>(mCurrentToken);
+  const ExprIndex Then = ParseExpression();
+  if (Then == InvalidExpr)
+    return InvalidExpr;
+  t = getTokenType();
   if (t != Token::Else)
     return LogError("expected else");
   getNextToken(); // eat the else.
-  auto Else = ParseExpression();
-  if (!Else)
-    return nullptr;
-  return make_unique<IfExprAST>(move(Cond), move(Then), move(Else));
+  const ExprIndex Else = ParseExpression();
+  if (Else == InvalidExpr)
+    return InvalidExpr;
+  return mArena->CreateIf(Cond, Then, Else);
 }
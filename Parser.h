@@ -10,11 +10,14 @@
 #include <sstream>
 
 #include "Lexer.h"
+#include "TokenBuffer.h"
 #include "AbstractSyntaxTree.h"
 
 using std::map;
 using std::string;
+using std::string_view;
 using std::unique_ptr;
+using std::shared_ptr;
 using std::variant;
 using std::tuple;
 using std::stringstream;
@@ -22,40 +25,51 @@ using std::make_unique;
 
 class Parser {
 public:
-  static map<string, int> mBinaryOpPrecedence;
-  static map<string, bool> mRightAssociative;
-  static map<string, int> mUnaryOpPrecedence;
   Parser();
   Parser(const string& Str);
   void SetupInput(const string& Str);
+  bool SetupInputFile(const string& FileName);
   void AppendString(const string& Str);
-  string getInputString() const;
-  static int GetBinaryPrecedence(const string& Op) ;
-  static int GetUnaryPrecedence(const string& Op) ;
-  static bool IsRightAssociative(const string& Op) ;
-  tuple<Token, variant<string, double>> getNextToken();
-  tuple<Token, variant<string, double>> getCurrentToken() const;
+  string_view getInputString() const;
+  // Tokenize the rest of the input up front and parse from the buffer.
+  void BufferTokens();
+  void getNextToken();
+  // The current token, read from the buffer by index after BufferTokens().
+  Token getTokenType() const {
+    return mUseTokenBuffer ? mTokens.getType(mTokenIndex) : mCurrentToken.mType;
+  }
   void PrintCurrentToken() const;
-  unique_ptr<ExprAST> ParseNumberExpr();
-  unique_ptr<ExprAST> ParseParenExpr();
-  unique_ptr<ExprAST> ParseIdentifierExpr();
-  unique_ptr<ExprAST> ParseIfExpr();
-  unique_ptr<ExprAST> ParsePrimary();
-  unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec, unique_ptr<ExprAST> LHS);
-  unique_ptr<ExprAST> ParseExpression();
-  unique_ptr<ExprAST> ParseUnaryOpRHS();
-  unique_ptr<ExprAST> ParseForExpr();
+  ExprIndex ParseNumberExpr();
+  ExprIndex ParseParenExpr();
+  ExprIndex ParseIdentifierExpr();
+  ExprIndex ParseIfExpr();
+  ExprIndex ParsePrimary();
+  ExprIndex ParseBinOpRHS(int MinPrec, ExprIndex LHS);
+  ExprIndex ParseExpression();
+  ExprIndex ParseUnaryOpRHS();
+  ExprIndex ParseForExpr();
   unique_ptr<PrototypeAST> ParsePrototype();
   unique_ptr<FunctionAST> ParseDefinition();
   unique_ptr<FunctionAST> ParseTopLevelExpr();
   unique_ptr<PrototypeAST> ParseExtern();
 private:
-  tuple<Token, variant<string, double>> mCurrentToken;
+  string_view getTokenText() const {
+    return mUseTokenBuffer ? mTokens.getText(mTokenIndex) : mCurrentToken.mText;
+  }
+  double getTokenNumber() const {
+    return mUseTokenBuffer ? mTokens.getNumber(mTokenIndex) : mCurrentToken.mNumber;
+  }
+  BinaryOp getTokenOperator() const {
+    return mUseTokenBuffer ? mTokens.getOperator(mTokenIndex) : mCurrentToken.mOperator;
+  }
+  // the current token when lexing on demand
+  TokenSpan mCurrentToken;
+  // the arena receiving the nodes of the expression being parsed
+  shared_ptr<ExprArena> mArena;
   Lexer mLexer;
+  TokenBuffer mTokens;
+  bool mUseTokenBuffer = false;
+  size_t mTokenIndex = 0;
 };
 
-// extern map<string, int> Parser::mBinaryOpPrecedence;
-// extern map<string, bool> Parser::mRightAssociative;
-// extern map<string, int> Parser::mUnaryOpPrecedence;
-
 #endif // PARSER_H
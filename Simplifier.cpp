@@ -0,0 +1,305 @@
+#include "Simplifier.h"
+#include <cmath>
+#include <utility>
+
+ExprIndex Simplifier::Simplify(ExprIndex Root) {
+  // The nodes built by a rule are simplified again right away, so a second
+  // pass normally finds nothing to do; it is only there to make sure we
+  // stopped at a fixed point.
+  constexpr int MaxPasses = 16;
+  for (int Pass = 0; Pass < MaxPasses; ++Pass) {
+    const ExprIndex Result = SimplifyNode(Root);
+    if (Result == Root)
+      break;
+    Root = Result;
+  }
+  return Root;
+}
+
+ExprIndex Simplifier::SimplifyNode(ExprIndex Index) {
+  const auto Found = mSimplified.find(Index);
+  if (Found != mSimplified.end())
+    return Found->second;
+  // copy what we need, creating nodes may reallocate the arena
+  const vector<ExprIndex> Operands(mArena.getOperands(Index).begin(),
+                                   mArena.getOperands(Index).end());
+  ExprIndex Result = Index;
+  switch (mArena.getKind(Index)) {
+    case ExprKind::Number:
+    case ExprKind::Variable:
+      break;
+    case ExprKind::Binary: {
+      const BinaryOp Op = mArena.getOperator(Index);
+      if (Op == BinaryOp::Assign) {
+        // the destination must stay a variable
+        Result = mArena.CreateBinary(Op, Operands[0], SimplifyNode(Operands[1]));
+      } else {
+        Result = SimplifyBinary(Op, SimplifyNode(Operands[0]), SimplifyNode(Operands[1]));
+      }
+      break;
+    }
+    case ExprKind::Call: {
+      const string Callee = mArena.getName(Index);
+      vector<ExprIndex> Arguments;
+      for (const ExprIndex Arg : Operands)
+        Arguments.push_back(SimplifyNode(Arg));
+      Result = mArena.CreateCall(Callee, Arguments);
+      break;
+    }
+    case ExprKind::If: {
+      const ExprIndex Cond = SimplifyNode(Operands[0]);
+      if (mArena.isNumber(Cond)) {
+        // the condition is true if it is ordered and not equal to 0.0
+        const double CondVal = mArena.getNumber(Cond);
+        Result = SimplifyNode((CondVal < 0.0 || CondVal > 0.0) ? Operands[1] : Operands[2]);
+        break;
+      }
+      const ExprIndex Then = SimplifyNode(Operands[1]);
+      const ExprIndex Else = SimplifyNode(Operands[2]);
+      if (Then == Else && IsPure(Cond))
+        Result = Then;
+      else
+        Result = mArena.CreateIf(Cond, Then, Else);
+      break;
+    }
+    case ExprKind::For: {
+      const string VarName = mArena.getName(Index);
+      const ExprIndex Step = Operands[2] == InvalidExpr ? InvalidExpr : SimplifyNode(Operands[2]);
+      Result = mArena.CreateFor(VarName, SimplifyNode(Operands[0]),
+                                SimplifyNode(Operands[1]), Step,
+                                SimplifyNode(Operands[3]));
+      break;
+    }
+  }
+  mSimplified.emplace(Index, Result);
+  return Result;
+}
+
+ExprIndex Simplifier::SimplifyBinary(BinaryOp Op, ExprIndex LHS, ExprIndex RHS) {
+  switch (Op) {
+    case BinaryOp::Add:
+      return SimplifyAdd(LHS, RHS);
+    case BinaryOp::Subtract:
+      return SimplifySubtract(LHS, RHS);
+    case BinaryOp::Multiply:
+      return SimplifyMultiply(LHS, RHS);
+    case BinaryOp::Divide:
+      return SimplifyDivide(LHS, RHS);
+    case BinaryOp::Power:
+      return SimplifyPower(LHS, RHS);
+    case BinaryOp::Less:
+      if (mArena.isNumber(LHS) && mArena.isNumber(RHS)) {
+        // same as FCmpULT: true if unordered or less than
+        const bool Less = !(mArena.getNumber(LHS) >= mArena.getNumber(RHS));
+        return mArena.CreateNumber(Less ? 1.0 : 0.0);
+      }
+      break;
+    default:
+      break;
+  }
+  return mArena.CreateBinary(Op, LHS, RHS);
+}
+
+ExprIndex Simplifier::SimplifyAdd(ExprIndex LHS, ExprIndex RHS) {
+  if (mArena.isNumber(LHS) && mArena.isNumber(RHS))
+    return mArena.CreateNumber(mArena.getNumber(LHS) + mArena.getNumber(RHS));
+  // x + (-0) is x, but -0 + 0 is 0
+  if (mFastMath ? IsConstant(LHS, 0.0) : IsZero(LHS, true))
+    return RHS;
+  if (mFastMath ? IsConstant(RHS, 0.0) : IsZero(RHS, true))
+    return LHS;
+  // constants go to the left
+  if (mArena.isNumber(RHS))
+    std::swap(LHS, RHS);
+  if (!mFastMath)
+    return mArena.CreateBinary(BinaryOp::Add, LHS, RHS);
+  ExprIndex Negated;
+  // x + (0 - y) = x - y
+  if (IsNegation(RHS, Negated))
+    return SimplifySubtract(LHS, Negated);
+  if (IsNegation(LHS, Negated))
+    return SimplifySubtract(RHS, Negated);
+  if (mArena.isNumber(LHS) && mArena.getKind(RHS) == ExprKind::Binary &&
+      mArena.isNumber(mArena.getOperand(RHS, 0))) {
+    const double C1 = mArena.getNumber(LHS);
+    const double C2 = mArena.getNumber(mArena.getOperand(RHS, 0));
+    const ExprIndex X = mArena.getOperand(RHS, 1);
+    // c1 + (c2 + x) = (c1 + c2) + x
+    if (mArena.getOperator(RHS) == BinaryOp::Add)
+      return SimplifyAdd(mArena.CreateNumber(C1 + C2), X);
+    // c1 + (c2 - x) = (c1 + c2) - x
+    if (mArena.getOperator(RHS) == BinaryOp::Subtract)
+      return SimplifySubtract(mArena.CreateNumber(C1 + C2), X);
+  }
+  // x + x = 2 * x
+  if (LHS == RHS && IsPure(LHS))
+    return SimplifyMultiply(mArena.CreateNumber(2.0), LHS);
+  return mArena.CreateBinary(BinaryOp::Add, LHS, RHS);
+}
+
+ExprIndex Simplifier::SimplifySubtract(ExprIndex LHS, ExprIndex RHS) {
+  if (mArena.isNumber(LHS) && mArena.isNumber(RHS))
+    return mArena.CreateNumber(mArena.getNumber(LHS) - mArena.getNumber(RHS));
+  // x - 0 is x, but -0 - (-0) is 0
+  if (mFastMath ? IsConstant(RHS, 0.0) : IsZero(RHS, false))
+    return LHS;
+  if (!mFastMath)
+    return mArena.CreateBinary(BinaryOp::Subtract, LHS, RHS);
+  // x - x is NaN for infinite x
+  if (LHS == RHS && IsPure(LHS))
+    return mArena.CreateNumber(0.0);
+  ExprIndex Negated;
+  // x - (0 - y) = x + y, which also turns 0 - (0 - y) into y
+  if (IsNegation(RHS, Negated))
+    return SimplifyAdd(LHS, Negated);
+  // x - c = (-c) + x, so that the constant can meet other constants
+  if (mArena.isNumber(RHS))
+    return SimplifyAdd(mArena.CreateNumber(-mArena.getNumber(RHS)), LHS);
+  if (mArena.isNumber(LHS) && mArena.getKind(RHS) == ExprKind::Binary &&
+      mArena.isNumber(mArena.getOperand(RHS, 0))) {
+    const double C1 = mArena.getNumber(LHS);
+    const double C2 = mArena.getNumber(mArena.getOperand(RHS, 0));
+    const ExprIndex X = mArena.getOperand(RHS, 1);
+    // c1 - (c2 + x) = (c1 - c2) - x
+    if (mArena.getOperator(RHS) == BinaryOp::Add)
+      return SimplifySubtract(mArena.CreateNumber(C1 - C2), X);
+    // c1 - (c2 - x) = (c1 - c2) + x
+    if (mArena.getOperator(RHS) == BinaryOp::Subtract)
+      return SimplifyAdd(mArena.CreateNumber(C1 - C2), X);
+  }
+  return mArena.CreateBinary(BinaryOp::Subtract, LHS, RHS);
+}
+
+ExprIndex Simplifier::SimplifyMultiply(ExprIndex LHS, ExprIndex RHS) {
+  if (mArena.isNumber(LHS) && mArena.isNumber(RHS))
+    return mArena.CreateNumber(mArena.getNumber(LHS) * mArena.getNumber(RHS));
+  if (IsConstant(LHS, 1.0))
+    return RHS;
+  if (IsConstant(RHS, 1.0))
+    return LHS;
+  // constants go to the left
+  if (mArena.isNumber(RHS))
+    std::swap(LHS, RHS);
+  if (!mFastMath)
+    return mArena.CreateBinary(BinaryOp::Multiply, LHS, RHS);
+  // 0 * x is NaN for infinite or NaN x, and -0 for negative x
+  if (IsConstant(LHS, 0.0) && IsPure(RHS))
+    return mArena.CreateNumber(0.0);
+  if (IsConstant(LHS, -1.0))
+    return Negate(RHS);
+  ExprIndex NegatedL, NegatedR;
+  const bool IsNegatedL = IsNegation(LHS, NegatedL);
+  const bool IsNegatedR = IsNegation(RHS, NegatedR);
+  // (0 - x) * (0 - y) = x * y
+  if (IsNegatedL && IsNegatedR)
+    return SimplifyMultiply(NegatedL, NegatedR);
+  // c * (0 - y) = (-c) * y
+  if (mArena.isNumber(LHS) && IsNegatedR)
+    return SimplifyMultiply(mArena.CreateNumber(-mArena.getNumber(LHS)), NegatedR);
+  // otherwise move the negation out of the product
+  if (IsNegatedL)
+    return Negate(SimplifyMultiply(NegatedL, RHS));
+  if (IsNegatedR)
+    return Negate(SimplifyMultiply(LHS, NegatedR));
+  // c1 * (c2 * x) = (c1 * c2) * x
+  if (mArena.isNumber(LHS) && mArena.getKind(RHS) == ExprKind::Binary &&
+      mArena.getOperator(RHS) == BinaryOp::Multiply &&
+      mArena.isNumber(mArena.getOperand(RHS, 0))) {
+    const double C2 = mArena.getNumber(mArena.getOperand(RHS, 0));
+    return SimplifyMultiply(mArena.CreateNumber(mArena.getNumber(LHS) * C2),
+                            mArena.getOperand(RHS, 1));
+  }
+  return mArena.CreateBinary(BinaryOp::Multiply, LHS, RHS);
+}
+
+ExprIndex Simplifier::SimplifyDivide(ExprIndex LHS, ExprIndex RHS) {
+  if (mArena.isNumber(LHS) && mArena.isNumber(RHS))
+    return mArena.CreateNumber(mArena.getNumber(LHS) / mArena.getNumber(RHS));
+  if (IsConstant(RHS, 1.0))
+    return LHS;
+  if (!mFastMath)
+    return mArena.CreateBinary(BinaryOp::Divide, LHS, RHS);
+  // 0 - x, unlike -x, is 0 for x = 0
+  if (IsConstant(RHS, -1.0))
+    return Negate(LHS);
+  if (IsConstant(LHS, 0.0) && IsPure(RHS))
+    return mArena.CreateNumber(0.0);
+  ExprIndex NegatedL, NegatedR;
+  const bool IsNegatedL = IsNegation(LHS, NegatedL);
+  const bool IsNegatedR = IsNegation(RHS, NegatedR);
+  if (IsNegatedL && IsNegatedR)
+    return SimplifyDivide(NegatedL, NegatedR);
+  if (IsNegatedL)
+    return Negate(SimplifyDivide(NegatedL, RHS));
+  if (IsNegatedR)
+    return Negate(SimplifyDivide(LHS, NegatedR));
+  return mArena.CreateBinary(BinaryOp::Divide, LHS, RHS);
+}
+
+ExprIndex Simplifier::SimplifyPower(ExprIndex LHS, ExprIndex RHS) {
+  // folded as codegen computes '^', not with pow: 2^3 is 2*2*2, (-2)^0.5
+  // is |sqrt(-2)|
+  if (mArena.isNumber(LHS) && mArena.isNumber(RHS))
+    return mArena.CreateNumber(
+        EvaluatePower(mArena.getNumber(LHS), mArena.getNumber(RHS), true, true));
+  if (IsConstant(RHS, 1.0))
+    return LHS;
+  if ((IsConstant(RHS, 0.0) && IsPure(LHS)) || (IsConstant(LHS, 1.0) && IsPure(RHS)))
+    return mArena.CreateNumber(1.0);
+  return mArena.CreateBinary(BinaryOp::Power, LHS, RHS);
+}
+
+bool Simplifier::IsConstant(ExprIndex Index, double Value) const {
+  return mArena.isNumber(Index) && mArena.getNumber(Index) == Value;
+}
+
+bool Simplifier::IsZero(ExprIndex Index, bool Negative) const {
+  return IsConstant(Index, 0.0) && std::signbit(mArena.getNumber(Index)) == Negative;
+}
+
+bool Simplifier::IsNegation(ExprIndex Index, ExprIndex& Negated) const {
+  if (mArena.getKind(Index) != ExprKind::Binary ||
+      mArena.getOperator(Index) != BinaryOp::Subtract ||
+      !IsConstant(mArena.getOperand(Index, 0), 0.0))
+    return false;
+  Negated = mArena.getOperand(Index, 1);
+  return true;
+}
+
+ExprIndex Simplifier::Negate(ExprIndex Index) {
+  return SimplifySubtract(mArena.CreateNumber(0.0), Index);
+}
+
+bool Simplifier::IsPure(ExprIndex Index) {
+  const auto Found = mPure.find(Index);
+  if (Found != mPure.end())
+    return Found->second;
+  bool Pure = true;
+  switch (mArena.getKind(Index)) {
+    case ExprKind::Number:
+    case ExprKind::Variable:
+      break;
+    case ExprKind::For:
+      // the body may assign to variables outside the loop
+      Pure = false;
+      break;
+    case ExprKind::Binary:
+      if (mArena.getOperator(Index) == BinaryOp::Assign) {
+        Pure = false;
+        break;
+      }
+      [[fallthrough]];
+    case ExprKind::Call:
+    case ExprKind::If: {
+      for (const ExprIndex Operand : mArena.getOperands(Index)) {
+        if (!IsPure(Operand)) {
+          Pure = false;
+          break;
+        }
+      }
+      break;
+    }
+  }
+  mPure.emplace(Index, Pure);
+  return Pure;
+}
@@ -0,0 +1,48 @@
+#ifndef SIMPLIFIER_H
+#define SIMPLIFIER_H
+
+#include <unordered_map>
+
+#include "AbstractSyntaxTree.h"
+
+/// Simplifier - Rule-based algebraic rewriting of the expressions in an
+/// ExprArena.  The rewritten expression is built from new (hash-consed)
+/// nodes; the original nodes are left untouched.  The rules are:
+///   - constant folding of operators and of if conditions,
+///   - dropping 1*x, x*1, x/1, x-0, x+(-0), x^1, x^0 and 1^x.
+/// These give the same result as the original expression for every input.
+/// With FastMath, which may assume there are no NaNs, infinities or signed
+/// zeros, and may reassociate, the rules also include
+///   - dropping 0*x, 0/x, x+0, 0+x and x-x,
+///   - folding negations (written as 0-x) into the surrounding operator,
+///   - collapsing nested constants, e.g. 2*(3*x) to 6*x, and x+x to 2*x.
+/// Constants are moved to the left of + and * so that nested constants meet.
+/// Operands with side effects ('=' or loops) are never dropped.
+class Simplifier {
+public:
+  explicit Simplifier(ExprArena& Arena, bool FastMath = false):
+    mArena(Arena), mFastMath(FastMath) {}
+  // Rewrite Root until no rule applies.
+  ExprIndex Simplify(ExprIndex Root);
+private:
+  ExprIndex SimplifyNode(ExprIndex Index);
+  ExprIndex SimplifyBinary(BinaryOp Op, ExprIndex LHS, ExprIndex RHS);
+  ExprIndex SimplifyAdd(ExprIndex LHS, ExprIndex RHS);
+  ExprIndex SimplifySubtract(ExprIndex LHS, ExprIndex RHS);
+  ExprIndex SimplifyMultiply(ExprIndex LHS, ExprIndex RHS);
+  ExprIndex SimplifyDivide(ExprIndex LHS, ExprIndex RHS);
+  ExprIndex SimplifyPower(ExprIndex LHS, ExprIndex RHS);
+  bool IsConstant(ExprIndex Index, double Value) const;
+  // Whether Index is the constant +0 (or -0 if Negative).
+  bool IsZero(ExprIndex Index, bool Negative) const;
+  // If Index is "0 - X", set Negated to X.
+  bool IsNegation(ExprIndex Index, ExprIndex& Negated) const;
+  bool IsPure(ExprIndex Index);
+  ExprIndex Negate(ExprIndex Index);
+  ExprArena& mArena;
+  const bool mFastMath;
+  std::unordered_map<ExprIndex, ExprIndex> mSimplified;
+  std::unordered_map<ExprIndex, bool> mPure;
+};
+
+#endif // SIMPLIFIER_H
@@ -0,0 +1,97 @@
+#include "ThreadPool.h"
+#include <algorithm>
+
+ThreadPool::ThreadPool(unsigned NumThreads) {
+  if (NumThreads == 0)
+    NumThreads = std::max(1u, std::thread::hardware_concurrency());
+  for (unsigned i = 0; i < NumThreads; ++i)
+    mQueues.push_back(std::make_unique<WorkQueue>());
+  // worker 0 is the thread calling ParallelFor
+  for (unsigned i = 1; i < NumThreads; ++i)
+    mWorkers.emplace_back(&ThreadPool::WorkerLoop, this, i);
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> Lock(mMutex);
+    mStop = true;
+  }
+  mWakeUp.notify_all();
+  for (auto& Worker : mWorkers)
+    Worker.join();
+}
+
+void ThreadPool::ParallelFor(size_t NumTasks,
+                             const std::function<void(size_t)>& Task) {
+  if (NumTasks == 0)
+    return;
+  const size_t NumQueues = mQueues.size();
+  {
+    std::lock_guard<std::mutex> Lock(mMutex);
+    mTask = &Task;
+    mRemaining = NumTasks;
+    // Neighbouring tasks usually touch neighbouring data, so each worker
+    // starts with a contiguous run of them.
+    for (size_t q = 0; q < NumQueues; ++q) {
+      std::lock_guard<std::mutex> QueueLock(mQueues[q]->mMutex);
+      for (size_t i = q * NumTasks / NumQueues; i < (q + 1) * NumTasks / NumQueues; ++i)
+        mQueues[q]->mTasks.push_back(i);
+    }
+    ++mGeneration;
+  }
+  mWakeUp.notify_all();
+  RunTasks(0);
+  // wait for the tasks other workers are still running
+  std::unique_lock<std::mutex> Lock(mMutex);
+  mDone.wait(Lock, [this] { return mRemaining == 0; });
+  mTask = nullptr;
+}
+
+void ThreadPool::WorkerLoop(unsigned Id) {
+  size_t Generation = 0;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> Lock(mMutex);
+      mWakeUp.wait(Lock, [&] { return mStop || mGeneration != Generation; });
+      if (mStop)
+        return;
+      Generation = mGeneration;
+    }
+    RunTasks(Id);
+  }
+}
+
+void ThreadPool::RunTasks(unsigned Id) {
+  size_t Task;
+  while (PopTask(Id, Task) || StealTask(Id, Task)) {
+    (*mTask)(Task);
+    if (--mRemaining == 0) {
+      std::lock_guard<std::mutex> Lock(mMutex);
+      mDone.notify_all();
+    }
+  }
+}
+
+bool ThreadPool::PopTask(unsigned Id, size_t& Task) {
+  WorkQueue& Queue = *mQueues[Id];
+  std::lock_guard<std::mutex> Lock(Queue.mMutex);
+  if (Queue.mTasks.empty())
+    return false;
+  Task = Queue.mTasks.front();
+  Queue.mTasks.pop_front();
+  return true;
+}
+
+bool ThreadPool::StealTask(unsigned Id, size_t& Task) {
+  // Steal from the back, away from where the owner is working.
+  for (size_t i = 1; i < mQueues.size(); ++i) {
+    WorkQueue& Queue = *mQueues[(Id + i) % mQueues.size()];
+    std::lock_guard<std::mutex> Lock(Queue.mMutex);
+    if (!Queue.mTasks.empty()) {
+      Task = Queue.mTasks.back();
+      Queue.mTasks.pop_back();
+      return true;
+    }
+  }
+  return false;
+}
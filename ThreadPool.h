@@ -0,0 +1,55 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// ThreadPool - A fixed set of workers running index-parallel loops with
+/// work stealing.  ParallelFor deals the task indices to the workers in
+/// contiguous runs; each worker takes tasks from the front of its own queue
+/// and, once that is empty, steals from the back of the others' queues, so
+/// uneven tasks still keep every worker busy.  The calling thread is worker
+/// 0, so a pool of one thread runs everything inline.
+class ThreadPool {
+public:
+  // NumThreads == 0 means one thread per hardware thread.
+  explicit ThreadPool(unsigned NumThreads = 0);
+  ~ThreadPool();
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+  unsigned getNumberOfThreads() const {
+    return mQueues.size();
+  }
+  // Run Task(i) for every i < NumTasks and wait for all of them.  Not
+  // reentrant: Task must not call ParallelFor on the same pool.
+  void ParallelFor(size_t NumTasks, const std::function<void(size_t)>& Task);
+private:
+  struct WorkQueue {
+    std::mutex mMutex;
+    std::deque<size_t> mTasks;
+  };
+  void WorkerLoop(unsigned Id);
+  // Run tasks until none is left in any queue.
+  void RunTasks(unsigned Id);
+  bool PopTask(unsigned Id, size_t& Task);
+  bool StealTask(unsigned Id, size_t& Task);
+  std::vector<std::unique_ptr<WorkQueue>> mQueues;
+  std::vector<std::thread> mWorkers;
+  const std::function<void(size_t)> *mTask = nullptr;
+  std::atomic<size_t> mRemaining{0};
+  // mGeneration counts the ParallelFor calls, which wake up the workers
+  std::mutex mMutex;
+  std::condition_variable mWakeUp;
+  std::condition_variable mDone;
+  size_t mGeneration = 0;
+  bool mStop = false;
+};
+
+#endif // THREADPOOL_H
@@ -0,0 +1,59 @@
+#include "TokenBuffer.h"
+
+#include <limits>
+
+void TokenBuffer::clear() {
+  mSource = string_view();
+  mTypes.clear();
+  mOffsets.clear();
+  mLengths.clear();
+  mPayloads.clear();
+  mNumbers.clear();
+}
+
+void TokenBuffer::Tokenize(Lexer& TheLexer) {
+  clear();
+  mSource = TheLexer.str();
+  if (mSource.size() > std::numeric_limits<uint32_t>::max()) {
+    std::cerr << "Input too large for a token buffer\n";
+    mSource = string_view();
+    // an empty buffer still ends with Eof
+    mTypes.push_back(Token::Eof);
+    mOffsets.push_back(0);
+    mLengths.push_back(0);
+    mPayloads.push_back(0);
+    return;
+  }
+  // a rough guess of one token per 4 characters saves most reallocations
+  const size_t Estimate = mSource.size() / 4 + 1;
+  mTypes.reserve(Estimate);
+  mOffsets.reserve(Estimate);
+  mLengths.reserve(Estimate);
+  mPayloads.reserve(Estimate);
+  while (true) {
+    const TokenSpan t = TheLexer.getToken();
+    uint32_t Payload = 0;
+    if (t.mType == Token::Number) {
+      Payload = mNumbers.size();
+      mNumbers.push_back(t.mNumber);
+    } else if (t.mType == Token::Operator) {
+      Payload = static_cast<uint32_t>(t.mOperator);
+    }
+    mTypes.push_back(t.mType);
+    mOffsets.push_back(t.mText.data() - mSource.data());
+    mLengths.push_back(t.mText.size());
+    mPayloads.push_back(Payload);
+    if (t.mType == Token::Eof) break;
+  }
+}
+
+double TokenBuffer::getNumber(size_t Index) const {
+  Index = Clamp(Index);
+  return mTypes[Index] == Token::Number ? mNumbers[mPayloads[Index]] : 0.0;
+}
+
+BinaryOp TokenBuffer::getOperator(size_t Index) const {
+  Index = Clamp(Index);
+  return mTypes[Index] == Token::Operator ? static_cast<BinaryOp>(mPayloads[Index])
+                                           : BinaryOp::None;
+}
@@ -0,0 +1,45 @@
+#ifndef TOKENBUFFER_H
+#define TOKENBUFFER_H
+
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+#include "Lexer.h"
+
+using std::string_view;
+using std::vector;
+
+/// TokenBuffer - The whole input tokenized up front and stored as parallel
+/// arrays (structure of arrays), which the parser walks by index.  Per token
+/// we keep the kind, the source offset and length, and a payload which is an
+/// index into mNumbers for numbers and the BinaryOp for operators.
+/// Identifier names are views into the source buffer, which must outlive the
+/// TokenBuffer.
+class TokenBuffer {
+public:
+  void Tokenize(Lexer& TheLexer);
+  void clear();
+  size_t size() const {return mTypes.size();}
+  // Indices past the end refer to the trailing Eof token.
+  Token getType(size_t Index) const {return mTypes[Clamp(Index)];}
+  uint32_t getOffset(size_t Index) const {return mOffsets[Clamp(Index)];}
+  string_view getText(size_t Index) const {
+    Index = Clamp(Index);
+    return mSource.substr(mOffsets[Index], mLengths[Index]);
+  }
+  double getNumber(size_t Index) const;
+  BinaryOp getOperator(size_t Index) const;
+private:
+  size_t Clamp(size_t Index) const {
+    return Index < mTypes.size() ? Index : mTypes.size() - 1;
+  }
+  string_view mSource;
+  vector<Token> mTypes;
+  vector<uint32_t> mOffsets;
+  vector<uint32_t> mLengths;
+  vector<uint32_t> mPayloads;
+  vector<double> mNumbers;
+};
+
+#endif // TOKENBUFFER_H
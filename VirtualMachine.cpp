@@ -0,0 +1,714 @@
+#include "VirtualMachine.h"
+#include "Driver.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iomanip>
+#include <limits>
+#include <optional>
+#include <set>
+#include <unordered_map>
+
+// Native functions of more arguments are left to the JIT.
+constexpr size_t MaxNativeArguments = 6;
+
+// Call the function at Address with the N doubles in Arguments.
+static double CallFunction(uint64_t Address, const double *Arguments, size_t N) {
+  const double *A = Arguments;
+  switch (N) {
+    case 0: return ((double (*)())(intptr_t)Address)();
+    case 1: return ((double (*)(double))(intptr_t)Address)(A[0]);
+    case 2: return ((double (*)(double, double))(intptr_t)Address)(A[0], A[1]);
+    case 3: return ((double (*)(double, double, double))(intptr_t)Address)(A[0], A[1], A[2]);
+    case 4:
+      return ((double (*)(double, double, double, double))(intptr_t)Address)(A[0], A[1], A[2], A[3]);
+    case 5:
+      return ((double (*)(double, double, double, double, double))(intptr_t)Address)(
+        A[0], A[1], A[2], A[3], A[4]);
+    default:
+      return ((double (*)(double, double, double, double, double, double))(intptr_t)Address)(
+        A[0], A[1], A[2], A[3], A[4], A[5]);
+  }
+}
+
+// unordered or less than, like the fcmp ult of codegen
+static double Less(double L, double R) {
+  return !(L >= R) ? 1.0 : 0.0;
+}
+
+// ordered and not equal to 0, like the fcmp one of codegen
+static bool IsNonZero(double Val) {
+  return Val < 0.0 || Val > 0.0;
+}
+
+/// VirtualMachine::Compiler - Compiles the body of one function.  Every
+/// value gets a register of its own, so a register that holds the value of
+/// a node can be reused for as long as codegen would reuse the value.  A
+/// variable is read in its register unless it is assigned with '=' in the
+/// function, in which case a read is a copy, like a load from the alloca.
+class VirtualMachine::Compiler {
+public:
+  Compiler(VirtualMachine& VM, const ExprArena& Arena, BytecodeFunction& F):
+    mVM(VM), mArena(Arena), mFunction(F) {}
+  bool CompileFunction(ExprIndex Body, const vector<string>& ArgumentNames);
+private:
+  /// Operand - The register holding a value, and the value itself if
+  /// codegen would have folded it to a constant.
+  struct Operand {
+    uint16_t mRegister;
+    bool mConstant;
+    double mValue;
+  };
+  using Result = std::optional<Operand>;
+  uint16_t NewRegister();
+  Operand Constant(double Val);
+  void Emit(Opcode Op, uint16_t A, uint16_t B = 0, uint16_t C = 0);
+  // The index of the next instruction, to jump to.
+  uint16_t getLabel() const {
+    return static_cast<uint16_t>(mFunction.mCode.size());
+  }
+  Operand EmitOperation(Opcode Op, Operand L, Operand R);
+  Operand EmitPower(Operand Base, Operand Exponent);
+  Result CompileNode(ExprIndex Index);
+  Result CompileVariable(ExprIndex Index);
+  Result CompileBinary(ExprIndex Index);
+  Result CompileCall(ExprIndex Index);
+  Result CompileIf(ExprIndex Index);
+  Result CompileFor(ExprIndex Index);
+  void ClearCache() {
+    mCache.clear();
+    mCacheLog.clear();
+  }
+  void RollbackCache(size_t Checkpoint) {
+    while (mCacheLog.size() > Checkpoint) {
+      mCache.erase(mCacheLog.back());
+      mCacheLog.pop_back();
+    }
+  }
+  VirtualMachine& mVM;
+  const ExprArena& mArena;
+  BytecodeFunction& mFunction;
+  map<string, uint16_t> mVariables;
+  // the variables assigned with '='
+  std::set<string> mAssigned;
+  std::unordered_map<ExprIndex, Operand> mCache;
+  vector<ExprIndex> mCacheLog;
+  // constant registers by the bits of their value
+  std::unordered_map<uint64_t, uint16_t> mConstants;
+  // set when the function needs more registers or instructions than the
+  // fields of an instruction can address
+  bool mTooLarge = false;
+};
+
+bool VirtualMachine::Compiler::CompileFunction(ExprIndex Body,
+                                               const vector<string>& ArgumentNames) {
+  mFunction.mNumArguments = static_cast<uint16_t>(ArgumentNames.size());
+  mFunction.mNumRegisters = 0;
+  mFunction.mConstants.clear();
+  mFunction.mCode.clear();
+  if (ArgumentNames.size() > std::numeric_limits<uint16_t>::max())
+    return false;
+  for (const string& Name : ArgumentNames)
+    mVariables[Name] = NewRegister();
+  for (const ExprIndex Index : mArena.CollectNodes(Body)) {
+    if (mArena.getKind(Index) == ExprKind::Binary &&
+        mArena.getOperator(Index) == BinaryOp::Assign &&
+        mArena.getKind(mArena.getOperand(Index, 0)) == ExprKind::Variable)
+      mAssigned.insert(mArena.getName(mArena.getOperand(Index, 0)));
+  }
+  const Result Value = CompileNode(Body);
+  if (!Value)
+    return false;
+  Emit(Opcode::Return, Value->mRegister);
+  return !mTooLarge;
+}
+
+uint16_t VirtualMachine::Compiler::NewRegister() {
+  if (mFunction.mNumRegisters == std::numeric_limits<uint16_t>::max()) {
+    mTooLarge = true;
+    return 0;
+  }
+  return mFunction.mNumRegisters++;
+}
+
+VirtualMachine::Compiler::Operand VirtualMachine::Compiler::Constant(double Val) {
+  uint64_t Bits;
+  std::memcpy(&Bits, &Val, sizeof(Bits));
+  const auto Found = mConstants.find(Bits);
+  if (Found != mConstants.end())
+    return {Found->second, true, Val};
+  const uint16_t Register = NewRegister();
+  mConstants.emplace(Bits, Register);
+  mFunction.mConstants.emplace_back(Register, Val);
+  return {Register, true, Val};
+}
+
+void VirtualMachine::Compiler::Emit(Opcode Op, uint16_t A, uint16_t B, uint16_t C) {
+  if (mFunction.mCode.size() == std::numeric_limits<uint16_t>::max()) {
+    mTooLarge = true;
+    return;
+  }
+  mFunction.mCode.push_back({Op, A, B, C});
+}
+
+VirtualMachine::Compiler::Operand
+VirtualMachine::Compiler::EmitOperation(Opcode Op, Operand L, Operand R) {
+  // IRBuilder folds the operations on constants
+  if (L.mConstant && R.mConstant) {
+    switch (Op) {
+      case Opcode::Add: return Constant(L.mValue + R.mValue);
+      case Opcode::Subtract: return Constant(L.mValue - R.mValue);
+      case Opcode::Multiply: return Constant(L.mValue * R.mValue);
+      case Opcode::Divide: return Constant(L.mValue / R.mValue);
+      case Opcode::Less: return Constant(Less(L.mValue, R.mValue));
+      default: break;
+    }
+  }
+  const uint16_t Register = NewRegister();
+  Emit(Op, Register, L.mRegister, R.mRegister);
+  return {Register, false, 0.0};
+}
+
+// Base^Exponent lowered like CreatePower.  A constant base and exponent are
+// folded as IRBuilder and the constant folder would fold the code.
+VirtualMachine::Compiler::Operand
+VirtualMachine::Compiler::EmitPower(Operand Base, Operand Exponent) {
+  if (Base.mConstant && Exponent.mConstant)
+    return Constant(EvaluatePower(Base.mValue, Exponent.mValue, true, true));
+  struct Lowering {
+    Compiler& mCompiler;
+    Operand mExponent;
+    Operand Constant(double Val) { return mCompiler.Constant(Val); }
+    Operand Multiply(Operand L, Operand R) {
+      return mCompiler.EmitOperation(Opcode::Multiply, L, R);
+    }
+    Operand Divide(Operand L, Operand R) {
+      return mCompiler.EmitOperation(Opcode::Divide, L, R);
+    }
+    Operand PowerInteger(Operand Base, int32_t) {
+      return Emit(Opcode::PowerInteger, Base.mRegister, mExponent.mRegister);
+    }
+    Operand SquareRoot(Operand Base) {
+      return Emit(Opcode::SquareRoot, Base.mRegister);
+    }
+    Operand Power(Operand Base, Operand Exponent) {
+      return mCompiler.EmitOperation(Opcode::Power, Base, Exponent);
+    }
+    Operand Emit(Opcode Op, uint16_t B, uint16_t C = 0) {
+      const uint16_t Register = mCompiler.NewRegister();
+      mCompiler.Emit(Op, Register, B, C);
+      return {Register, false, 0.0};
+    }
+  };
+  Lowering TheLowering{*this, Exponent};
+  return LowerPower(TheLowering, Base, Exponent,
+                    Exponent.mConstant ? std::optional<double>(Exponent.mValue)
+                                       : std::nullopt);
+}
+
+VirtualMachine::Compiler::Result VirtualMachine::Compiler::CompileNode(ExprIndex Index) {
+  const auto Found = mCache.find(Index);
+  if (Found != mCache.end())
+    return Found->second;
+  Result Value;
+  switch (mArena.getKind(Index)) {
+    case ExprKind::Number:
+      Value = Constant(mArena.getNumber(Index));
+      break;
+    case ExprKind::Variable:
+      Value = CompileVariable(Index);
+      break;
+    case ExprKind::Binary:
+      Value = CompileBinary(Index);
+      break;
+    case ExprKind::Call:
+      Value = CompileCall(Index);
+      break;
+    case ExprKind::If:
+      Value = CompileIf(Index);
+      break;
+    case ExprKind::For:
+      Value = CompileFor(Index);
+      break;
+  }
+  // '=' and loops are run every time, as in codegen
+  const bool HasSideEffects = mArena.getKind(Index) == ExprKind::For ||
+    (mArena.getKind(Index) == ExprKind::Binary &&
+     mArena.getOperator(Index) == BinaryOp::Assign);
+  if (Value && !HasSideEffects) {
+    mCache.emplace(Index, *Value);
+    mCacheLog.push_back(Index);
+  }
+  return Value;
+}
+
+VirtualMachine::Compiler::Result VirtualMachine::Compiler::CompileVariable(ExprIndex Index) {
+  const auto Found = mVariables.find(mArena.getName(Index));
+  if (Found == mVariables.end())
+    return std::nullopt;
+  if (!mAssigned.count(Found->first))
+    return Operand{Found->second, false, 0.0};
+  const uint16_t Register = NewRegister();
+  Emit(Opcode::Move, Register, Found->second);
+  return Operand{Register, false, 0.0};
+}
+
+VirtualMachine::Compiler::Result VirtualMachine::Compiler::CompileBinary(ExprIndex Index) {
+  const BinaryOp Op = mArena.getOperator(Index);
+  const ExprIndex LHS = mArena.getOperand(Index, 0);
+  const ExprIndex RHS = mArena.getOperand(Index, 1);
+  if (Op == BinaryOp::Assign) {
+    if (mArena.getKind(LHS) != ExprKind::Variable)
+      return std::nullopt;
+    const Result Value = CompileNode(RHS);
+    const auto Variable = mVariables.find(mArena.getName(LHS));
+    if (!Value || Variable == mVariables.end())
+      return std::nullopt;
+    Emit(Opcode::Move, Variable->second, Value->mRegister);
+    // the registers read from variables so far may be stale now
+    ClearCache();
+    return Value;
+  }
+  const Result L = CompileNode(LHS);
+  if (!L)
+    return std::nullopt;
+  const Result R = CompileNode(RHS);
+  if (!R)
+    return std::nullopt;
+  switch (Op) {
+    case BinaryOp::Add: return EmitOperation(Opcode::Add, *L, *R);
+    case BinaryOp::Subtract: return EmitOperation(Opcode::Subtract, *L, *R);
+    case BinaryOp::Multiply: return EmitOperation(Opcode::Multiply, *L, *R);
+    case BinaryOp::Divide: return EmitOperation(Opcode::Divide, *L, *R);
+    case BinaryOp::Power: return EmitPower(*L, *R);
+    case BinaryOp::Less: return EmitOperation(Opcode::Less, *L, *R);
+    default: return std::nullopt;
+  }
+}
+
+VirtualMachine::Compiler::Result VirtualMachine::Compiler::CompileCall(ExprIndex Index) {
+  const string& Callee = mArena.getName(Index);
+  const ArrayRef<ExprIndex> Operands = mArena.getOperands(Index);
+  // the definitions with bytecode first, then the native functions
+  Opcode Op = Opcode::Call;
+  uint16_t Target = 0;
+  const auto Function = mVM.mFunctionIndices.find(Callee);
+  if (Function != mVM.mFunctionIndices.end()) {
+    if (mVM.mFunctions[Function->second]->mNumArguments != Operands.size())
+      return std::nullopt;
+    Target = Function->second;
+  } else {
+    const auto Proto = mVM.mDriver.mFunctionProtos.find(Callee);
+    if (Proto == mVM.mDriver.mFunctionProtos.end() ||
+        Proto->second->getNumberOfArguments() != Operands.size() ||
+        Operands.size() > MaxNativeArguments)
+      return std::nullopt;
+    auto Native = mVM.mNativeIndices.find(Callee);
+    if (Native == mVM.mNativeIndices.end()) {
+      if (mVM.mNativeFunctions.size() == std::numeric_limits<uint16_t>::max())
+        return std::nullopt;
+      const auto NewIndex = static_cast<uint16_t>(mVM.mNativeFunctions.size());
+      mVM.mNativeFunctions.push_back({Callee, static_cast<uint16_t>(Operands.size())});
+      Native = mVM.mNativeIndices.emplace(Callee, NewIndex).first;
+    }
+    if (mVM.mNativeFunctions[Native->second].mNumArguments != Operands.size())
+      return std::nullopt;
+    Op = Opcode::CallNative;
+    Target = Native->second;
+  }
+  vector<Operand> Arguments;
+  for (const ExprIndex Arg : Operands) {
+    const Result Argument = CompileNode(Arg);
+    if (!Argument)
+      return std::nullopt;
+    Arguments.push_back(*Argument);
+  }
+  // the arguments are passed in consecutive registers
+  uint16_t First = 0;
+  for (size_t i = 0; i < Arguments.size(); ++i) {
+    const uint16_t Register = NewRegister();
+    if (i == 0)
+      First = Register;
+    Emit(Opcode::Move, Register, Arguments[i].mRegister);
+  }
+  const uint16_t Register = NewRegister();
+  Emit(Op, Register, Target, First);
+  return Operand{Register, false, 0.0};
+}
+
+VirtualMachine::Compiler::Result VirtualMachine::Compiler::CompileIf(ExprIndex Index) {
+  const Result Cond = CompileNode(mArena.getOperand(Index, 0));
+  if (!Cond)
+    return std::nullopt;
+  const ExprIndex Then = mArena.getOperand(Index, 1);
+  const ExprIndex Else = mArena.getOperand(Index, 2);
+  // codegen emits cheap arms as a select, which IRBuilder folds for a
+  // constant condition
+  if (Cond->mConstant && mArena.SpeculationCost(Then) + mArena.SpeculationCost(Else) <=
+                         mVM.mDriver.getSelectCost())
+    return CompileNode(IsNonZero(Cond->mValue) ? Then : Else);
+  const uint16_t Register = NewRegister();
+  const size_t ToElse = mFunction.mCode.size();
+  Emit(Opcode::JumpIfZero, Cond->mRegister);
+  // values computed in one branch are not there in the other one or after
+  const size_t CacheCheckpoint = mCacheLog.size();
+  const Result ThenValue = CompileNode(Then);
+  if (!ThenValue)
+    return std::nullopt;
+  Emit(Opcode::Move, Register, ThenValue->mRegister);
+  RollbackCache(CacheCheckpoint);
+  const size_t ToEnd = mFunction.mCode.size();
+  Emit(Opcode::Jump, 0);
+  if (!mTooLarge)
+    mFunction.mCode[ToElse].mB = getLabel();
+  const Result ElseValue = CompileNode(Else);
+  if (!ElseValue)
+    return std::nullopt;
+  Emit(Opcode::Move, Register, ElseValue->mRegister);
+  RollbackCache(CacheCheckpoint);
+  if (!mTooLarge)
+    mFunction.mCode[ToEnd].mB = getLabel();
+  return Operand{Register, false, 0.0};
+}
+
+// The loop of codegenFor: the body runs at least once, then the step and
+// the end condition are computed before the variable is incremented.
+VirtualMachine::Compiler::Result VirtualMachine::Compiler::CompileFor(ExprIndex Index) {
+  const string& VarName = mArena.getName(Index);
+  const ExprIndex Step = mArena.getOperand(Index, 2);
+  const Result Start = CompileNode(mArena.getOperand(Index, 0));
+  if (!Start)
+    return std::nullopt;
+  const uint16_t Variable = NewRegister();
+  Emit(Opcode::Move, Variable, Start->mRegister);
+  ClearCache();
+  const uint16_t Loop = getLabel();
+  // the loop variable shadows any variable of the same name
+  const auto Shadowed = mVariables.find(VarName);
+  const std::optional<uint16_t> OldVariable =
+    Shadowed != mVariables.end() ? std::optional<uint16_t>(Shadowed->second) : std::nullopt;
+  mVariables[VarName] = Variable;
+  if (!CompileNode(mArena.getOperand(Index, 3)))
+    return std::nullopt;
+  const Result StepValue = Step != InvalidExpr ? CompileNode(Step) : Constant(1.0);
+  if (!StepValue)
+    return std::nullopt;
+  const Result EndCond = CompileNode(mArena.getOperand(Index, 1));
+  if (!EndCond)
+    return std::nullopt;
+  Emit(Opcode::Add, Variable, Variable, StepValue->mRegister);
+  Emit(Opcode::JumpIfNonZero, EndCond->mRegister, Loop);
+  if (OldVariable)
+    mVariables[VarName] = *OldVariable;
+  else
+    mVariables.erase(VarName);
+  ClearCache();
+  // for expr always returns 0.0.
+  return Constant(0.0);
+}
+
+bool VirtualMachine::Evaluate(const ExprArena& Arena, ExprIndex Root, double& Result) {
+  // variables only exist in loops and definitions, which run as bytecode
+  for (const ExprIndex Index : Arena.CollectNodes(Root)) {
+    if (Arena.getKind(Index) == ExprKind::Variable || Arena.getKind(Index) == ExprKind::For)
+      return false;
+  }
+  EvaluatedValues Values;
+  EvaluatedValue Value;
+  if (!EvaluateNode(Arena, Root, Values, Value))
+    return false;
+  Result = Value.mValue;
+  return true;
+}
+
+bool VirtualMachine::EvaluateNode(const ExprArena& Arena, ExprIndex Index,
+                                  EvaluatedValues& Values, EvaluatedValue& Result) {
+  // the expression is pure, so a shared node has one value
+  const auto Found = Values.find(Index);
+  if (Found != Values.end()) {
+    Result = Found->second;
+    return true;
+  }
+  switch (Arena.getKind(Index)) {
+    case ExprKind::Number:
+      Result = {Arena.getNumber(Index), true};
+      break;
+    case ExprKind::Binary: {
+      const BinaryOp Op = Arena.getOperator(Index);
+      EvaluatedValue L, R;
+      if (Op == BinaryOp::Assign ||
+          !EvaluateNode(Arena, Arena.getOperand(Index, 0), Values, L) ||
+          !EvaluateNode(Arena, Arena.getOperand(Index, 1), Values, R))
+        return false;
+      // codegen folds the operations on constants
+      Result.mConstant = L.mConstant && R.mConstant;
+      switch (Op) {
+        case BinaryOp::Add: Result.mValue = L.mValue + R.mValue; break;
+        case BinaryOp::Subtract: Result.mValue = L.mValue - R.mValue; break;
+        case BinaryOp::Multiply: Result.mValue = L.mValue * R.mValue; break;
+        case BinaryOp::Divide: Result.mValue = L.mValue / R.mValue; break;
+        case BinaryOp::Less: Result.mValue = Less(L.mValue, R.mValue); break;
+        case BinaryOp::Power:
+          Result.mValue = EvaluatePower(L.mValue, R.mValue, L.mConstant, R.mConstant);
+          // x^0 is the constant 1
+          Result.mConstant = R.mConstant && (L.mConstant || R.mValue == 0.0);
+          break;
+        default: return false;
+      }
+      break;
+    }
+    case ExprKind::Call: {
+      const ArrayRef<ExprIndex> Operands = Arena.getOperands(Index);
+      vector<double> Arguments(Operands.size());
+      for (size_t i = 0; i < Operands.size(); ++i) {
+        EvaluatedValue Argument;
+        if (!EvaluateNode(Arena, Operands[i], Values, Argument))
+          return false;
+        Arguments[i] = Argument.mValue;
+      }
+      if (!EvaluateCall(Arena.getName(Index), Arguments.data(), Arguments.size(), Result.mValue))
+        return false;
+      Result.mConstant = false;
+      break;
+    }
+    case ExprKind::If: {
+      EvaluatedValue Cond;
+      if (!EvaluateNode(Arena, Arena.getOperand(Index, 0), Values, Cond))
+        return false;
+      const ExprIndex Then = Arena.getOperand(Index, 1);
+      const ExprIndex Else = Arena.getOperand(Index, 2);
+      if (!EvaluateNode(Arena, IsNonZero(Cond.mValue) ? Then : Else, Values, Result))
+        return false;
+      // only the select of cheap arms on a constant condition is folded
+      Result.mConstant = Result.mConstant && Cond.mConstant &&
+        Arena.SpeculationCost(Then) + Arena.SpeculationCost(Else) <= mDriver.getSelectCost();
+      break;
+    }
+    default:
+      return false;
+  }
+  Values[Index] = Result;
+  return true;
+}
+
+bool VirtualMachine::EvaluateCall(const string& Callee, const double *Arguments,
+                                  size_t N, double& Result) {
+  // the definitions with bytecode first, then the native functions
+  const auto Function = mFunctionIndices.find(Callee);
+  if (Function != mFunctionIndices.end()) {
+    BytecodeFunction& F = *mFunctions[Function->second];
+    if (F.mNumArguments != N)
+      return false;
+    if (const uint64_t Address = CountCall(F)) {
+      Result = CallFunction(Address, Arguments, N);
+      return true;
+    }
+    return Run(F, Arguments, Result);
+  }
+  const auto Proto = mDriver.mFunctionProtos.find(Callee);
+  if (Proto == mDriver.mFunctionProtos.end() ||
+      Proto->second->getNumberOfArguments() != N || N > MaxNativeArguments)
+    return false;
+  const uint64_t Address = mDriver.getFunctionAddress(Callee);
+  if (!Address)
+    return false;
+  Result = CallFunction(Address, Arguments, N);
+  return true;
+}
+
+uint64_t VirtualMachine::CountCall(BytecodeFunction& F) {
+  // a hot definition is worth compiling
+  if (!F.mAddress && F.mNumArguments <= MaxNativeArguments &&
+      ++F.mCalls == mDriver.getTierUpCalls())
+    F.mAddress = mDriver.getFunctionAddress(F.mName);
+  return F.mAddress;
+}
+
+bool VirtualMachine::Compile(const ExprArena& Arena, ExprIndex Body,
+                             const vector<string>& ArgumentNames,
+                             BytecodeFunction& F) {
+  Compiler C(*this, Arena, F);
+  return C.CompileFunction(Body, ArgumentNames);
+}
+
+bool VirtualMachine::AddFunction(const string& Name, const vector<string>& ArgumentNames,
+                                 const ExprArena& Arena, ExprIndex Body) {
+  // The index is reserved first, so that the body can call the function.
+  // The code compiled against another number of arguments keeps calling
+  // the old function, and the new one gets an index of its own.
+  auto Found = mFunctionIndices.find(Name);
+  if (Found != mFunctionIndices.end() &&
+      mFunctions[Found->second]->mNumArguments != ArgumentNames.size()) {
+    mFunctionIndices.erase(Found);
+    Found = mFunctionIndices.end();
+  }
+  if (Found == mFunctionIndices.end()) {
+    if (mFunctions.size() == std::numeric_limits<uint16_t>::max())
+      return false;
+    Found = mFunctionIndices.emplace(Name, static_cast<uint16_t>(mFunctions.size())).first;
+    mFunctions.push_back(make_unique<BytecodeFunction>());
+    mFunctions.back()->mName = Name;
+    mFunctions.back()->mNumArguments = static_cast<uint16_t>(ArgumentNames.size());
+  }
+  auto F = make_unique<BytecodeFunction>();
+  F->mName = Name;
+  if (!Compile(Arena, Body, ArgumentNames, *F)) {
+    RemoveFunction(Name);
+    return false;
+  }
+  mFunctions[Found->second] = move(F);
+  return true;
+}
+
+void VirtualMachine::RemoveFunction(const string& Name) {
+  // the code calling it keeps the index, so the function stays
+  mFunctionIndices.erase(Name);
+}
+
+void VirtualMachine::ForgetAddress(const string& Name) {
+  const auto Function = mFunctionIndices.find(Name);
+  if (Function != mFunctionIndices.end()) {
+    mFunctions[Function->second]->mCalls = 0;
+    mFunctions[Function->second]->mAddress = 0;
+  }
+  const auto Native = mNativeIndices.find(Name);
+  if (Native != mNativeIndices.end())
+    mNativeFunctions[Native->second].mAddress = 0;
+}
+
+void VirtualMachine::Enter(const BytecodeFunction& F, size_t Base, size_t Arguments) {
+  if (mRegisters.size() < Base + F.mNumRegisters)
+    mRegisters.resize(std::max(Base + F.mNumRegisters, 2 * mRegisters.size()));
+  double *R = mRegisters.data() + Base;
+  std::copy_n(mRegisters.data() + Arguments, F.mNumArguments, R);
+  for (const auto& [Register, Val] : F.mConstants)
+    R[Register] = Val;
+}
+
+bool VirtualMachine::Run(const BytecodeFunction& F, const double *Arguments,
+                         double& Result) {
+  // the arguments go in the registers of a frame before the entry frame
+  const size_t Base = F.mNumArguments;
+  if (mRegisters.size() < Base)
+    mRegisters.resize(Base);
+  std::copy_n(Arguments, F.mNumArguments, mRegisters.data());
+  Enter(F, Base, 0);
+  mFrames.clear();
+  const BytecodeFunction *Function = &F;
+  const Instruction *PC = F.mCode.data();
+  size_t FrameBase = Base;
+  double *R = mRegisters.data() + FrameBase;
+  for (;;) {
+    const Instruction I = *PC++;
+    switch (I.mOpcode) {
+      case Opcode::Move: R[I.mA] = R[I.mB]; break;
+      case Opcode::Add: R[I.mA] = R[I.mB] + R[I.mC]; break;
+      case Opcode::Subtract: R[I.mA] = R[I.mB] - R[I.mC]; break;
+      case Opcode::Multiply: R[I.mA] = R[I.mB] * R[I.mC]; break;
+      case Opcode::Divide: R[I.mA] = R[I.mB] / R[I.mC]; break;
+      case Opcode::Less: R[I.mA] = Less(R[I.mB], R[I.mC]); break;
+      case Opcode::Power: R[I.mA] = std::pow(R[I.mB], R[I.mC]); break;
+      case Opcode::PowerInteger:
+        R[I.mA] = EvaluatePowerInteger(R[I.mB], static_cast<int32_t>(R[I.mC]));
+        break;
+      case Opcode::SquareRoot: R[I.mA] = EvaluateSquareRoot(R[I.mB]); break;
+      case Opcode::Jump: PC = Function->mCode.data() + I.mB; break;
+      case Opcode::JumpIfZero:
+        if (!IsNonZero(R[I.mA]))
+          PC = Function->mCode.data() + I.mB;
+        break;
+      case Opcode::JumpIfNonZero:
+        if (IsNonZero(R[I.mA]))
+          PC = Function->mCode.data() + I.mB;
+        break;
+      case Opcode::Call: {
+        BytecodeFunction& Callee = *mFunctions[I.mB];
+        if (const uint64_t Address = CountCall(Callee)) {
+          R[I.mA] = CallFunction(Address, R + I.mC, Callee.mNumArguments);
+          break;
+        }
+        mFrames.push_back({Function, PC, FrameBase, I.mA});
+        const size_t CalleeBase = FrameBase + Function->mNumRegisters;
+        Enter(Callee, CalleeBase, FrameBase + I.mC);
+        Function = &Callee;
+        PC = Callee.mCode.data();
+        FrameBase = CalleeBase;
+        R = mRegisters.data() + FrameBase;
+        break;
+      }
+      case Opcode::CallNative: {
+        NativeFunction& Callee = mNativeFunctions[I.mB];
+        if (!Callee.mAddress)
+          Callee.mAddress = mDriver.getFunctionAddress(Callee.mName);
+        if (!Callee.mAddress)
+          return false;
+        R[I.mA] = CallFunction(Callee.mAddress, R + I.mC, Callee.mNumArguments);
+        break;
+      }
+      case Opcode::Return: {
+        const double Value = R[I.mA];
+        if (mFrames.empty()) {
+          Result = Value;
+          return true;
+        }
+        const Frame& Caller = mFrames.back();
+        Function = Caller.mFunction;
+        PC = Caller.mNext;
+        FrameBase = Caller.mBase;
+        R = mRegisters.data() + FrameBase;
+        R[Caller.mResult] = Value;
+        mFrames.pop_back();
+        break;
+      }
+    }
+  }
+}
+
+void VirtualMachine::Print(const BytecodeFunction& F, std::ostream& OS) const {
+  auto Reg = [](uint16_t Register) {
+    return "r" + std::to_string(Register);
+  };
+  auto Arguments = [&](uint16_t First, size_t N) {
+    string Result;
+    for (size_t i = 0; i < N; ++i)
+      Result += (i ? ", " : "") + Reg(static_cast<uint16_t>(First + i));
+    return Result;
+  };
+  for (const auto& [Register, Val] : F.mConstants)
+    OS << "      " << Reg(Register) << " = " << Val << "\n";
+  for (size_t i = 0; i < F.mCode.size(); ++i) {
+    const Instruction& I = F.mCode[i];
+    OS << "  " << std::setw(3) << i << ": ";
+    switch (I.mOpcode) {
+      case Opcode::Move: OS << Reg(I.mA) << " = " << Reg(I.mB); break;
+      case Opcode::Add: OS << Reg(I.mA) << " = " << Reg(I.mB) << " + " << Reg(I.mC); break;
+      case Opcode::Subtract: OS << Reg(I.mA) << " = " << Reg(I.mB) << " - " << Reg(I.mC); break;
+      case Opcode::Multiply: OS << Reg(I.mA) << " = " << Reg(I.mB) << " * " << Reg(I.mC); break;
+      case Opcode::Divide: OS << Reg(I.mA) << " = " << Reg(I.mB) << " / " << Reg(I.mC); break;
+      case Opcode::Less: OS << Reg(I.mA) << " = " << Reg(I.mB) << " < " << Reg(I.mC); break;
+      case Opcode::Power: OS << Reg(I.mA) << " = pow(" << Reg(I.mB) << ", " << Reg(I.mC) << ")"; break;
+      case Opcode::PowerInteger:
+        OS << Reg(I.mA) << " = powi(" << Reg(I.mB) << ", " << Reg(I.mC) << ")";
+        break;
+      case Opcode::SquareRoot: OS << Reg(I.mA) << " = " << Reg(I.mB) << " ^ 0.5"; break;
+      case Opcode::Jump: OS << "goto " << I.mB; break;
+      case Opcode::JumpIfZero: OS << "if " << Reg(I.mA) << " == 0 goto " << I.mB; break;
+      case Opcode::JumpIfNonZero: OS << "if " << Reg(I.mA) << " != 0 goto " << I.mB; break;
+      case Opcode::Call: {
+        const BytecodeFunction& Callee = *mFunctions[I.mB];
+        OS << Reg(I.mA) << " = " << Callee.mName << "("
+           << Arguments(I.mC, Callee.mNumArguments) << ")";
+        break;
+      }
+      case Opcode::CallNative: {
+        const NativeFunction& Callee = mNativeFunctions[I.mB];
+        OS << Reg(I.mA) << " = native " << Callee.mName << "("
+           << Arguments(I.mC, Callee.mNumArguments) << ")";
+        break;
+      }
+      case Opcode::Return: OS << "return " << Reg(I.mA); break;
+    }
+    OS << "\n";
+  }
+}
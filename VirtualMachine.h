@@ -0,0 +1,138 @@
+#ifndef VIRTUALMACHINE_H
+#define VIRTUALMACHINE_H
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "AbstractSyntaxTree.h"
+
+class Driver;
+
+/// Opcode - The instructions of the bytecode.  A, B and C are the fields of
+/// the instruction and rN is register N of the current frame.
+enum class Opcode : uint8_t {
+  Move,           // rA = rB
+  Add,            // rA = rB + rC
+  Subtract,       // rA = rB - rC
+  Multiply,       // rA = rB * rC
+  Divide,         // rA = rB / rC
+  Less,           // rA = 1 if rB < rC or they are unordered, else 0
+  Power,          // rA = pow(rB, rC)
+  PowerInteger,   // rA = rB^rC by repeated squaring, rC an int32 (llvm.powi)
+  SquareRoot,     // rA = rB^0.5, i.e. |sqrt(rB)|, or +inf for -inf
+  Jump,           // continue at instruction B
+  JumpIfZero,     // continue at instruction B if rA is 0 or NaN
+  JumpIfNonZero,  // continue at instruction B if rA is neither 0 nor NaN
+  Call,           // rA = function B of the VM on rC, rC+1...
+  CallNative,     // rA = native function B on rC, rC+1...
+  Return,         // return rA
+};
+
+/// Instruction - A bytecode instruction, 8 bytes.
+struct Instruction {
+  Opcode mOpcode;
+  uint16_t mA;
+  uint16_t mB;
+  uint16_t mC;
+};
+
+/// BytecodeFunction - A definition or an expression compiled to bytecode.
+/// The arguments are the first registers of its frame, and the constants
+/// are stored in their registers on entry; no instruction writes them.
+struct BytecodeFunction {
+  string mName;
+  uint16_t mNumArguments = 0;
+  uint16_t mNumRegisters = 0;
+  vector<std::pair<uint16_t, double>> mConstants;
+  vector<Instruction> mCode;
+  // calls so far, and the address of the native code once it is hot
+  uint64_t mCalls = 0;
+  uint64_t mAddress = 0;
+};
+
+/// VirtualMachine - A register machine running expressions and definitions
+/// without the JIT.  An expression is compiled to bytecode in one pass over
+/// its arena, which folds constants like IRBuilder, shares the value of a
+/// node like the value cache of codegen and lowers '^' like CreatePower, so
+/// that the results are those of the JIT in the strict floating-point mode,
+/// but for the sign of a NaN made from two NaNs.  The functions the VM has
+/// no bytecode for (the library, derivatives...) are called through their
+/// native code, and so is a definition once it has been called TierUpCalls
+/// times.  An expression without variables, '=' or loops is not even
+/// compiled: Evaluate walks its nodes, with the same results.
+class VirtualMachine {
+public:
+  explicit VirtualMachine(Driver& TheDriver): mDriver(TheDriver) {}
+  // Evaluate the expression at Root, made of numbers, arithmetic, ifs and
+  // calls, without compiling it.  False if it has variables, '=' or loops,
+  // or calls a function that cannot be called.
+  bool Evaluate(const ExprArena& Arena, ExprIndex Root, double& Result);
+  // Compile Body, whose arguments are ArgumentNames, into F.  False if it
+  // uses unknown names, calls a native function of more than 6 arguments
+  // or needs more than 65535 registers or instructions.
+  bool Compile(const ExprArena& Arena, ExprIndex Body,
+               const vector<string>& ArgumentNames, BytecodeFunction& F);
+  // Compile the definition Name, which the compiled code then calls as
+  // bytecode.  If it cannot be compiled, calls of Name go to the JIT.  A
+  // new number of arguments leaves the calls compiled so far to the old
+  // definition.
+  bool AddFunction(const string& Name, const vector<string>& ArgumentNames,
+                   const ExprArena& Arena, ExprIndex Body);
+  void RemoveFunction(const string& Name);
+  // Drop the address of Name, whose native code has been replaced.
+  void ForgetAddress(const string& Name);
+  // Run F on Arguments.  False if a native function cannot be found.
+  bool Run(const BytecodeFunction& F, const double *Arguments, double& Result);
+  // Print the bytecode of F, one instruction per line.
+  void Print(const BytecodeFunction& F, std::ostream& OS) const;
+private:
+  class Compiler;
+  /// NativeFunction - A function called through its native code, looked
+  /// up in the JIT on the first call.
+  struct NativeFunction {
+    string mName;
+    uint16_t mNumArguments;
+    uint64_t mAddress = 0;
+  };
+  /// Frame - The caller of the function being run.
+  struct Frame {
+    const BytecodeFunction *mFunction;
+    const Instruction *mNext;
+    size_t mBase;
+    uint16_t mResult;
+  };
+  /// EvaluatedValue - A value computed by Evaluate, and whether codegen
+  /// would have folded it to a constant.
+  struct EvaluatedValue {
+    double mValue;
+    bool mConstant;
+  };
+  using EvaluatedValues = std::unordered_map<ExprIndex, EvaluatedValue>;
+  bool EvaluateNode(const ExprArena& Arena, ExprIndex Index,
+                    EvaluatedValues& Values, EvaluatedValue& Result);
+  // Count a call of F: the address of its native code once it is hot, 0
+  // before.
+  uint64_t CountCall(BytecodeFunction& F);
+  // Call the function Callee as a call of the compiled code would.
+  bool EvaluateCall(const string& Callee, const double *Arguments, size_t N,
+                    double& Result);
+  // Make room for the frame of F at Base, with its constants and the
+  // arguments at Arguments in the registers.
+  void Enter(const BytecodeFunction& F, size_t Base, size_t Arguments);
+  Driver& mDriver;
+  vector<unique_ptr<BytecodeFunction>> mFunctions;
+  map<string, uint16_t> mFunctionIndices;
+  vector<NativeFunction> mNativeFunctions;
+  map<string, uint16_t> mNativeIndices;
+  // the registers of all frames, and the frames of the callers
+  vector<double> mRegisters;
+  vector<Frame> mFrames;
+};
+
+#endif // VIRTUALMACHINE_H
@@ -0,0 +1,119 @@
+#include "Lexer.h"
+
+#include <cctype>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <random>
+#include <string>
+#include <string_view>
+
+// Generate polynomial definitions like
+//   def p0(x) 1.25*x^0 + -3.5e-2*x^1 + ...
+// with NumCoefficients terms each, which is mostly numeric input.
+std::string generatePolynomials(size_t NumDefinitions, size_t NumCoefficients) {
+  std::mt19937_64 Rng(42);
+  std::uniform_real_distribution<double> Coefficient(-1000.0, 1000.0);
+  std::string Result;
+  for (size_t i = 0; i < NumDefinitions; ++i) {
+    Result += "def p" + std::to_string(i) + "(x) ";
+    for (size_t j = 0; j < NumCoefficients; ++j) {
+      if (j > 0) Result += " + ";
+      Result += std::to_string(Coefficient(Rng)) + "e-3*x^" + std::to_string(j);
+    }
+    Result += "\n";
+  }
+  return Result;
+}
+
+// The scanner before the character class table and from_chars: std::isspace
+// and friends, keywords in a std::map and numbers parsed with std::stod.
+class BaselineLexer {
+public:
+  explicit BaselineLexer(std::string_view Input): mInput(Input) {}
+  TokenSpan getToken() {
+    while (mPosition < mInput.size() && std::isspace(mInput[mPosition]))
+      ++mPosition;
+    if (mPosition >= mInput.size())
+      return TokenSpan{Token::Eof, mInput.substr(mInput.size())};
+    const size_t Start = mPosition;
+    const char c = mInput[mPosition];
+    if (std::isalpha(c) || c == '_') {
+      do {
+        ++mPosition;
+      } while (mPosition < mInput.size() &&
+               (std::isalnum(mInput[mPosition]) || mInput[mPosition] == '_'));
+      const std::string_view Result = mInput.substr(Start, mPosition - Start);
+      const auto Found = Keywords.find(Result);
+      return TokenSpan{Found != Keywords.end() ? Found->second : Token::Identifier, Result};
+    }
+    if (std::isdigit(c) || c == '.') {
+      int NumE = 0;
+      ++mPosition;
+      while (mPosition < mInput.size()) {
+        const char d = mInput[mPosition];
+        if (d == 'e' || d == 'E') {
+          ++NumE;
+        } else if (!std::isdigit(d) && d != '.' &&
+                   !(NumE == 1 && (d == '+' || d == '-'))) {
+          break;
+        }
+        ++mPosition;
+      }
+      const std::string_view Result = mInput.substr(Start, mPosition - Start);
+      return TokenSpan{Token::Number, Result, std::stod(std::string(Result))};
+    }
+    ++mPosition;
+    const BinaryOp Op = GetBinaryOp(c);
+    return TokenSpan{Op != BinaryOp::None ? Token::Operator : Token::Unknown,
+                     mInput.substr(Start, 1), 0.0, Op};
+  }
+private:
+  static const std::map<std::string, Token, std::less<>> Keywords;
+  std::string_view mInput;
+  size_t mPosition = 0;
+};
+
+const std::map<std::string, Token, std::less<>> BaselineLexer::Keywords = {
+  {"extern", Token::Extern}, {"def", Token::Definition}, {"if", Token::If},
+  {"then", Token::Then}, {"else", Token::Else}, {"for", Token::For},
+  {"in", Token::In}};
+
+// Lex Input Repeat times with LexerT and print the best time.
+template <typename LexerT>
+void Measure(const char* Name, const std::string& Input, int Repeat) {
+  double BestSeconds = 0;
+  size_t NumTokens = 0;
+  double Checksum = 0;
+  for (int r = 0; r < Repeat; ++r) {
+    LexerT l(Input);
+    NumTokens = 0;
+    Checksum = 0;
+    const auto Start = std::chrono::steady_clock::now();
+    for (auto t = l.getToken(); t.mType != Token::Eof; t = l.getToken()) {
+      if (t.mType == Token::Number) Checksum += t.mNumber;
+      ++NumTokens;
+    }
+    const std::chrono::duration<double> Elapsed =
+        std::chrono::steady_clock::now() - Start;
+    if (r == 0 || Elapsed.count() < BestSeconds) BestSeconds = Elapsed.count();
+  }
+  std::cout << Name << ": " << NumTokens << " tokens (checksum " << Checksum
+            << "), best of " << Repeat << ": " << BestSeconds * 1e3 << " ms, "
+            << NumTokens / BestSeconds / 1e6 << " Mtokens/s, "
+            << Input.size() / BestSeconds / (1024.0 * 1024.0) << " MiB/s\n";
+}
+
+int main(int argc, char* argv[]) {
+  const size_t NumDefinitions = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 100;
+  const size_t NumCoefficients = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 5000;
+  const int Repeat = argc > 3 ? std::atoi(argv[3]) : 5;
+  const std::string Input = generatePolynomials(NumDefinitions, NumCoefficients);
+  std::cout << "Input: " << NumDefinitions << " definitions x "
+            << NumCoefficients << " coefficients, "
+            << Input.size() / (1024.0 * 1024.0) << " MiB\n";
+  Measure<BaselineLexer>("before", Input, Repeat);
+  Measure<Lexer>("after ", Input, Repeat);
+  return 0;
+}
@@ -0,0 +1,57 @@
+#include "Driver.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Evaluate a three-argument formula over NumRows rows with 1, 2, 4, ...
+// threads up to the number of hardware threads, and check that every run
+// produces the same output as the single-threaded one.
+int main(int argc, char* argv[]) {
+  const size_t NumRows = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : (size_t(1) << 24);
+  const int Repeat = argc > 2 ? std::atoi(argv[2]) : 5;
+  const unsigned MaxThreads = argc > 3 ? std::atoi(argv[3])
+                                       : std::max(1u, std::thread::hardware_concurrency());
+  Parser p;
+  Driver d(p);
+  d.LoadLibraryFunctions();
+  d.RunSource("def f(x, y, z) (x*y + z) / (x + y*z) - x*x*z + 3*y");
+  std::vector<std::vector<double>> Data(3, std::vector<double>(NumRows));
+  for (size_t j = 0; j < Data.size(); ++j) {
+    for (size_t i = 0; i < NumRows; ++i)
+      Data[j][i] = j + 1.0 + (i % 4096) / 4096.0;
+  }
+  const double* Columns[] = {Data[0].data(), Data[1].data(), Data[2].data()};
+  std::vector<double> Reference(NumRows);
+  std::vector<double> Out(NumRows);
+  std::cout << "Rows: " << NumRows << ", best of " << Repeat << "\n";
+  double SingleThreadSeconds = 0;
+  for (unsigned NumThreads = 1; ; NumThreads = std::min(2 * NumThreads, MaxThreads)) {
+    d.setThreads(NumThreads);
+    double BestSeconds = 0;
+    for (int r = 0; r <= Repeat; ++r) {
+      const auto Start = std::chrono::steady_clock::now();
+      if (!d.EvaluateBatch("f", Columns, Out.data(), NumRows))
+        return 1;
+      const std::chrono::duration<double> Elapsed =
+          std::chrono::steady_clock::now() - Start;
+      // the first run includes compiling the kernel and starting the threads
+      if (r == 1 || (r > 1 && Elapsed.count() < BestSeconds)) BestSeconds = Elapsed.count();
+    }
+    if (NumThreads == 1) {
+      SingleThreadSeconds = BestSeconds;
+      Reference = Out;
+    }
+    std::cout << NumThreads << " threads: " << BestSeconds * 1e3 << " ms, "
+              << NumRows / BestSeconds / 1e6 << " Mrows/s, speedup "
+              << SingleThreadSeconds / BestSeconds
+              << (Out == Reference ? "" : " (OUTPUT DIFFERS)") << "\n";
+    if (NumThreads == MaxThreads)
+      break;
+  }
+  return 0;
+}
@@ -0,0 +1,57 @@
+#include "Driver.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Time an exp-heavy formula in batch kernels compiled with and without the
+// vector math library, on one thread, and compare their results.
+double timeKernel(bool VectorLibrary, const double* const* Columns,
+                  std::vector<double>& Out, int Repeat) {
+  Parser p;
+  Driver d(p);
+  d.LoadLibraryFunctions();
+  d.setVectorLibrary(VectorLibrary);
+  d.setThreads(1);
+  d.RunSource("def f(x, y) exp(0-x*x) * y + exp(x/y) - 0.5*exp(y)");
+  double BestSeconds = 0;
+  for (int r = 0; r <= Repeat; ++r) {
+    const auto Start = std::chrono::steady_clock::now();
+    if (!d.EvaluateBatch("f", Columns, Out.data(), Out.size()))
+      std::exit(1);
+    const std::chrono::duration<double> Elapsed =
+        std::chrono::steady_clock::now() - Start;
+    // the first run includes compiling the kernel
+    if (r == 1 || (r > 1 && Elapsed.count() < BestSeconds)) BestSeconds = Elapsed.count();
+  }
+  return BestSeconds;
+}
+
+int main(int argc, char* argv[]) {
+  const size_t NumRows = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : (size_t(1) << 22);
+  const int Repeat = argc > 2 ? std::atoi(argv[2]) : 5;
+  std::vector<double> X(NumRows), Y(NumRows);
+  for (size_t i = 0; i < NumRows; ++i) {
+    X[i] = -4.0 + 8.0 * (i % 8192) / 8192.0;
+    Y[i] = 1.0 + (i % 1024) / 1024.0;
+  }
+  const double* Columns[] = {X.data(), Y.data()};
+  std::vector<double> Scalar(NumRows), Vector(NumRows);
+  const double ScalarSeconds = timeKernel(false, Columns, Scalar, Repeat);
+  const double VectorSeconds = timeKernel(true, Columns, Vector, Repeat);
+  double MaxRelativeError = 0;
+  for (size_t i = 0; i < NumRows; ++i) {
+    const double Error = std::fabs(Vector[i] - Scalar[i]) / std::max(std::fabs(Scalar[i]), 1e-300);
+    MaxRelativeError = std::max(MaxRelativeError, Error);
+  }
+  std::cout << "Rows: " << NumRows << ", best of " << Repeat << "\n";
+  std::cout << "scalar libm: " << ScalarSeconds * 1e9 / NumRows << " ns/row\n";
+  std::cout << "libmvec:     " << VectorSeconds * 1e9 / NumRows << " ns/row, speedup "
+            << ScalarSeconds / VectorSeconds << "\n";
+  std::cout << "max relative difference: " << MaxRelativeError << "\n";
+  return 0;
+}
@@ -3,14 +3,90 @@
 #include "Version.h"
 #include "Driver.h"
 
-int main() {
+int main(int argc, char* argv[]) {
   std::string s;
 //   std::cin >> s;
 //   std::cout << "Input string: " << s << std::endl;
   Parser p(s);
-  Driver d(p);
+  // the target has to be known before the JIT is created
+  string CPU, Features;
+  for (int i = 1; i + 1 < argc; ++i) {
+    const string Arg = argv[i];
+    if (Arg == "--cpu") {
+      CPU = argv[i + 1];
+    } else if (Arg == "--features") {
+      Features = argv[i + 1];
+    }
+  }
+  Driver d(p, CPU, Features);
+  d.PrintTargetInfo();
   d.LoadLibraryFunctions();
-  d.MainLoop();
+  string FileName, OutputName;
+  bool Batch = false;
+  for (int i = 1; i < argc; ++i) {
+    const string Arg = argv[i];
+    if ((Arg == "--cpu" || Arg == "--features") && i + 1 < argc) {
+      ++i;
+    } else if (Arg == "--no-simplify") {
+      d.setSimplify(false);
+    } else if (Arg == "--egraph") {
+      d.setEGraph(true);
+    } else if (Arg == "--fp" && i + 1 < argc) {
+      FPMode Mode;
+      if (!ParseFPMode(argv[++i], Mode)) {
+        std::cerr << "Unknown floating-point mode " << argv[i] << "\n";
+        return 1;
+      }
+      d.setFPMode(Mode);
+    } else if (Arg == "--no-interpreter") {
+      d.setInterpret(false);
+    } else if (Arg == "--no-vector-library") {
+      d.setVectorLibrary(false);
+    } else if (Arg == "--select-cost" && i + 1 < argc) {
+      d.setSelectCost(std::stod(argv[++i]));
+    } else if (Arg == "--threads" && i + 1 < argc) {
+      d.setThreads(std::stoul(argv[++i]));
+    } else if (Arg.size() == 3 && Arg[0] == '-' && Arg[1] == 'O' &&
+               Arg[2] >= '0' && Arg[2] <= '3') {
+      d.setOptLevel(Arg[2] - '0');
+    } else if (Arg == "--time-passes") {
+      d.setTimePasses(true);
+    } else if (Arg == "--inline-definitions") {
+      d.setInlineDefinitions(true);
+    } else if (Arg == "--cache-dir" && i + 1 < argc) {
+      if (!d.setCacheDirectory(argv[++i]))
+        return 1;
+    } else if (Arg == "-o" && i + 1 < argc) {
+      OutputName = argv[++i];
+    } else if (Arg == "--batch") {
+      Batch = true;
+    } else if (Arg == "--single-module") {
+      d.setSingleModule(true);
+    } else if (Arg == "--tiered") {
+      d.setTiered(true);
+    } else if (Arg == "--tier-up-calls" && i + 1 < argc) {
+      d.setTierUpCalls(std::stoull(argv[++i]));
+    } else if (Arg.size() > 1 && Arg[0] == '-') {
+      std::cerr << "Unknown option " << Arg << "\n";
+      return 1;
+    } else {
+      FileName = Arg;
+    }
+  }
+  if (!OutputName.empty()) {
+    // compile the definitions of the script ahead of time
+    if (FileName.empty()) {
+      std::cerr << "-o needs a script file\n";
+      return 1;
+    }
+    d.RunFile(FileName);
+    return d.CompileDefinitions(OutputName, Batch) ? 0 : 1;
+  } else if (!FileName.empty()) {
+    // run a script file instead of the interactive loop
+    d.RunFile(FileName);
+  } else {
+    d.MainLoop();
+  }
 //   s = "(-5+2)*8";
 //   Lexer l;
 //   l.getAllToken(s);
@@ -0,0 +1,35 @@
+# Run SCRIPT with the calculator CALCULATOR in the mode given by the options
+# in MODE, and on the plain JIT path (no simplifier, no e-graph and no
+# interpreter), and fail if they print different values.  If SCRIPT.expected
+# exists, the plain JIT path must also print what it contains.  The sign of
+# a NaN is not compared: which NaN an operation on two NaNs returns depends
+# on the order the host compiler or the optimizer gives the operands.
+#
+#   cmake -DCALCULATOR=<main> -DSCRIPT=<script> "-DMODE=--egraph" -P CompareModes.cmake
+#
+# The tests are registered by add_mode_tests in CMakeLists.txt.
+
+separate_arguments(MODE_ARGS UNIX_COMMAND "${MODE}")
+
+function(run_calculator OUTPUT)
+  execute_process(COMMAND ${CALCULATOR} ${ARGN} ${SCRIPT}
+                  OUTPUT_VARIABLE Output ERROR_VARIABLE Errors
+                  RESULT_VARIABLE Result TIMEOUT 300)
+  if (NOT Result EQUAL 0)
+    message(FATAL_ERROR "${CALCULATOR} ${ARGN} ${SCRIPT} failed (${Result}):\n${Errors}")
+  endif()
+  string(REPLACE "-nan" "nan" Output "${Output}")
+  set(${OUTPUT} "${Output}" PARENT_SCOPE)
+endfunction()
+
+run_calculator(Reference --no-simplify --no-interpreter)
+if (EXISTS "${SCRIPT}.expected")
+  file(READ "${SCRIPT}.expected" Expected)
+  if (NOT Reference STREQUAL Expected)
+    message(FATAL_ERROR "The JIT output of ${SCRIPT} is\n${Reference}\nexpected\n${Expected}")
+  endif()
+endif()
+run_calculator(Output ${MODE_ARGS})
+if (NOT Output STREQUAL Reference)
+  message(FATAL_ERROR "With '${MODE}', ${SCRIPT} prints\n${Output}\ninstead of\n${Reference}")
+endif()